@@ -0,0 +1,135 @@
+// file BusStats.cpp - class for accounting the keybus time used by each type of operation
+
+// KeypadSerial computes the air time of each operation from the baud rate, framing and the
+// fixed delays it uses (see KeypadSerial.h) and adds it here.  Time is kept per op in a ring of
+// one second slots, so utilisation is always over the last BUS_WINDOW_SLOTS seconds.
+
+#include "BusStats.h"
+
+static const char opNames[NUM_BUS_OPS][BUS_OP_NAME_LEN+1] PROGMEM = { "poll", "f6", "resp", "ack", "f7" };
+
+// init the class
+void BusStats::init(void)
+{
+    memset(slot, 0, sizeof(slot));
+    for (uint8_t op=0; op < NUM_BUS_OPS; op++)
+    {
+        count[op] = 0;
+    }
+    cur = 0;
+    txnUs = 0;
+    merges = 0;
+    savedUs = 0;
+    pollLate = 0;
+    maxPollGap = 0;
+    slotStart = millis();
+}
+
+// copy name of op
+void BusStats::opName(uint8_t op, char * name)  // declared static
+{
+    strcpy_P(name, op < NUM_BUS_OPS ? opNames[op] : PSTR("?"));
+}
+
+// move the window forward to the current time, clearing slots that fall out of it
+void BusStats::roll(void)
+{
+    uint32_t ms = millis();
+
+    if (ms - slotStart >= (uint32_t)BUS_SLOT_MS * BUS_WINDOW_SLOTS)  // idle longer than the window
+    {
+        memset(slot, 0, sizeof(slot));
+        slotStart = ms;
+        return;
+    }
+
+    while (ms - slotStart >= BUS_SLOT_MS)
+    {
+        cur = (cur + 1) % BUS_WINDOW_SLOTS;
+        memset(slot[cur], 0, sizeof(slot[cur]));
+        slotStart += BUS_SLOT_MS;
+    }
+}
+
+// start of a new keybus transaction
+void BusStats::beginTxn(void)
+{
+    txnUs = 0;
+}
+
+// account us of keybus time to op
+void BusStats::add(uint8_t op, uint32_t us)
+{
+    if (op >= NUM_BUS_OPS)
+        return;
+
+    roll();
+    uint32_t t = slot[cur][op] + (us + BUS_TICK_US/2) / BUS_TICK_US;
+    slot[cur][op] = t > 0xFFFF ? 0xFFFF : t;
+    count[op]++;
+    txnUs += us;
+}
+
+// a write followed the previous one on the held low line, without its own preamble
+void BusStats::addMerge(uint32_t us)
+{
+    merges++;
+    savedUs += us;
+}
+
+// a poll started ms after the last one.  The scheduler holds F7 writes back so this stays under
+// deadline, a later poll is counted as a miss
+void BusStats::pollGap(uint32_t ms, uint32_t deadline)
+{
+    if (ms > maxPollGap)
+        maxPollGap = ms;
+    if (ms > deadline)
+        pollLate++;
+}
+
+// length of the window, full slots plus the part of the current slot (ms)
+uint32_t BusStats::windowMs(void)
+{
+    return (uint32_t)BUS_SLOT_MS * (BUS_WINDOW_SLOTS-1) + (millis() - slotStart);
+}
+
+// sum of op over the window (BUS_TICK_US units)
+uint32_t BusStats::sumTicks(uint8_t op)
+{
+    uint32_t sum = 0;
+    for (uint8_t i=0; i < BUS_WINDOW_SLOTS; i++)
+    {
+        sum += slot[i][op];
+    }
+    return sum;
+}
+
+// keybus utilisation of op over the window (permille)
+uint16_t BusStats::getUtil(uint8_t op)
+{
+    if (op >= NUM_BUS_OPS)
+        return 0;
+
+    roll();
+    return (sumTicks(op) * BUS_TICK_US) / windowMs();  // us / ms is permille
+}
+
+// keybus utilisation of all ops over the window (permille)
+uint16_t BusStats::getTotalUtil(void)
+{
+    roll();
+    uint32_t sum = 0;
+    for (uint8_t op=0; op < NUM_BUS_OPS; op++)
+    {
+        sum += sumTicks(op);
+    }
+    return (sum * BUS_TICK_US) / windowMs();
+}
+
+// gap to leave after the last transaction (ms).  Keypads get as long to settle as the transaction
+// took, between minGap (short transactions) and maxGap (long F7 writes)
+uint32_t BusStats::txGap(uint32_t minGap, uint32_t maxGap)
+{
+    uint32_t ms = (txnUs + 999) / 1000;
+    return ms < minGap ? minGap : (ms > maxGap ? maxGap : ms);
+}
@@ -0,0 +1,70 @@
+// file BusStats.h - class for accounting the keybus time used by each type of operation
+
+#pragma once
+
+#include <Arduino.h>
+
+#define BUS_WINDOW_SLOTS  (10)    // sliding window is this many slots
+#define BUS_SLOT_MS     (1000)    // length of one window slot (ms)
+#define BUS_TICK_US       (16)    // slot counters are in units of 16us (max ~1.05s per slot)
+#define BUS_OP_NAME_LEN    (4)    // max length of an op name
+
+// types of keybus operation
+enum {
+    BUS_POLL  = 0,  // poll keypads (long low + 3 clock pulses)
+    BUS_F6    = 1,  // F6 request for keypad data
+    BUS_RESP  = 2,  // keypad response to F6
+    BUS_ACK   = 3,  // ack of keypad response
+    BUS_F7    = 4,  // F7 display/status message
+    NUM_BUS_OPS
+};
+
+class BusStats
+{
+public:
+    BusStats(void) {}                        // Class constructor.  Returns: none
+
+    void     init(void);                     // init the class
+    void     beginTxn(void);                 // start of a new keybus transaction (poll, request or write)
+    void     add(uint8_t op, uint32_t us);   // account us of keybus time to op
+    void     addMerge(uint32_t savedUs);     // a write shared the preamble of the one before it
+    void     pollGap(uint32_t ms, uint32_t deadline);  // a poll started ms after the last one
+    uint16_t getUtil(uint8_t op);            // keybus utilisation of op over the window (permille)
+    uint16_t getTotalUtil(void);             // keybus utilisation of all ops over the window (permille)
+    uint32_t txGap(uint32_t minGap, uint32_t maxGap);  // gap needed after the last transaction (ms)
+
+    // return number of op performed since init
+    uint32_t getCount(uint8_t op)            { return op < NUM_BUS_OPS ? count[op] : 0; }
+
+    // return number of writes merged into the previous transaction since init
+    uint32_t getMerges(void)                 { return merges; }
+
+    // return keybus time saved by merged writes per poll cycle (us)
+    uint32_t getSavedPerPoll(void)           { return count[BUS_POLL] ? savedUs / count[BUS_POLL] : 0; }
+
+    // return number of polls that started later than their deadline
+    uint32_t getPollLate(void)               { return pollLate; }
+
+    // return longest time between polls since init (ms)
+    uint32_t getMaxPollGap(void)             { return maxPollGap; }
+
+    // return keybus time of the last transaction (us)
+    uint32_t getTxnUs(void)                  { return txnUs; }
+
+    static void opName(uint8_t op, char * name);  // copy name of op (BUS_OP_NAME_LEN+1 bytes)
+
+private:
+    uint16_t slot[BUS_WINDOW_SLOTS][NUM_BUS_OPS];  // keybus time per op per slot (BUS_TICK_US units)
+    uint32_t count[NUM_BUS_OPS];  // count of each op
+    uint32_t slotStart;           // millis() at start of current slot
+    uint32_t txnUs;               // keybus time of the current/last transaction
+    uint32_t merges;              // writes merged into the previous transaction
+    uint32_t savedUs;             // preamble time saved by merged writes (us)
+    uint32_t pollLate;            // polls that missed their deadline
+    uint32_t maxPollGap;          // longest time between polls (ms)
+    uint8_t  cur;                 // current slot
+
+    void     roll(void);
+    uint32_t windowMs(void);
+    uint32_t sumTicks(uint8_t op);
+};
@@ -0,0 +1,96 @@
+// file Config.cpp - class for the runtime tunable timing configuration
+
+// These were compile time constants in USB2keybus.ino.  They can now be read and set over USB with
+// the CFG commands, and are kept in the EEPROM snapshot so a site's tuning survives a reset.  Each
+// set is checked against the range in the table, values out of range are rejected.  gapshort is
+// the lower bound of the gap after a transmit and gap the upper one, so a set that would leave
+// gapshort above gap is rejected too.
+//
+// gapshort defaults to the 50ms gap the keybus has always used after every transmit.  Air-time
+// accounting can shorten the gap after polls and requests, but shorter gaps have not been checked
+// against real keypads, so a site lowers it with CFG gapshort= once captures show they cope.
+
+#include "Config.h"
+#include "KeyWindow.h"
+
+static const t_CfgParam cfgParams[NUM_CFG] PROGMEM = {
+    //  name         default            min      max
+    { "poll",          330,              100,    5000 },
+    { "f7",           4000,             1000,   30000 },
+    { "keepalive",   12000,             1000,   60000 },
+    { "volt",         1000,              100,   60000 },
+    { "gap",            50,               10,     500 },
+    { "gapshort",       50,                5,     500 },
+    { "readdelay",      40,                0,    1000 },
+    { "retx",  KEY_RETX_MS,               50,   10000 },
+    { "retries", KEY_MAX_RETRIES,          0,      20 },
+    { "eesave",      60000,            10000,   65000 },
+    { "pollmax",      1000,              500,   10000 },
+};
+
+// init the class, all parameters to defaults
+void Config::init(void)
+{
+    for (uint8_t p=0; p < NUM_CFG; p++)
+    {
+        val[p] = pgm_read_word(&cfgParams[p].def);
+    }
+}
+
+// copy name, default and range of parameter p
+void Config::getParam(uint8_t p, t_CfgParam * pParam)  // declared static
+{
+    memcpy_P(pParam, &cfgParams[p < NUM_CFG ? p : 0], sizeof(t_CfgParam));
+}
+
+// true if v is in the range of parameter p
+static bool inRange(uint8_t p, uint16_t v)
+{
+    return p < NUM_CFG && v >= pgm_read_word(&cfgParams[p].min) && v <= pgm_read_word(&cfgParams[p].max);
+}
+
+// set parameter p. Returns: false if p or val out of range, or gapshort would be above gap
+bool Config::set(uint8_t p, uint16_t v)
+{
+    if (!inRange(p, v) ||
+        (p == CFG_MIN_TX_GAP && v < val[CFG_MIN_TX_GAP_SHORT]) ||
+        (p == CFG_MIN_TX_GAP_SHORT && v > val[CFG_MIN_TX_GAP]))
+    {
+        return false;
+    }
+    val[p] = v;
+    return true;
+}
+
+// set all parameters from v[NUM_CFG], a value out of range keeps the current one.  Not done with
+// set() one at a time, the order would matter when gap and gapshort both change.  If gapshort
+// ends up above gap both go back to their defaults
+void Config::load(const uint16_t * v)
+{
+    for (uint8_t p=0; p < NUM_CFG; p++)
+    {
+        if (inRange(p, v[p]))
+        {
+            val[p] = v[p];
+        }
+    }
+    if (val[CFG_MIN_TX_GAP_SHORT] > val[CFG_MIN_TX_GAP])
+    {
+        val[CFG_MIN_TX_GAP] = pgm_read_word(&cfgParams[CFG_MIN_TX_GAP].def);
+        val[CFG_MIN_TX_GAP_SHORT] = pgm_read_word(&cfgParams[CFG_MIN_TX_GAP_SHORT].def);
+    }
+}
+
+// find parameter by name (len chars, not terminated). Returns: NUM_CFG if not found
+uint8_t Config::find(const char * name, uint8_t len)  // declared static
+{
+    for (uint8_t p=0; p < NUM_CFG; p++)
+    {
+        if (len <= CFG_NAME_LEN && strncmp_P(name, cfgParams[p].name, len) == 0 &&
+            pgm_read_byte(&cfgParams[p].name[len]) == '\0')
+        {
+            return p;
+        }
+    }
+    return NUM_CFG;
+}
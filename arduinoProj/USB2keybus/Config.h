@@ -0,0 +1,50 @@
+// file Config.h - class for the runtime tunable timing configuration
+
+#pragma once
+
+#include <Arduino.h>
+
+#define CFG_NAME_LEN  (9)   // max length of a parameter name
+
+// tunable parameters, see cfgParams[] in Config.cpp for names, defaults and ranges
+enum {
+    CFG_POLL_PERIOD      = 0,  // how often to poll keypad (ms)
+    CFG_F7_PERIOD        = 1,  // how often to send F7 when pages rotate or tone is on (ms)
+    CFG_F7_KEEPALIVE     = 2,  // how often to resend an unchanged F7 (ms)
+    CFG_VOLT_PERIOD      = 3,  // min time between voltage rail msgs (ms)
+    CFG_MIN_TX_GAP       = 4,  // gap after long transmits to keypads (F7), ms
+    CFG_MIN_TX_GAP_SHORT = 5,  // gap after short transmits (poll, request), ms
+    CFG_READ_KEY_DELAY   = 6,  // delay between keypad poll response and keypad read (ms)
+    CFG_KEY_RETX         = 7,  // reliable mode retransmit time (ms)
+    CFG_KEY_RETRIES      = 8,  // reliable mode retransmits before a report is dropped
+    CFG_EE_SAVE_PERIOD   = 9,  // min time between EEPROM snapshots (ms)
+    CFG_POLL_MAX         = 10, // max time between keypad polls, even with changed F7s waiting (ms)
+    NUM_CFG
+};
+
+// name, default and range of a parameter
+typedef struct {
+    char     name[CFG_NAME_LEN+1];
+    uint16_t def;
+    uint16_t min;
+    uint16_t max;
+} t_CfgParam;
+
+class Config
+{
+public:
+    Config(void) {}                          // Class constructor.  Returns: none
+
+    void     init(void);                     // init the class, all parameters to defaults
+    bool     set(uint8_t p, uint16_t val);   // set parameter p. Returns: false if out of range, or gapshort above gap
+    void     load(const uint16_t * v);       // set all parameters, from an EEPROM snapshot
+
+    // return value of parameter p
+    uint16_t get(uint8_t p)                  { return p < NUM_CFG ? val[p] : 0; }
+
+    static void    getParam(uint8_t p, t_CfgParam * pParam);  // copy name, default and range of p
+    static uint8_t find(const char * name, uint8_t len);      // find parameter by name. Returns: NUM_CFG if not found
+
+private:
+    uint16_t val[NUM_CFG];
+};
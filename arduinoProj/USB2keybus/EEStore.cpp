@@ -0,0 +1,126 @@
+// file EEStore.cpp - class for a wear-levelled record in EEPROM
+
+// The store is a ring of EE_SLOT_SIZE slots.  Each save goes to the slot after the newest record
+// with the next sequence number, so writes are spread over every slot (EEPROM cells are good for
+// ~100k writes).  At init every slot is checked and the valid record with the highest sequence
+// number is the current one.
+//
+// A byte write to EEPROM takes ~3.4ms, so a record is written one byte per call to service() when
+// the EEPROM is ready, instead of stalling the loop for the whole record.  The data goes first and
+// the header (with the CRC) last, so a reset part way through a write leaves a slot that fails its
+// CRC and the previous record is still used.  eeprom_update_byte() skips bytes that don't change.
+
+#include "EEStore.h"
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+// init the class, find the newest valid record
+void EEStore::init(void)
+{
+    numSlots = (EE_STORE_END - EE_STORE_ADDR) / EE_SLOT_SIZE;
+    valid = false;
+    slot = 0;
+    seq = 0;
+    saves = 0;
+    wrIdx = wrLen = 0;
+
+    for (uint8_t s=0; s < numSlots; s++)
+    {
+        t_EeHeader hdr;
+        eeprom_read_block(&hdr, (const void *)slotAddr(s), sizeof(hdr));
+
+        if (hdr.len <= EE_MAX_DATA && hdr.crc == slotCrc(s, &hdr) &&
+            (!valid || (int16_t)(hdr.seq - seq) > 0))
+        {
+            valid = true;
+            slot = s;
+            seq = hdr.seq;
+        }
+    }
+}
+
+// CRC16 of the header fields and the data of slot s as stored in EEPROM
+uint16_t EEStore::slotCrc(uint8_t s, const t_EeHeader * pHdr)
+{
+    uint16_t crc = 0xFFFF;
+    crc = _crc16_update(crc, pHdr->seq & 0xFF);
+    crc = _crc16_update(crc, pHdr->seq >> 8);
+    crc = _crc16_update(crc, pHdr->len);
+
+    const uint8_t * p = (const uint8_t *)(slotAddr(s) + sizeof(t_EeHeader));
+    for (uint8_t i=0; i < pHdr->len; i++)
+    {
+        crc = _crc16_update(crc, eeprom_read_byte(p + i));
+    }
+    return crc;
+}
+
+// copy the newest record to data.  Returns: false if there is none, or it is not len bytes long
+bool EEStore::load(void * data, uint8_t len)
+{
+    t_EeHeader hdr;
+
+    if (!valid)
+    {
+        return false;
+    }
+    eeprom_read_block(&hdr, (const void *)slotAddr(slot), sizeof(hdr));
+    if (hdr.len != len)
+    {
+        return false;  // layout of the data changed, don't use the old record
+    }
+    eeprom_read_block(data, (const void *)(slotAddr(slot) + sizeof(hdr)), len);
+    return true;
+}
+
+// start writing a record with len bytes of data to the next slot.  Returns: false if busy or too long
+bool EEStore::save(const void * data, uint8_t len)
+{
+    if (isBusy() || len > EE_MAX_DATA)
+    {
+        return false;
+    }
+
+    t_EeHeader * pHdr = (t_EeHeader *)img;
+    pHdr->seq = valid ? seq + 1 : 0;
+    pHdr->len = len;
+    memcpy(img + sizeof(t_EeHeader), data, len);
+
+    uint16_t crc = 0xFFFF;
+    crc = _crc16_update(crc, pHdr->seq & 0xFF);
+    crc = _crc16_update(crc, pHdr->seq >> 8);
+    crc = _crc16_update(crc, len);
+    for (uint8_t i=0; i < len; i++)
+    {
+        crc = _crc16_update(crc, img[sizeof(t_EeHeader) + i]);
+    }
+    pHdr->crc = crc;
+
+    wrSlot = valid ? (slot + 1) % numSlots : 0;
+    wrLen = sizeof(t_EeHeader) + len;
+    wrIdx = 0;
+    return true;
+}
+
+// write the next byte of a pending record if the EEPROM is ready, call every loop
+void EEStore::service(void)
+{
+    if (!isBusy() || !eeprom_is_ready())
+    {
+        return;
+    }
+
+    // data bytes first, then the header
+    uint8_t dataLen = wrLen - sizeof(t_EeHeader);
+    uint8_t i = wrIdx < dataLen ? sizeof(t_EeHeader) + wrIdx : wrIdx - dataLen;
+    eeprom_update_byte((uint8_t *)(slotAddr(wrSlot) + i), img[i]);
+
+    if (++wrIdx >= wrLen)  // record complete
+    {
+        t_EeHeader * pHdr = (t_EeHeader *)img;
+        valid = true;
+        slot = wrSlot;
+        seq = pHdr->seq;
+        saves++;
+    }
+}
@@ -0,0 +1,58 @@
+// file EEStore.h - class for a wear-levelled record in EEPROM
+
+#pragma once
+
+#include <Arduino.h>
+
+#define EE_STORE_ADDR   (32)            // first byte of the store, below is the KeybusTiming record
+#define EE_STORE_END    (E2END + 1)     // store runs to the end of EEPROM
+#define EE_SLOT_SIZE   (160)            // bytes per slot, a record is header + data
+
+// header at the start of each slot, written after the data so a partly written slot fails its CRC
+typedef struct {
+    uint16_t seq;   // record sequence number, newest valid record wins
+    uint8_t  len;   // data length
+    uint16_t crc;   // CRC16 of seq, len and data
+} t_EeHeader;
+
+#define EE_MAX_DATA (EE_SLOT_SIZE - sizeof(t_EeHeader))
+
+class EEStore
+{
+public:
+    EEStore(void) {}                         // Class constructor.  Returns: none
+
+    void init(void);                         // init the class, find the newest valid record
+    bool load(void * data, uint8_t len);     // copy the newest record. Returns: false if none of length len
+    bool save(const void * data, uint8_t len); // start writing a record to the next slot. Returns: false if busy
+    void service(void);                      // write the next byte of a pending record, call every loop
+
+    // return true while a record is being written
+    bool     isBusy(void)                    { return wrIdx < wrLen; }
+
+    // return number of slots in the store
+    uint8_t  getNumSlots(void)               { return numSlots; }
+
+    // return slot of the newest valid record
+    uint8_t  getSlot(void)                   { return slot; }
+
+    // return sequence number of the newest valid record
+    uint16_t getSeq(void)                    { return seq; }
+
+    // return number of records saved since init
+    uint16_t getSaves(void)                  { return saves; }
+
+private:
+    uint8_t  img[EE_SLOT_SIZE];  // image of the slot being written
+    uint16_t seq;        // sequence number of newest record
+    uint16_t saves;      // records written since init
+    uint8_t  numSlots;
+    uint8_t  slot;       // slot of newest record
+    uint8_t  wrSlot;     // slot being written
+    uint8_t  wrIdx;      // next byte of img to write
+    uint8_t  wrLen;      // bytes of img to write
+    bool     valid;      // store holds a valid record
+
+    uint16_t slotCrc(uint8_t s, const t_EeHeader * pHdr);
+    uint16_t slotAddr(uint8_t s)             { return EE_STORE_ADDR + (uint16_t)s * EE_SLOT_SIZE; }
+};
@@ -0,0 +1,81 @@
+// file Idle.cpp - class for sleeping the processor while the main loop has nothing to do
+
+// At the end of a loop pass, the loop works out how long until the scheduler has something to do
+// (next poll, F7, keypad read or the end of the tx gap) and calls sleepFor().  The processor goes
+// into SLEEP_MODE_IDLE, which stops the cpu clock but keeps timers, UARTs, the ADC and pin change
+// interrupts running.  Any interrupt wakes it within a few cycles and runs its ISR as usual, so
+// the keybus recv ISR and millis()/micros() keep full accuracy.  Keybus transmits are busy-wait
+// delays inside a loop pass and never overlap a sleep.
+//
+// Timer0 (millis) wakes the processor every ~1ms and the ADC every ~104us, so after each wake the
+// wake check is run and the processor sleeps again if nothing arrived.  The check and the sleep run
+// with interrupts off up to the sei/sleep pair, so a USB byte can't slip in between them.
+
+#include "Idle.h"
+#include <avr/sleep.h>
+
+// init the class, idle sleep on
+void Idle::init(void)
+{
+    setEnabled(true);
+}
+
+// turn idle sleep on/off, clears the stats
+void Idle::setEnabled(bool on)
+{
+    enabled = on;
+    clear();
+}
+
+// clear the collected stats
+void Idle::clear(void)
+{
+    sleeps = wakes = 0;
+    idleMs = 0;
+    idleUs = 0;
+    clearMs = millis();
+}
+
+// sleep up to ms (ISRs still run), or until pWake() returns true
+void Idle::sleepFor(uint32_t ms, bool (*pWake)(void))
+{
+    if (!enabled || ms == 0)
+    {
+        return;
+    }
+
+    uint32_t start = micros();
+    uint32_t limit = (ms < IDLE_MAX_MS ? ms : IDLE_MAX_MS) * 1000;
+
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleeps++;
+    while (micros() - start < limit)
+    {
+        cli();
+        if (pWake())
+        {
+            sei();
+            break;
+        }
+        sleep_enable();
+        sei();          // sleep_cpu runs before any pending ISR, so no wake is lost
+        sleep_cpu();
+        sleep_disable();
+        wakes++;
+    }
+
+    uint32_t us = micros() - start + idleUs;
+    idleMs += us / 1000;
+    idleUs = us % 1000;
+}
+
+// time spent asleep since clear (permille)
+uint16_t Idle::getFraction(void)
+{
+    uint32_t elapsed = millis() - clearMs;
+    if (elapsed == 0)
+    {
+        return 0;
+    }
+    return elapsed < 4000000UL ? idleMs * 1000 / elapsed : idleMs / (elapsed / 1000);  // avoid overflow
+}
@@ -0,0 +1,31 @@
+// file Idle.h - class for sleeping the processor while the main loop has nothing to do
+
+#pragma once
+
+#include <Arduino.h>
+
+#define IDLE_MAX_MS  (4)   // max sleep per loop pass, keeps the loop stats and watchdog budget meaningful
+
+class Idle
+{
+public:
+    Idle(void) {}                            // Class constructor.  Returns: none
+
+    void init(void);                         // init the class, idle sleep on
+    void setEnabled(bool on);                // turn idle sleep on/off, clears the stats
+    void sleepFor(uint32_t ms, bool (*pWake)(void));  // sleep up to ms, or until pWake() returns true
+    void clear(void);                        // clear the collected stats
+
+    bool     isEnabled(void)                 { return enabled; }
+    uint32_t getSleeps(void)                 { return sleeps; }
+    uint32_t getWakes(void)                  { return wakes; }
+    uint16_t getFraction(void);              // time spent asleep since clear (permille)
+
+private:
+    bool     enabled;
+    uint32_t sleeps;     // loop passes that slept
+    uint32_t wakes;      // interrupts that woke the processor
+    uint32_t idleMs;     // time asleep since clear (ms part)
+    uint16_t idleUs;     // time asleep since clear (us part, < 1000)
+    uint32_t clearMs;    // millis() at clear
+};
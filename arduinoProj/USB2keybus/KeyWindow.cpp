@@ -0,0 +1,105 @@
+// file KeyWindow.cpp - retransmit window for reliable delivery of key reports over USB
+
+// In reliable mode every key report stays in the window until the host sends ACK <seq>.  Acks are
+// cumulative, so one ack clears every report up to seq.  Unacked reports are resent (same line,
+// same q= sequence number, so the host can drop duplicates) every retx ms (KEY_RETX_MS by default,
+// set with CFG retx=<ms>), oldest first.
+// With reliable mode off nothing is stored and reports are sent once, as before.
+
+#include "KeyWindow.h"
+
+// init the class
+void KeyWindow::init(void)
+{
+    head = count = 0;
+    enabled = false;
+    added = acked = retx = dropped = expired = 0;
+    setRetx(KEY_RETX_MS, KEY_MAX_RETRIES);
+}
+
+// set retransmit time and max retransmits per report
+void KeyWindow::setRetx(uint16_t ms, uint8_t max)
+{
+    retxMs = ms;
+    maxRetries = max;
+}
+
+// turn reliable mode on/off
+void KeyWindow::setEnabled(bool on)
+{
+    enabled = on;
+    head = count = 0;
+}
+
+// remove the oldest report from the window
+void KeyWindow::pop(void)
+{
+    head = (head + 1) % KEY_WINDOW_SIZE;
+    count--;
+}
+
+// add a report that was just sent
+void KeyWindow::add(uint16_t seq, uint32_t time, uint8_t addr, uint8_t type, uint8_t len, const uint8_t * pData)
+{
+    if (!enabled)
+        return;
+
+    if (count >= KEY_WINDOW_SIZE)  // window full, oldest report is lost
+    {
+        pop();
+        dropped++;
+    }
+
+    t_KeyEvent * e = &win[(head + count) % KEY_WINDOW_SIZE];
+    e->seq = seq;
+    e->time = time;
+    e->sentMs = millis();
+    e->addr = addr;
+    e->type = type;
+    e->len = len < KEY_EVENT_MAX_DATA ? len : KEY_EVENT_MAX_DATA;
+    e->retries = 0;
+    memcpy(e->data, pData, e->len);
+
+    count++;
+    added++;
+}
+
+// host acked all reports up to and including seq
+void KeyWindow::ack(uint16_t seq)
+{
+    while (count && (int16_t)(win[head].seq - seq) <= 0)  // seq wraps, compare as signed difference
+    {
+        pop();
+        acked++;
+    }
+}
+
+// return the oldest report that is due for retransmit and mark it resent, NULL if none
+t_KeyEvent * KeyWindow::due(uint32_t ms)
+{
+    while (count)
+    {
+        t_KeyEvent * e = &win[head];
+
+        if (e->retries >= maxRetries && ms - e->sentMs > retxMs)  // give up on this report
+        {
+            pop();
+            expired++;
+            continue;
+        }
+
+        for (uint8_t i=0; i < count; i++)
+        {
+            e = &win[(head + i) % KEY_WINDOW_SIZE];
+            if (e->retries < maxRetries && ms - e->sentMs > retxMs)
+            {
+                e->sentMs = ms;
+                e->retries++;
+                retx++;
+                return e;
+            }
+        }
+        break;
+    }
+    return NULL;
+}
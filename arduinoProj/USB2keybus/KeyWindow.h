@@ -0,0 +1,59 @@
+// file KeyWindow.h - retransmit window for reliable delivery of key reports over USB
+
+#pragma once
+
+#include <Arduino.h>
+#include "KeypadSerial.h"
+
+#define KEY_WINDOW_SIZE     (8)    // max unacknowledged key reports held for retransmit
+#define KEY_EVENT_MAX_DATA (KP_SERIAL_READ_BUF_SIZE)  // whole keypad mesg, so a retransmit is the same line
+#define KEY_RETX_MS       (500)    // retransmit a report if not acked within this time (ms)
+#define KEY_MAX_RETRIES     (5)    // give up on a report after this many retransmits
+
+typedef struct {
+    uint16_t seq;                      // sequence number of report (q=)
+    uint32_t time;                     // millis() when keypad response was decoded (t=)
+    uint32_t sentMs;                   // millis() of last transmit
+    uint8_t  addr;                     // keypad address
+    uint8_t  type;                     // mesg type
+    uint8_t  len;                      // number of data bytes
+    uint8_t  retries;                  // number of retransmits so far
+    uint8_t  data[KEY_EVENT_MAX_DATA]; // keys or raw mesg bytes
+} t_KeyEvent;
+
+class KeyWindow
+{
+public:
+    KeyWindow(void) {}                       // Class constructor.  Returns: none
+
+    void init(void);                         // init the class, reliable mode off
+    void setEnabled(bool on);                // turn reliable mode on/off (off drops pending reports)
+    void setRetx(uint16_t ms, uint8_t max);  // set retransmit time and max retransmits per report
+    void add(uint16_t seq, uint32_t time, uint8_t addr, uint8_t type, uint8_t len, const uint8_t * pData);
+    void ack(uint16_t seq);                  // host acked all reports up to and including seq
+    t_KeyEvent * due(uint32_t ms);           // next report due for retransmit, NULL if none
+
+    bool     isEnabled(void)                 { return enabled; }
+    uint8_t  getPending(void)                { return count; }
+    uint16_t getAdded(void)                  { return added; }
+    uint16_t getAcked(void)                  { return acked; }
+    uint16_t getRetx(void)                   { return retx; }
+    uint16_t getDropped(void)                { return dropped; }
+    uint16_t getExpired(void)                { return expired; }
+
+private:
+    t_KeyEvent win[KEY_WINDOW_SIZE];  // ring of unacked reports, oldest at head
+    uint8_t  head;
+    uint8_t  count;
+    bool     enabled;
+    uint16_t retxMs;     // retransmit a report if not acked within this time (ms)
+    uint8_t  maxRetries; // give up on a report after this many retransmits
+
+    uint16_t added;     // reports added to window
+    uint16_t acked;     // reports acked by host
+    uint16_t retx;      // retransmits
+    uint16_t dropped;   // reports pushed out of a full window before ack
+    uint16_t expired;   // reports dropped after KEY_MAX_RETRIES
+
+    void     pop(void);
+};
@@ -0,0 +1,246 @@
+// file KeybusTiming.cpp - class for the tunable keybus delays, their calibration and EEPROM storage
+
+// The keybus delays in KeypadSerial were measured by hand with generous margins.  Calibration walks
+// each delay down from its default one step at a time.  A step is accepted once keypads have answered
+// KT_CONFIRM transactions at that value, and calibration of the delay stops at the first failure (or
+// at its floor).  The tuned value is then set KT_MARGIN_STEPS above the lowest value that worked.
+//
+// Keypads only answer a poll when they have data, so calibration moves forward as keys are pressed.
+//   poll delays (low, clock high, gap) - a trial poll that gets a partial answer (some clocks but not
+//     all) fails.  A trial poll with no answer is followed by a poll at the value in use.  If that
+//     poll is answered, the keypads had data and ignored the trial poll, so the trial fails.
+//   write preamble - a trial F6 request must get a valid response.  Keypads answered the poll just
+//     before, so they have data.  Acks always use the default preamble, because a lost ack can't be
+//     detected and would repeat the keys.  F7 writes do too, they get no reply at all, so nothing
+//     shows whether the keypads took an F7 behind a tuned preamble.
+//
+// Tuned values are saved to EEPROM with a CRC and loaded at init.  A bad record or an out of range
+// value loads the defaults.  If KT_MAX_ERRORS polls in a row get partial answers with tuned values,
+// the defaults come back and the saved record is erased.
+
+#include "KeybusTiming.h"
+#include "KeypadSerial.h"
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+// default (hand measured), floor and step of each delay (us)
+static const uint16_t ktDefault[NUM_KT] = { KP_POLL_LOW_MS * 1000U, KP_BYTE_US, KP_POLL_GAP_US, KP_LOW_BEFORE_WRITE_US };
+static const uint16_t ktFloor[NUM_KT]   = { 10500, 9 * KP_BIT_US, 2 * KP_BIT_US, KP_POLL_GAP_US };  // poll low must stay > 10ms
+static const uint16_t ktStep[NUM_KT]    = { 500, KP_BIT_US / 4, KP_BIT_US / 4, KP_BIT_US };
+
+static const char stateNames[][KT_NAME_LEN+1] PROGMEM = { "idle", "run", "done", "fail" };
+static const char paramNames[NUM_KT][KT_NAME_LEN+1] PROGMEM = { "poll", "byte", "gap", "pre" };
+
+// init the class, load tuned values from EEPROM if valid
+void KeybusTiming::init(void)
+{
+    state = CAL_IDLE;
+    calParam = NUM_KT;
+    trialActive = false;
+    probe = false;
+    errors = 0;
+
+    if (!load())
+    {
+        for (uint8_t d=0; d < NUM_KT; d++)
+        {
+            val[d] = ktDefault[d];
+        }
+    }
+}
+
+// copy name of calibration state
+void KeybusTiming::stateName(uint8_t s, char * name)  // declared static
+{
+    strcpy_P(name, s <= CAL_FAIL ? stateNames[s] : PSTR("?"));
+}
+
+// copy name of delay
+void KeybusTiming::paramName(uint8_t d, char * name)  // declared static
+{
+    strcpy_P(name, d < NUM_KT ? paramNames[d] : PSTR("-"));
+}
+
+// start calibration from the defaults
+void KeybusTiming::startCal(void)
+{
+    for (uint8_t d=0; d < NUM_KT; d++)
+    {
+        val[d] = ktDefault[d];
+    }
+    state = CAL_RUN;
+    calParam = 0;
+    good = val[0];
+    trial = good - ktStep[0];
+    confirms = 0;
+    errors = 0;
+    trialActive = false;
+    probe = false;
+}
+
+// go back to defaults and erase the saved values, a calibration run in progress is dropped
+void KeybusTiming::useDefaults(void)
+{
+    for (uint8_t d=0; d < NUM_KT; d++)
+    {
+        val[d] = ktDefault[d];
+    }
+    state = CAL_IDLE;  // the caller sets CAL_FAIL after this when tuned values failed
+    calParam = NUM_KT;
+    trialActive = false;
+    probe = false;
+    errors = 0;
+    eeprom_update_word((uint16_t *)(KT_EE_ADDR + offsetof(t_KtRecord, magic)), 0xFFFF);
+}
+
+// call before each poll
+void KeybusTiming::pollStart(void)
+{
+    trialActive = state == CAL_RUN && calParam < KT_PRE && !probe;
+}
+
+// call after each poll with the count of clocks keypads answered (0 none, 3 all)
+void KeybusTiming::pollDone(uint8_t clocks)
+{
+    if (trialActive)
+    {
+        trialActive = false;
+        if (clocks == 3)
+        {
+            nextTrial(true);
+        }
+        else if (clocks > 0)
+        {
+            nextTrial(false);  // keypads started to answer but lost the clock
+        }
+        else
+        {
+            probe = true;      // no answer, find out if the keypads had data
+        }
+    }
+    else if (probe)
+    {
+        probe = false;
+        if (clocks == 3)
+        {
+            nextTrial(false);  // keypads had data but ignored the trial poll
+        }
+    }
+    else if (state != CAL_RUN)
+    {
+        // partial answers with tuned values, fall back to the defaults
+        errors = (clocks > 0 && clocks < 3) ? errors + 1 : 0;
+        if (errors >= KT_MAX_ERRORS && state != CAL_FAIL && getSavedUs() > 0)
+        {
+            useDefaults();
+            state = CAL_FAIL;
+        }
+    }
+}
+
+// call before each F6 request that has its own preamble
+void KeybusTiming::readStart(void)
+{
+    trialActive = state == CAL_RUN && calParam == KT_PRE;
+}
+
+// call after each F6 request, ok if keypad responded
+void KeybusTiming::readDone(bool ok)
+{
+    if (trialActive)
+    {
+        trialActive = false;
+        nextTrial(ok);
+    }
+}
+
+// record the result of a transaction at the trial value
+void KeybusTiming::nextTrial(bool ok)
+{
+    if (!ok)
+    {
+        finishParam();
+    }
+    else if (++confirms >= KT_CONFIRM)
+    {
+        good = trial;
+        confirms = 0;
+        if (trial < ktFloor[calParam] + ktStep[calParam])
+        {
+            finishParam();
+        }
+        else
+        {
+            trial -= ktStep[calParam];
+        }
+    }
+}
+
+// set the tuned value of calParam and move on to the next delay
+void KeybusTiming::finishParam(void)
+{
+    uint16_t v = good + KT_MARGIN_STEPS * ktStep[calParam];
+    val[calParam] = v < ktDefault[calParam] ? v : ktDefault[calParam];
+
+    if (++calParam >= NUM_KT)
+    {
+        state = CAL_DONE;
+        save();
+        return;
+    }
+    good = val[calParam];
+    trial = good - ktStep[calParam];
+    confirms = 0;
+    probe = false;
+}
+
+// keybus time saved per poll cycle (one poll and one F6 request) vs the defaults (us)
+uint32_t KeybusTiming::getSavedUs(void)
+{
+    uint32_t def = ktDefault[KT_POLL_LOW] + 3UL * (ktDefault[KT_BYTE] + ktDefault[KT_GAP]) + ktDefault[KT_PRE];
+    uint32_t cur = val[KT_POLL_LOW] + 3UL * (val[KT_BYTE] + val[KT_GAP]) + val[KT_PRE];
+    return def > cur ? def - cur : 0;
+}
+
+// CRC16 of the delay values
+uint16_t KeybusTiming::crc(const uint16_t * v)
+{
+    uint16_t c = 0xFFFF;
+    const uint8_t * p = (const uint8_t *)v;
+    for (uint8_t i=0; i < NUM_KT * sizeof(uint16_t); i++)
+    {
+        c = _crc16_update(c, p[i]);
+    }
+    return c;
+}
+
+// save the delays in use to EEPROM
+void KeybusTiming::save(void)
+{
+    t_KtRecord rec;
+    rec.magic = KT_MAGIC;
+    memcpy(rec.val, val, sizeof(rec.val));
+    rec.crc = crc(rec.val);
+    eeprom_update_block(&rec, (void *)KT_EE_ADDR, sizeof(rec));
+}
+
+// load saved delays from EEPROM.  Return: true if the record is valid and every value in range
+bool KeybusTiming::load(void)
+{
+    t_KtRecord rec;
+    eeprom_read_block(&rec, (const void *)KT_EE_ADDR, sizeof(rec));
+
+    if (rec.magic != KT_MAGIC || rec.crc != crc(rec.val))
+    {
+        return false;
+    }
+    for (uint8_t d=0; d < NUM_KT; d++)
+    {
+        if (rec.val[d] < ktFloor[d] || rec.val[d] > ktDefault[d])
+        {
+            return false;
+        }
+    }
+    memcpy(val, rec.val, sizeof(val));
+    return true;
+}
@@ -0,0 +1,82 @@
+// file KeybusTiming.h - class for the tunable keybus delays, their calibration and EEPROM storage
+
+#pragma once
+
+#include <Arduino.h>
+
+#define KT_EE_ADDR        (0)       // EEPROM address of the saved timing record
+#define KT_MAGIC     (0x4B54)       // 'KT', marks a saved timing record
+#define KT_CONFIRM        (3)       // keypad responses needed to accept a trial value
+#define KT_MARGIN_STEPS   (2)       // tuned value is this many steps above the lowest value that worked
+#define KT_MAX_ERRORS     (3)       // partial poll responses in a row before falling back to defaults
+#define KT_NAME_LEN       (4)       // max length of a state or delay name
+
+// tunable keybus delays (all in us)
+enum {
+    KT_POLL_LOW = 0,  // transmit held low to start a poll
+    KT_BYTE     = 1,  // high time of each poll clock
+    KT_GAP      = 2,  // low time between poll clocks
+    KT_PRE      = 3,  // transmit low before an F6 request (F7s and acks keep the default)
+    NUM_KT
+};
+
+// calibration states
+enum {
+    CAL_IDLE = 0,  // using defaults or values loaded from EEPROM
+    CAL_RUN  = 1,  // calibrating, needs keypad activity (key presses) to make progress
+    CAL_DONE = 2,  // calibration finished, tuned values saved to EEPROM
+    CAL_FAIL = 3   // tuned values caused errors, back on defaults
+};
+
+// timing record saved in EEPROM
+typedef struct {
+    uint16_t magic;
+    uint16_t val[NUM_KT];
+    uint16_t crc;
+} t_KtRecord;
+
+class KeybusTiming
+{
+public:
+    KeybusTiming(void) {}                    // Class constructor.  Returns: none
+
+    void     init(void);                     // init the class, load tuned values from EEPROM if valid
+    void     startCal(void);                 // start calibration from the defaults
+    void     useDefaults(void);              // go back to defaults and erase the saved values
+
+    void     pollStart(void);                // call before each poll
+    void     pollDone(uint8_t clocks);       // call after each poll with count of clocks keypads answered
+    void     readStart(void);                // call before each F6 request that has its own preamble
+    void     readDone(bool ok);              // call after each F6 request, ok if keypad responded
+
+    uint32_t getSavedUs(void);               // keybus time saved per poll cycle vs the defaults (us)
+
+    // return delay d to use for the current transaction (us)
+    uint16_t get(uint8_t d)                  { return (trialActive && d == calParam) ? trial : val[d]; }
+
+    // return delay d in use outside of calibration trials (us)
+    uint16_t getVal(uint8_t d)               { return d < NUM_KT ? val[d] : 0; }
+
+    uint8_t  getState(void)                  { return state; }
+    uint8_t  getCalParam(void)               { return calParam; }
+
+    static void stateName(uint8_t s, char * name);  // copy name of calibration state s (KT_NAME_LEN+1 bytes)
+    static void paramName(uint8_t d, char * name);  // copy name of delay d (KT_NAME_LEN+1 bytes)
+
+private:
+    uint16_t val[NUM_KT];  // delays in use
+    uint16_t good;         // lowest value of calParam confirmed so far
+    uint16_t trial;        // value of calParam being tried
+    uint8_t  calParam;     // delay being calibrated
+    uint8_t  confirms;     // keypad responses at the trial value
+    uint8_t  errors;       // partial poll responses in a row
+    uint8_t  state;
+    bool     trialActive;  // current transaction uses the trial value
+    bool     probe;        // next poll uses the value in use, to see if the keypads had data
+
+    void     nextTrial(bool ok);
+    void     finishParam(void);
+    void     save(void);
+    bool     load(void);
+    static uint16_t crc(const uint16_t * v);
+};
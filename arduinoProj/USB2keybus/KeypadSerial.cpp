@@ -1,17 +1,63 @@
 // file KeypadSerial.cpp - a class for handling com with alarm keypad
 
 #include "KeypadSerial.h"
+#include "Profile.h"
 
 // Keypad communication appears to be mostly inverted 8E2@4800, but some special handling is required
 // Check the comments below for details.
 
-#define ONE_BIT_DELAY              delay_us(208)  // ~one bit delay @4800 baud
-#define ONE_BYTE_DELAY             delay_us(2030) // ~one byte delay @4800 baud
-#define DELAY_BETWEEN_POLL_WRITES  delay_us(1015) // measured delay between polling writes
-#define LOW_BEFORE_WRITE_DELAY     delay_us(4060) // time to drop transmit before regular writes
+#define ONE_BIT_DELAY              delay_us(KP_BIT_US)              // ~one bit delay @4800 baud
+#define ONE_BYTE_DELAY             delay_us(timing.get(KT_BYTE))    // ~one byte delay @4800 baud
+#define DELAY_BETWEEN_POLL_WRITES  delay_us(timing.get(KT_GAP))     // measured delay between polling writes
+#define POLL_LOW_DELAY             delay_us(timing.get(KT_POLL_LOW)) // transmit low > 10ms to start a poll
 
 KeypadSerial * KeypadSerial::pKeypadSerial = NULL;  // pointer to class for ISR
 
+// known keypad mesg types, selected by the second byte of the keypad response.  To support a new
+// mesg type, add an entry here.  Mesgs that match no entry are read with the KP_LEN_SCAN rule.
+//   key mesg - byte1 is count of bytes that follow (keys + checksum), decoded data is the keys
+//   0x87     - sent once after keypad power-up, fixed length 9, meaning unknown, decoded data is the whole mesg
+static const t_KpMsgType kpMsgTypes[] PROGMEM = {
+    // lo    hi    lenRule       len  event      off trim name
+    { 0x00, 0x10, KP_LEN_BYTE1,  0,  KEYS_MESG,  2,  1,  "KEYS" },
+    { 0x87, 0x87, KP_LEN_FIXED,  9,  0x87,       0,  0,  "PWUP" },
+};
+
+#define NUM_KP_MSG_TYPES (sizeof(kpMsgTypes) / sizeof(kpMsgTypes[0]))
+
+// find the table entry for mesg type byte1, or fill pType with the rule for unknown mesgs
+static void findMsgType(uint8_t byte1, t_KpMsgType * pType)
+{
+    for (uint8_t i=0; i < NUM_KP_MSG_TYPES; i++)
+    {
+        memcpy_P(pType, &kpMsgTypes[i], sizeof(t_KpMsgType));
+        if (byte1 >= pType->typeLo && byte1 <= pType->typeHi)
+        {
+            return;
+        }
+    }
+    t_KpMsgType unknown = { byte1, byte1, KP_LEN_SCAN, 0, byte1, 0, 0, "" };
+    strcpy_P(unknown.name, PSTR("UNK_"));
+    *pType = unknown;
+}
+
+// copy the USB event name for a requestData result into name (KP_MSG_NAME_LEN+1 bytes)
+void KeypadSerial::msgName(uint8_t event, char * name)  // declared static
+{
+    t_KpMsgType type;
+
+    for (uint8_t i=0; i < NUM_KP_MSG_TYPES; i++)
+    {
+        memcpy_P(&type, &kpMsgTypes[i], sizeof(t_KpMsgType));
+        if (type.event == event)
+        {
+            strcpy(name, type.name);
+            return;
+        }
+    }
+    strcpy_P(name, PSTR("UNK_"));
+}
+
 // class constructor
 KeypadSerial::KeypadSerial(void) : softSerial(RX_PIN, TX_PIN, true) {}
 
@@ -20,9 +66,15 @@ void KeypadSerial::init(void)
 {
     pKeypadSerial = this;              // setup class pointer for ISR
     pollState = NOT_POLLING;           // not currently polling
+    merge = KP_MERGE_TXN;              // merge writes onto acks if enabled by default
+    holdLow = false;
+    seenMask = 0;                      // no keypad has answered a poll yet
     softSerial.begin(KP_SERIAL_BAUD);  // set baud rate
     softSerial.setParity(true);        // enable even parity
+    softSerial.setVote(KP_RX_VOTE);    // majority vote received bits if enabled by default
     afterWrite();                      // normal state of the transmit line should be high
+    busStats.init();
+    timing.init();                     // load calibrated delays from EEPROM, if any
 }
 
 // microsecond delay function that supports interrupts during the delay
@@ -37,12 +89,52 @@ inline void KeypadSerial::delay_us(uint32_t us)
 
 // The before/after write functions manage the state of the transmit line to keypad
 
-// normal state of the transmit line to the keypad is high, but moves low before
-// a write starts (high start bit).  
-void KeypadSerial::beforeWrite(void)
+// normal state of the transmit line to the keypad is high, but moves low for pre us before
+// a write starts (high start bit).  If merged (the caller's isHeld() found the line still low after
+// an ack), this write is merged onto that transaction and only needs the rest of the short merge gap.
+// The caller decides once, so its bus stats and calibration agree with the preamble sent.
+//   Return: time the line was low before the write (us)
+uint32_t KeypadSerial::beforeWrite(uint16_t pre, bool merged)
 {
+    if (merged)
+    {
+        holdLow = false;
+        uint32_t low = micros() - holdSince;  // already low since the ack
+        if (low < KP_MERGE_GAP_US)
+        {
+            delay_us(KP_MERGE_GAP_US - low);
+            low = KP_MERGE_GAP_US;
+        }
+        busStats.addMerge(low < pre ? pre - low : 0);
+        return low;
+    }
+
     softSerial.tx_pin_write(LOW);      // set transmit low before we start writing
-    LOW_BEFORE_WRITE_DELAY;            // hold transmit low before write for ~4ms
+    delay_us(pre);                     // hold transmit low before write for ~4ms
+    return pre;
+}
+
+// The line held low after an ack must be written to before the keypads take it for a poll.  A hold
+// that has run past KP_MERGE_MAX_HOLD_US is released here, so a caller that was kept busy doesn't
+// start a merged write late.
+//   Return: true if the line is held low and the next write is merged onto the ack
+bool KeypadSerial::isHeld(void)
+{
+    if (holdLow && micros() - holdSince > KP_MERGE_MAX_HOLD_US)
+    {
+        releaseHold();
+    }
+    return holdLow;
+}
+
+// raise the line held low after an ack, the next write starts a transaction with its own preamble
+void KeypadSerial::releaseHold(void)
+{
+    if (holdLow)
+    {
+        holdLow = false;
+        afterWrite();
+    }
 }
 
 // restore high transmit after write
@@ -64,6 +156,7 @@ bool KeypadSerial::parsePollResp(uint8_t resp)
             if (((resp >> i) & 0x01) == 0) // keypad 16+i responded
             {
                 keypadAddr[numKeypads++] = 16 + i;
+                seenMask |= 1 << i;
             }
         }
         return (numKeypads > 0);
@@ -97,10 +190,15 @@ bool KeypadSerial::poll(void)
 
     softSerial.setParity(false);       // turn off parity for this transaction
     uint8_t pollResp = 0xFF;           // init poll response
+    holdLow = false;                   // poll starts with its own long low
     pollState = POLL_STATE_1;          // set pollState to initial value
+    timing.pollStart();                // may use trial delays while calibrating
+
+    busStats.beginTxn();
+    busStats.add(BUS_POLL, timing.get(KT_POLL_LOW) + 3UL * (timing.get(KT_BYTE) + timing.get(KT_GAP)));
 
     softSerial.tx_pin_write(LOW);      // set transmit low
-    _delay_ms(13);                     // keep low for > 10 ms to signal keypad
+    POLL_LOW_DELAY;                    // keep low for > 10 ms to signal keypad
     write0();                          // after write, should be at POLL_STATE_2 if keypad responded
     write0();                          // after write, should be at POLL_STATE_3 if keypad responded
     write0();                          // after write, should be at POLL_STATE_4 if keypad responded
@@ -110,6 +208,7 @@ bool KeypadSerial::poll(void)
     {
         read(&pollResp, 10);           // which keypads replied?
     }
+    timing.pollDone(pollState - POLL_STATE_1);  // count of poll clocks the keypads answered
     pollState = NOT_POLLING;           // done polling (response or no)
     softSerial.setParity(true);        // restore parity after this transaction
 
@@ -119,7 +218,15 @@ bool KeypadSerial::poll(void)
 // write sequence of bytes to keypad
 void KeypadSerial::write(const uint8_t * msg, const uint8_t size)
 {
-    beforeWrite();  // set transmit low before we start writing (about 4ms)
+    bool merged = isHeld();            // lets go of a hold that ran too long
+    if (!merged)
+    {
+        busStats.beginTxn();           // a merged write continues the transaction of the ack
+    }
+    // F7s get no reply, so a preamble too short for the keypads would fail silently.  KT_PRE is only
+    // calibrated on F6 requests, F7s keep the default like the ack does
+    uint32_t low = beforeWrite(KP_LOW_BEFORE_WRITE_US, merged);  // set transmit low before we start writing (about 4ms)
+    busStats.add(BUS_F7, low + (uint32_t)size * KP_FRAME_US);
 
     for (uint8_t i=0; i < size; i++)
     {
@@ -148,83 +255,115 @@ bool KeypadSerial::read(uint8_t * c, uint32_t timeout)
 }
 
 // send F6 message to keypad to request data. Return mesg type
-uint8_t KeypadSerial::requestData(uint8_t kp)
+//   If more is true and merging is on, the line is left low after the ack so the caller's next write
+//   (F6 to the next keypad, or an F7) shares this transaction instead of starting with a new ~4ms
+//   preamble.  The caller must then start that write right away (check isHeld()), a low line held
+//   for more than 10ms starts a poll.  isHeld() lets go of a hold older than KP_MERGE_MAX_HOLD_US,
+//   and a caller with something slow to do first calls releaseHold().
+uint8_t KeypadSerial::requestData(uint8_t kp, bool more)
 {
     uint8_t msgType = NO_MESG;
 
     recvMsgLen = 0;
+    dataOff = 0;
+    dataLen = 0;
 
     if (kp >= numKeypads || kp >= KP_SERIAL_MAX_KEYPADS)
     {
         return NO_MESG;  // invalid kp number
     }
 
-    beforeWrite();                     // set transmit low before we start writing
+    bool merged = isHeld();            // lets go of a hold that ran too long
+    if (!merged)
+    {
+        busStats.beginTxn();           // a merged request continues the transaction of the ack
+        timing.readStart();            // may use a trial preamble while calibrating
+    }
+    uint32_t low = beforeWrite(timing.get(KT_PRE), merged);  // set transmit low before we start writing
+    busStats.add(BUS_F6, low + 2 * KP_FRAME_US);
     softSerial.write(0xF6);            // tell keypad to send data
     ONE_BIT_DELAY;                     // extra stop bit delay
     softSerial.write(keypadAddr[kp]);  // address keypad we want to hear from 
     ONE_BIT_DELAY;                     // extra stop bit delay
     afterWrite();                      // restore transmit line level
 
-    uint8_t calcChksum = 0;
-
-    if (read(&readBuf[0], 10) && read(&readBuf[1], 10))  // if we recv a message
+    if (read(&readBuf[0], KP_READ_TIMEOUT_MS) && read(&readBuf[1], KP_READ_TIMEOUT_MS))  // if we recv a message
     {
-        calcChksum = readBuf[0] + readBuf[1]; // add first two bytes to checksum
-
         // second byte of message is either the length (key message) or a message type
-
-        if (readBuf[1] == 0x87)  // msgType 0x87 unknown, sent on power-up, total length 9, 7 bytes after type
-        {
-            for (uint8_t i=2; i < 8; i++)  // read bytes up to checksum
-            {
-                read(&readBuf[i], 10);
-                calcChksum += readBuf[i];
-            }
-            read(&readBuf[8], 10);  // read last mesg byte (checksum)
-            recvMsgLen = 9;
-            msgType = readBuf[1];
-        }
-        else if (readBuf[1] <= 16) // assume this is a key message
-        {
-            for (uint8_t i=0; i < readBuf[1]; i++) // 2nd byte of keys mesg is length
-            {
-                if (read(&readBuf[i+2], 10) && i < readBuf[1]-1)
-                {
-                    calcChksum += readBuf[i+2];
-                }
-            }
-            recvMsgLen = readBuf[1]+2;  // remain_bytes + header + length
-            msgType = KEYS_MESG;
-        } 
-        else  // some other type of message, unknown length, read however many bytes are provided
-        {
-            // read input until we hit size of read buf or read times out
-            for (recvMsgLen=2; recvMsgLen < KP_SERIAL_READ_BUF_SIZE && read(&readBuf[recvMsgLen], 10); recvMsgLen++)
-                ;
-            for (uint8_t i=2; i < recvMsgLen-1; i++)  // assume last byte read is mesg checksum
-                calcChksum += readBuf[i];
-            msgType = readBuf[1];
-        }
-
-        calcChksum = 0x100 - calcChksum; // two's compliment
+        t_KpMsgType type;
+        findMsgType(readBuf[1], &type);
+
+        bool chksumOk = readMsg(&type);  // sets recvMsgLen
+        msgType = type.event;
+        dataOff = min(type.dataOff, recvMsgLen);
+        dataLen = recvMsgLen - dataOff > type.dataTrim ? recvMsgLen - dataOff - type.dataTrim : 0;
+        recvTime = millis();             // capture time of this response
+        busStats.add(BUS_RESP, (uint32_t)recvMsgLen * KP_FRAME_US);
         
         ONE_BIT_DELAY;
         ONE_BIT_DELAY;  // appears that a two bit delay is needed before dropping transmit for ack
 
         if ((readBuf[0] & 0x3F) == keypadAddr[kp] &&   // if correct keypad responded to our query
-             calcChksum == readBuf[recvMsgLen-1])      // and the checksum is correct
+             chksumOk)                                 // and the checksum is correct
         {
-            beforeWrite();                  // set transmit low before we start writing
+            busStats.add(BUS_ACK, KP_ACK_AIR_US);
+            timing.readDone(true);
+            // the ack always uses the default preamble, a lost ack can't be detected and the keypad
+            // would send the same keys again
+            softSerial.tx_pin_write(LOW);   // set transmit low before we start writing
+            delay_us(KP_LOW_BEFORE_WRITE_US);
             softSerial.write(readBuf[0]);   // send keypad mesg ack
             ONE_BIT_DELAY;                  // extra stop bit
-            afterWrite();                   // restore transmit line level
+            if (more && merge)
+            {
+                holdLow = true;             // leave transmit low, next write merges onto this one
+                holdSince = micros();
+            }
+            else
+            {
+                afterWrite();               // restore transmit line level
+            }
             return msgType;
         }
     }
+    timing.readDone(false);
     return NO_MESG;  // no message recv for this keypad, or bad checksum
 }
 
+// read the rest of a keypad mesg (after the first two bytes) using the length rule of pType.
+//   Sets recvMsgLen.  Return: true if the last byte read is a valid checksum of the mesg
+bool KeypadSerial::readMsg(t_KpMsgType * pType)
+{
+    // the checksum byte is the two's complement of the sum of the bytes before it, so a mesg
+    // (including checksum) is valid when all of its bytes sum to zero
+
+    uint8_t len = KP_SERIAL_READ_BUF_SIZE;
+    if (pType->lenRule == KP_LEN_FIXED)
+    {
+        len = pType->len;
+    }
+    else if (pType->lenRule == KP_LEN_BYTE1)
+    {
+        len = readBuf[1] + 2;  // remain_bytes + header + length
+    }
+
+    uint8_t sum = readBuf[0] + readBuf[1];
+    for (recvMsgLen=2; recvMsgLen < len; recvMsgLen++)
+    {
+        // an unknown mesg with a matching checksum is most likely complete, so only wait long
+        // enough to see if another byte follows rather than the full read timeout
+        uint8_t timeout = (pType->lenRule == KP_LEN_SCAN && recvMsgLen > 2 && sum == 0) ?
+            KP_SCAN_QUIET_MS : KP_READ_TIMEOUT_MS;
+
+        if (!read(&readBuf[recvMsgLen], timeout))
+        {
+            break;
+        }
+        sum += readBuf[recvMsgLen];
+    }
+    return recvMsgLen > 2 && sum == 0;
+}
+
 // Pin Change INTerrupts ---------------------------------------------------------------------------
 
 // this pin change ISR replaces the one normally used by SoftwareSerial
@@ -234,7 +373,9 @@ inline void KeypadSerial::pinChangeIsr(void)  // declared static
     {
         if (pKeypadSerial->pollState == NOT_POLLING || pKeypadSerial->pollState == POLL_STATE_3)
         {
+            PROF_ENTER(PROF_RECV_ISR);
             pKeypadSerial->softSerial.recv();  // start recv of byte
+            PROF_EXIT(PROF_RECV_ISR);
         }
         if (pKeypadSerial->pollState != NOT_POLLING) // we are currently polling keypad
         {
@@ -4,19 +4,68 @@
 
 #include <Arduino.h>
 #include "ModSoftwareSerial.h"
+#include "BusStats.h"
+#include "KeybusTiming.h"
 
 // i/o pins for software serial 
 #define RX_PIN (12)
 #define TX_PIN (11)
 
-// responses from requestData func
+// responses from requestData func (any other value is the type byte of a non-key keypad mesg)
 #define NO_MESG    (0)
 #define KEYS_MESG  (1)
 
+// length rules for keypad mesg types, see kpMsgTypes[] in KeypadSerial.cpp
+enum {
+    KP_LEN_FIXED = 0,  // total mesg length is fixed
+    KP_LEN_BYTE1 = 1,  // byte1 is the count of bytes that follow it (incl checksum)
+    KP_LEN_SCAN  = 2   // unknown length, read until checksum matches and line goes quiet
+};
+
+#define KP_MSG_NAME_LEN  (4)  // length of mesg type name used in USB events
+
+// entry in the table of known keypad mesg types
+typedef struct {
+    uint8_t typeLo;                     // byte1 range that selects this entry
+    uint8_t typeHi;
+    uint8_t lenRule;                    // KP_LEN_*
+    uint8_t len;                        // total mesg length for KP_LEN_FIXED
+    uint8_t event;                      // value returned by requestData
+    uint8_t dataOff;                    // decoded data starts at this byte of the mesg
+    uint8_t dataTrim;                   // bytes at end of mesg not included in decoded data
+    char    name[KP_MSG_NAME_LEN+1];    // name used in USB events
+} t_KpMsgType;
+
 #define KP_SERIAL_BAUD        (4800)    // baud rate for keypad communication
 #define KP_SERIAL_MAX_KEYPADS    (8)    // max number of keypads in alarm circuit
 #define KP_SERIAL_READ_BUF_SIZE (64)    // size of read buffer
 
+// keybus timing (us). Keypad communication appears to be mostly inverted 8E2@4800
+//   these are the defaults, poll and write preamble delays can be tuned by KeybusTiming calibration
+#define KP_BIT_US              (208)    // ~one bit @4800 baud
+#define KP_BYTE_US            (2030)    // ~one byte @4800 baud, used as the high time of a poll clock
+#define KP_POLL_GAP_US        (1015)    // measured delay between polling writes
+#define KP_LOW_BEFORE_WRITE_US (4060)   // time to drop transmit before regular writes
+#define KP_POLL_LOW_MS          (13)    // transmit held low > 10ms to start a poll
+#define KP_FRAME_BITS           (12)    // start + 8 data + parity + 2 stop
+
+// keybus air time of each operation (us)
+#define KP_FRAME_US            (KP_BIT_US * KP_FRAME_BITS)
+#define KP_POLL_AIR_US         (KP_POLL_LOW_MS * 1000UL + 3 * (KP_BYTE_US + KP_POLL_GAP_US))
+#define KP_WRITE_AIR_US(n)     (KP_LOW_BEFORE_WRITE_US + (uint32_t)(n) * KP_FRAME_US)
+#define KP_ACK_AIR_US          (2 * KP_BIT_US + KP_WRITE_AIR_US(1))  // includes 2 bit turnaround
+#define KP_F7_AIR_MS           (KP_WRITE_AIR_US(48) / 1000)
+#define KP_POLL_AIR_MS         (KP_POLL_AIR_US / 1000)
+
+#define KP_MERGE_GAP_US       (1015)    // low time between an ack and a write merged onto it
+#define KP_MERGE_MAX_HOLD_US  (6000)    // longest the line is held low after an ack for a merged write,
+                                        //   leaves a keypad byte ISR of margin to the 10ms of a poll
+#define KP_MERGE_TXN             (0)    // 1 to merge writes onto the preceding ack by default
+#define KP_RX_VOTE               (0)    // 1 to receive with 3 samples per bit by default (see setVote)
+
+#define KP_READ_TIMEOUT_MS      (10)    // max wait for each byte of a keypad response
+#define KP_SCAN_QUIET_MS         (4)    // quiet time after a checksum match that ends an unknown mesg
+
 // polling states during keypad polling
 enum {
     NOT_POLLING  = 0,
@@ -35,8 +84,13 @@ public:
     bool    poll(void);
     void    write(const uint8_t * msg, const uint8_t size);
     bool    read(uint8_t * c, uint32_t timeout);
+
+    // return true if a char from the keypads is waiting to be read
+    bool    available(void)             { return softSerial.available() > 0; }
     void    getMsg(char * buf, uint8_t bufLen);
-    uint8_t requestData(uint8_t kp);
+    uint8_t requestData(uint8_t kp, bool more = false);
+
+    static void msgName(uint8_t event, char * name);  // copy USB event name for requestData result
 
     // return keypad address for keypad kp
     uint8_t getAddr(uint8_t kp)         { return kp < numKeypads ? keypadAddr[kp] : 0; }
@@ -44,6 +98,9 @@ public:
     // return the number of keypads that responded to the poll request
     uint8_t getNumKeypads(void)         { return numKeypads; }
 
+    // return bitmask of keypads that have answered a poll since reset (bit i is keypad 16+i)
+    uint8_t getSeenMask(void)           { return seenMask; }
+
     // return the number of keys returned by keypad
     uint8_t getKeyCount(void)           { return recvMsgLen > 3 ? recvMsgLen - 3 : 0; }
 
@@ -53,25 +110,69 @@ public:
     // return length of data received from keypad
     uint8_t getRecvMsgLen(void)         { return recvMsgLen; }
 
+    // return millis() when the last keypad response was decoded
+    uint32_t getRecvTime(void)          { return recvTime; }
+
     // return pointer to array of data read from keypad
     uint8_t * getRecvMsg(void)          { return readBuf; }
 
+    // return decoded data of the last mesg (keys for KEYS_MESG, whole mesg for others)
+    uint8_t * getData(void)             { return &readBuf[dataOff]; }
+
+    // return length of decoded data of the last mesg
+    uint8_t getDataLen(void)            { return dataLen; }
+
+    // turn on/off merging of writes onto the preceding ack (see requestData)
+    void setMerge(bool on)              { merge = on; }
+
+    // return true if writes are merged onto the preceding ack
+    bool getMerge(void)                 { return merge; }
+
+    // turn on/off majority vote of 3 samples per received bit, for long or noisy keybus runs where
+    // one glitch would fail the checksum of a whole keypad mesg
+    void setVote(bool on)               { softSerial.setVote(on); }
+
+    // return true if received bits are majority voted
+    bool getVote(void)                  { return softSerial.getVote(); }
+
+    // return count of received bits a glitch was voted out of since reset
+    uint16_t getVoteFixes(void)         { return softSerial.getVoted(); }
+
+    bool    isHeld(void);            // true if the line is held low after an ack for a merged write
+    void    releaseHold(void);       // raise a line held low after an ack, the next write takes its own preamble
+
+    // return tunable keybus delays
+    KeybusTiming & getTiming(void)      { return timing; }
+
+    // return keybus time accounting
+    BusStats & getBusStats(void)        { return busStats; }
+
     static inline void pinChangeIsr(void) __attribute__((__always_inline__));
     static KeypadSerial * pKeypadSerial;
 
 private:
     bool    parsePollResp(uint8_t);
+    bool    readMsg(t_KpMsgType * pType);
     void    write0(void);
-    void    beforeWrite(void);
+    uint32_t beforeWrite(uint16_t pre, bool merged);
     void    afterWrite(void);
 
     static inline void delay_us(uint32_t us) __attribute__((__always_inline__));
 
     SoftwareSerial softSerial;
+    BusStats       busStats;
+    KeybusTiming   timing;
 
     uint8_t pollState;
+    bool    merge;
+    bool    holdLow;
+    uint32_t holdSince;
     uint8_t numKeypads;
+    uint8_t seenMask;
     uint8_t recvMsgLen;
+    uint8_t dataOff;
+    uint8_t dataLen;
+    uint32_t recvTime;
     uint8_t keypadAddr[KP_SERIAL_MAX_KEYPADS];
     uint8_t readBuf[KP_SERIAL_READ_BUF_SIZE];
 };
@@ -0,0 +1,153 @@
+// file LoopMon.cpp - class for measuring main loop latency and detecting stalls
+
+// The loop duration is measured with micros() on every iteration, so the stats are always on.
+// When a budget is set, the watchdog is also run in interrupt mode with a period just above the
+// budget.  start() kicks the watchdog, so the watchdog ISR only fires if a single iteration is
+// stuck for longer than the period (even one that never returns).  The ISR only counts the alarm,
+// it never resets the processor.
+
+#include "LoopMon.h"
+#include <avr/wdt.h>
+
+LoopMon * LoopMon::pLoopMon = NULL;  // pointer to class for ISR
+
+static const char taskNames[NUM_TASKS][TASK_NAME_LEN+1] PROGMEM = { "IDLE", "USB", "KP_READ", "F7", "POLL", "VOLT" };
+
+// init the class
+void LoopMon::init(void)
+{
+    pLoopMon = this;  // setup class pointer for ISR
+    budgetMs = 0;
+    wdtAlarms = 0;
+    clear();
+    setBudget(0);
+    start();
+}
+
+// clear the collected stats
+void LoopMon::clear(void)
+{
+    lastUs = maxUs = 0;
+    maxTask = TASK_NONE;
+    overruns = 0;
+    wdtAlarms = 0;
+    for (uint8_t b=0; b < LOOP_HIST_BUCKETS; b++)
+    {
+        hist[b] = 0;
+    }
+}
+
+// copy name of task t
+void LoopMon::taskName(uint8_t t, char * name)  // declared static
+{
+    strcpy_P(name, taskNames[t < NUM_TASKS ? t : TASK_NONE]);
+}
+
+// write watchdog config cfg, interrupts must be off.  The timed sequence wants cfg stored within 4
+// cycles of setting WDCE, or WDE stays set and the watchdog resets the board.  So cfg is in a
+// register before the first store and the two stores are back to back, as in avr-libc wdt_enable()
+static inline void wdtConfig(uint8_t cfg)
+{
+#if defined(__AVR__)
+    __asm__ __volatile__(
+        "sts %0, %1" "\n\t"
+        "sts %0, %2" "\n\t"
+        : /* no outputs */
+        : "n" (_SFR_MEM_ADDR(WDTCSR)), "r" ((uint8_t)(_BV(WDCE) | _BV(WDE))), "r" (cfg)
+        : "memory");
+#else
+    WDTCSR = cfg;  // native build, no timed sequence
+#endif
+}
+
+// set the stall budget (ms) and the matching watchdog period. 0 turns both off
+void LoopMon::setBudget(uint16_t ms)
+{
+    budgetMs = ms;
+
+    uint8_t wdp = 0;  // watchdog period is 16ms << wdp, pick the first one above the budget
+    while (wdp < 9 && ((uint32_t)16 << wdp) <= ms)
+        wdp++;
+    uint8_t cfg = _BV(WDIE) | ((wdp & 0x08) ? _BV(WDP3) : 0) | (wdp & 0x07);  // interrupt mode only
+
+    uint8_t oldSREG = SREG;
+    cli();
+    wdt_reset();
+    MCUSR &= ~_BV(WDRF);                  // WDE can not be cleared while WDRF is set
+    if (ms == 0)
+        wdt_disable();                    // watchdog off
+    else
+        wdtConfig(cfg);
+    SREG = oldSREG;
+}
+
+// call at the top of each loop iteration
+void LoopMon::start(void)
+{
+    if (budgetMs)
+        wdt_reset();
+
+    startUs = taskUs = micros();
+    worstUs = 0;
+    curTask = worstTask = TASK_NONE;
+}
+
+// account the time used by the current task
+void LoopMon::closeTask(uint32_t us)
+{
+    uint32_t d = us - taskUs;
+    if (d >= worstUs)
+    {
+        worstUs = d;
+        worstTask = curTask;
+    }
+    taskUs = us;
+}
+
+// call before starting a task within the loop
+void LoopMon::task(uint8_t t)
+{
+    closeTask(micros());
+    curTask = t;
+}
+
+// call at the end of each loop iteration. Returns: true if iteration went over budget
+bool LoopMon::end(void)
+{
+    uint32_t us = micros();
+    closeTask(us);
+    curTask = TASK_NONE;
+
+    lastUs = us - startUs;
+    if (lastUs > maxUs)
+    {
+        maxUs = lastUs;
+        maxTask = worstTask;
+    }
+
+    uint8_t b = 0;
+    for (uint32_t limit = 256; b < LOOP_HIST_BUCKETS-1 && lastUs >= limit; limit <<= 2)
+        b++;
+    if (hist[b] < 0xFFFF)
+        hist[b]++;
+
+    if (budgetMs && lastUs > (uint32_t)budgetMs * 1000)
+    {
+        if (overruns < 0xFFFF)
+            overruns++;
+        return true;
+    }
+    return false;
+}
+
+// watchdog alarm, loop did not restart within the watchdog period
+inline void LoopMon::wdtIsr(void)  // declared static
+{
+    if (pLoopMon && pLoopMon->wdtAlarms < 0xFFFF)
+        pLoopMon->wdtAlarms++;
+}
+
+ISR(WDT_vect)
+{
+    LoopMon::wdtIsr();
+}
@@ -0,0 +1,64 @@
+// file LoopMon.h - class for measuring main loop latency and detecting stalls
+
+#pragma once
+
+#include <Arduino.h>
+
+#define LOOP_HIST_BUCKETS (7)   // loop duration buckets: <256us, <1ms, <4ms, <16ms, <64ms, <256ms, longer
+#define TASK_NAME_LEN     (7)   // max length of a task name
+
+// tasks run by the main loop, used to blame a stall on the code that caused it
+enum {
+    TASK_NONE    = 0,  // loop overhead, nothing to do
+    TASK_USB     = 1,  // parse command from USB
+    TASK_KP_READ = 2,  // read data from a keypad (requestData)
+    TASK_F7      = 3,  // write F7 message to keypads
+    TASK_POLL    = 4,  // poll keypads
+    TASK_VOLT    = 5,  // report voltage rails
+    NUM_TASKS
+};
+
+class LoopMon
+{
+public:
+    LoopMon(void) {}                         // Class constructor.  Returns: none
+
+    void init(void);                         // init the class
+    void start(void);                        // call at the top of each loop iteration
+    void task(uint8_t t);                    // call before starting a task within the loop
+    bool end(void);                          // call at the end of each loop. Returns: true if over budget
+    void setBudget(uint16_t ms);             // set stall budget, 0 turns off budget check and watchdog
+    void clear(void);                        // clear the collected stats
+
+    uint16_t getBudget(void)                 { return budgetMs; }
+    uint32_t getLast(void)                   { return lastUs; }
+    uint32_t getMax(void)                    { return maxUs; }
+    uint8_t  getMaxTask(void)                { return maxTask; }
+    uint8_t  getLastTask(void)               { return worstTask; }
+    uint16_t getOverruns(void)               { return overruns; }
+    uint16_t getWdtAlarms(void)              { return wdtAlarms; }
+    uint16_t getHist(uint8_t b)              { return b < LOOP_HIST_BUCKETS ? hist[b] : 0; }
+
+    static void taskName(uint8_t t, char * name);  // copy name of task t (TASK_NAME_LEN+1 bytes)
+
+    static inline void wdtIsr(void) __attribute__((__always_inline__));
+    static LoopMon * pLoopMon;
+
+private:
+    uint32_t startUs;       // micros() at start of this iteration
+    uint32_t taskUs;        // micros() at start of current task
+    uint32_t worstUs;       // duration of longest task this iteration
+    uint8_t  curTask;       // task currently running
+    uint8_t  worstTask;     // task that took longest this iteration
+
+    uint32_t lastUs;        // duration of last iteration
+    uint32_t maxUs;         // longest iteration seen
+    uint8_t  maxTask;       // task that caused the longest iteration
+    uint16_t budgetMs;      // iterations longer than this are counted as overruns
+    uint16_t overruns;      // count of iterations over budget
+
+    volatile uint16_t wdtAlarms;  // count of watchdog alarms (loop stuck for longer than watchdog period)
+    uint16_t hist[LOOP_HIST_BUCKETS];
+
+    void closeTask(uint32_t us);
+};
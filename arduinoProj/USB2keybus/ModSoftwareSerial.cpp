@@ -44,15 +44,13 @@ http://arduiniana.org.
 #include <avr/pgmspace.h>
 #include <Arduino.h>
 #include "ModSoftwareSerial.h"       // our custom version of standard SoftwareSerial
+#include "Profile.h"                 // NON_STANDARD - simavr profile markers
 #include <util/delay_basic.h>
 
 //
 // Statics
 //
 SoftwareSerial *SoftwareSerial::active_object = 0;
-uint8_t SoftwareSerial::_receive_buffer[_SS_MAX_RX_BUFF]; 
-volatile uint8_t SoftwareSerial::_receive_buffer_tail = 0;
-volatile uint8_t SoftwareSerial::_receive_buffer_head = 0;
 
 //
 // Debugging
@@ -97,7 +95,7 @@ bool SoftwareSerial::listen()
       active_object->stopListening();
 
     _buffer_overflow = false;
-    _receive_buffer_head = _receive_buffer_tail = 0;
+    _rx_ring.clear();  // NON_STANDARD
     active_object = this;
 
     setRxIntMsk(true);
@@ -152,32 +150,53 @@ void SoftwareSerial::recv()
     // cause problems at higher baudrates.
     setRxIntMsk(false);
 
-    // Wait approximately 1/2 of a bit width to "center" the sample
-    tunedDelay(_rx_delay_centering);
-    DebugPulse(_DEBUG_PIN2, 1);
-
-    // Read each of the 8 bits
-    for (uint8_t i=8; i > 0; --i)
+    if (_vote)
     {
-      tunedDelay(_rx_delay_intrabit);
-      d >>= 1;
-      DebugPulse(_DEBUG_PIN2, 1);
-      if (rx_pin_read())
-        d |= 0x80;
+      // NON_STANDARD - read each bit three times around its centre and take the majority, so
+      // one glitch on the line doesn't flip the bit.  fixed counts bits that had a glitch
+      uint8_t fixed = 0;
+      tunedDelay(_rx_delay_centering_vote);
+      for (uint8_t i=8; i > 0; --i)
+      {
+        tunedDelay(_rx_delay_intrabit_vote);
+        uint8_t n = rx_pin_read() ? 1 : 0;
+        tunedDelay(_rx_delay_vote_gap);
+        if (rx_pin_read())
+          n++;
+        tunedDelay(_rx_delay_vote_gap);
+        if (rx_pin_read())
+          n++;
+        d >>= 1;
+        if (n >= 2)
+          d |= 0x80;
+        if ((uint8_t)(n - 1) < 2)  // 1 or 2, samples disagree
+          fixed++;
+      }
+      if (fixed)
+        _rx_voted += fixed;
     }
+    else
+    {
+      // Wait approximately 1/2 of a bit width to "center" the sample
+      tunedDelay(_rx_delay_centering);
+      DebugPulse(_DEBUG_PIN2, 1);
+
+      // Read each of the 8 bits
+      for (uint8_t i=8; i > 0; --i)
+      {
+        tunedDelay(_rx_delay_intrabit);
+        d >>= 1;
+        DebugPulse(_DEBUG_PIN2, 1);
+        if (rx_pin_read())
+          d |= 0x80;
+      }
+    }  // end of NON_STANDARD
 
     if (_inverse_logic)
       d = ~d;
 
     // if buffer full, set the overflow flag and return
-    uint8_t next = (_receive_buffer_tail + 1) % _SS_MAX_RX_BUFF;
-    if (next != _receive_buffer_head)
-    {
-      // save new data in buffer: tail points to where byte goes
-      _receive_buffer[_receive_buffer_tail] = d; // save new byte
-      _receive_buffer_tail = next;
-    } 
-    else 
+    if (!_rx_ring.push(d))  // NON_STANDARD - per object ring
     {
       DebugPulse(_DEBUG_PIN1, 1);
       _buffer_overflow = true;
@@ -263,9 +282,14 @@ SoftwareSerial::SoftwareSerial(uint8_t receivePin, uint8_t transmitPin, bool inv
   _rx_delay_intrabit(0),
   _rx_delay_stopbit(0),
   _tx_delay(0),
+  _rx_delay_vote_gap(0),           // NON_STANDARD
+  _rx_delay_centering_vote(0),     // NON_STANDARD
+  _rx_delay_intrabit_vote(0),      // NON_STANDARD
+  _rx_voted(0),                    // NON_STANDARD
   _buffer_overflow(false),
   _inverse_logic(inverse_logic),
-  _parity(false)                   // NON_STANDARD - init parity mode to false
+  _parity(false),                  // NON_STANDARD - init parity mode to false
+  _vote(false)                     // NON_STANDARD - one sample per bit
 {
   setTX(transmitPin);
   setRX(receivePin);
@@ -320,6 +344,22 @@ void SoftwareSerial::setParity(bool parity)
     _parity = parity;
 }
 
+// NON_STANDARD (allow majority vote receive, see recv)
+void SoftwareSerial::setVote(bool vote)
+{
+    _vote = vote;
+}
+
+// NON_STANDARD - count of received bits where one of the three samples was outvoted
+uint16_t SoftwareSerial::getVoted()
+{
+    uint8_t oldSREG = SREG;
+    cli();  // recv() updates it in the ISR
+    uint16_t n = _rx_voted;
+    SREG = oldSREG;
+    return n;
+}
+
 void SoftwareSerial::begin(long speed)
 {
   _rx_delay_centering = _rx_delay_intrabit = _rx_delay_stopbit = _tx_delay = 0;
@@ -372,6 +412,17 @@ void SoftwareSerial::begin(long speed)
     _rx_delay_stopbit = subtract_cap(bit_delay * 3 / 4, (44 + 17) / 4);
     #endif
 
+    // NON_STANDARD - majority vote receive.  Samples are 1/8 bit apart, so the first of each bit
+    // is taken a gap before the single sample would be.  The voted loop runs about 36 cycles
+    // longer per bit than the single sample one (two more delays and pin reads, and the vote),
+    // which comes off the intrabit delay.  That is estimated, not counted from compiler output,
+    // at 4800 baud a bit is 3333 cycles so the error does not add up to much over 8 bits.  The
+    // first bit has none of that overhead before its first sample, so centering gets it back.
+    // The last sample is a gap late, which leaves the stopbit delay ending 3/8 into the stop bit
+    _rx_delay_vote_gap = bit_delay / 8;
+    _rx_delay_centering_vote = _rx_delay_centering + _rx_delay_vote_gap + 36 / 4;
+    _rx_delay_intrabit_vote = subtract_cap(_rx_delay_intrabit, 2 * _rx_delay_vote_gap + 36 / 4);
+
 
     // Enable the PCINT for the entire port here, but never disable it
     // (others might also need it, so we disable the interrupt by using
@@ -413,14 +464,9 @@ int SoftwareSerial::read()
   if (!isListening())
     return -1;
 
-  // Empty buffer?
-  if (_receive_buffer_head == _receive_buffer_tail)
-    return -1;
-
-  // Read from "head"
-  uint8_t d = _receive_buffer[_receive_buffer_head]; // grab next byte
-  _receive_buffer_head = (_receive_buffer_head + 1) % _SS_MAX_RX_BUFF;
-  return d;
+  // NON_STANDARD - per object ring, -1 if empty
+  uint8_t d;
+  return _rx_ring.pop(&d) ? d : -1;
 }
 
 int SoftwareSerial::available()
@@ -428,7 +474,7 @@ int SoftwareSerial::available()
   if (!isListening())
     return 0;
 
-  return (_receive_buffer_tail + _SS_MAX_RX_BUFF - _receive_buffer_head) % _SS_MAX_RX_BUFF;
+  return _rx_ring.available();  // NON_STANDARD
 }
 
 size_t SoftwareSerial::write(uint8_t b)
@@ -455,6 +501,7 @@ size_t SoftwareSerial::write(uint8_t b)
     b = ~b;
 
   cli();  // turn off interrupts for a clean txmit
+  PROF_ENTER(PROF_TX_CLI);  // NON_STANDARD
 
   // Write the start bit
   if (inv)
@@ -497,6 +544,7 @@ size_t SoftwareSerial::write(uint8_t b)
   else
     *reg |= reg_mask;
 
+  PROF_EXIT(PROF_TX_CLI);   // NON_STANDARD
   SREG = oldSREG; // turn interrupts back on
   tunedDelay(_tx_delay);
   
@@ -513,12 +561,9 @@ int SoftwareSerial::peek()
   if (!isListening())
     return -1;
 
-  // Empty buffer?
-  if (_receive_buffer_head == _receive_buffer_tail)
-    return -1;
-
-  // Read from "head"
-  return _receive_buffer[_receive_buffer_head];
+  // NON_STANDARD - per object ring, -1 if empty
+  const uint8_t * p = _rx_ring.peek();
+  return p ? *p : -1;
 }
 
 // NON_STANDARD
@@ -36,6 +36,7 @@ http://arduiniana.org.
 
 #include <inttypes.h>
 #include <Stream.h>
+#include "SpscRing.h"  // NON_STANDARD
 
 /******************************************************************************
 * Definitions
@@ -67,14 +68,23 @@ protected:  // NON_STANDARD - changed from private to protected
   uint16_t _rx_delay_stopbit;
   uint16_t _tx_delay;
 
+  // NON_STANDARD - majority vote receive (see setVote), three samples per bit _rx_delay_vote_gap
+  // apart around the centre, so the first sample is a gap early and the last a gap late
+  uint16_t _rx_delay_vote_gap;
+  uint16_t _rx_delay_centering_vote;
+  uint16_t _rx_delay_intrabit_vote;
+  volatile uint16_t _rx_voted;   // bits where one sample was outvoted
+
   uint16_t _buffer_overflow:1;
   uint16_t _inverse_logic:1;
   uint16_t _parity:1;            // NON_STANDARD
+  bool _vote;                    // NON_STANDARD - not a bit field, recv() writes _buffer_overflow
+
+  // NON_STANDARD - per object receive ring, pushed by recv() in the ISR (was a static buffer
+  // shared by every object)
+  SpscRing<uint8_t, _SS_MAX_RX_BUFF> _rx_ring;
 
   // static data
-  static uint8_t _receive_buffer[_SS_MAX_RX_BUFF]; 
-  static volatile uint8_t _receive_buffer_tail;
-  static volatile uint8_t _receive_buffer_head;
   static SoftwareSerial *active_object;
 
   // private methods
@@ -111,6 +121,9 @@ public:
   virtual int available();
   virtual void flush();
   virtual void setParity(bool parity=false);  // NON_STANDARD
+  void setVote(bool vote);                    // NON_STANDARD
+  bool getVote() { return _vote; }            // NON_STANDARD
+  uint16_t getVoted();                        // NON_STANDARD
   operator bool() { return true; }
   
   using Print::write;
@@ -13,9 +13,78 @@ void PiSerial::init(void)
 {
     // init USB serial connection to Raspberry PI
     Serial.begin(PI_SERIAL_BAUD);  
-    sprintf(msgBuf, "\nUSB2keybus initialized, USB rx buf size %d\n", SERIAL_RX_BUFFER_SIZE);
+    sprintf_P(msgBuf, PSTR("\nUSB2keybus initialized, USB rx buf size %d tx buf size %d\n"), SERIAL_RX_BUFFER_SIZE,
+        SERIAL_TX_BUFFER_SIZE);
     Serial.println(msgBuf);
     clearCmd();
+
+    baud = PI_SERIAL_BAUD;
+    pendingBaud = 0;
+    baudTime = 0;
+    confirmed = true;
+    errors = 0;
+    fallbacks = 0;
+}
+
+// true if baud is exact at 16MHz with U2X (or the default rate)
+bool PiSerial::validBaud(uint32_t baud)  // declared static
+{
+    return baud == PI_SERIAL_BAUD || baud == 250000 || baud == 500000 || baud == 1000000;
+}
+
+// switch to baud on the next checkBaud, after the reply to the BAUD command has gone out
+void PiSerial::setBaud(uint32_t b)
+{
+    pendingBaud = b;
+}
+
+// count a parsed command.  A valid one confirms the rate in use, a garbled one counts towards fallback
+void PiSerial::cmdResult(bool valid)
+{
+    if (valid)
+    {
+        confirmed = true;
+        errors = 0;
+    }
+    else if (errors < 0xFF)
+    {
+        errors++;
+    }
+}
+
+// switch to a pending rate, or fall back to PI_SERIAL_BAUD if a new rate wasn't confirmed in time or
+// commands keep arriving garbled.  Returns: true if it fell back
+bool PiSerial::checkBaud(uint32_t ms)
+{
+    if (pendingBaud)
+    {
+        Serial.flush();  // the reply goes out at the old rate
+        Serial.end();
+        Serial.begin(pendingBaud);
+        baud = pendingBaud;
+        pendingBaud = 0;
+        baudTime = ms;
+        confirmed = baud == PI_SERIAL_BAUD;  // nothing to fall back to
+        errors = 0;
+        clearCmd();
+        return false;
+    }
+
+    if (baud == PI_SERIAL_BAUD || ((confirmed || ms - baudTime <= PI_BAUD_CONFIRM_MS) && errors < PI_BAUD_MAX_ERRORS))
+    {
+        return false;
+    }
+
+    Serial.flush();
+    Serial.end();
+    Serial.begin(PI_SERIAL_BAUD);
+    baud = PI_SERIAL_BAUD;
+    baudTime = ms;
+    confirmed = true;
+    errors = 0;
+    fallbacks++;
+    clearCmd();
+    return true;
 }
 
 void PiSerial::write(const char * buf)
@@ -33,16 +102,17 @@ bool PiSerial::read(void)
         {
             if (bufIdx > 0) // don't create zero length commands
             {
-                if (msgBuf[0] == 'F')  // commands always start with 'F'
+                if (msgBuf[0] >= 'A' && msgBuf[0] <= 'Z')  // commands always start with an upper case letter
                 {
                     cmdRecvd = true;
                 }
                 else
                 {
-                    Serial.println("ERR_FMT: garbled command: ");
+                    Serial.println(F("ERR_FMT: garbled command: "));
                     Serial.println(msgBuf);
-                    Serial.println("\n");
+                    Serial.println(F("\n"));
                     clearCmd();
+                    cmdResult(false);
                 }
             }
         }
@@ -54,8 +124,9 @@ bool PiSerial::read(void)
 
     if (bufIdx >= PI_SERIAL_MSG_BUF_SIZE-1)
     {
-        Serial.println("ERR_OFL: buf overflow\n");
+        Serial.println(F("ERR_OFL: buf overflow\n"));
         clearCmd();
+        cmdResult(false);
     }
     else
     {
@@ -68,4 +139,4 @@ const char * PiSerial::getMsg(uint8_t * size)
 {
     *size = cmdRecvd ? bufIdx : 0;
     return (const char *)msgBuf;
-}
+}
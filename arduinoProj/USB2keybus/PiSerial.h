@@ -1,12 +1,25 @@
 // file PiSerial.h - Serial class for handling serial com with Raspberry PI
 
-#pragma once
+// The USB serial rx/tx buffer sizes (SERIAL_RX_BUFFER_SIZE, SERIAL_TX_BUFFER_SIZE) are set in the
+// Makefile, the core's HardwareSerial.cpp must be built with the same values as this code.
+//
+// The link starts at PI_SERIAL_BAUD.  'BAUD <rate>' moves it to one of the rates that are exact at
+// 16MHz with U2X (250000, 500000, 1000000) or back to 115200:
+//   1. the reply 'BAUD rate=<rate> ok=0 ..' goes out at the old rate, then the port switches
+//   2. the Pi switches its tty when it sees the reply, and sends any command (BAUD?, say)
+//   3. a valid command within PI_BAUD_CONFIRM_MS confirms the rate.  Otherwise both ends go back
+//      to PI_SERIAL_BAUD, the Pi after the same timeout with no reply
+// A confirmed high rate also falls back after PI_BAUD_MAX_ERRORS garbled commands in a row.  The
+// keybus ISRs run for a whole keypad byte with interrupts off, long enough at 1M for the USART to
+// overrun if the Pi is sending just then.
 
-#define SERIAL_RX_BUFFER_SIZE  256    // increase default size for arduino serial recv buffer
+#pragma once
 
 #include <Arduino.h>
 
-#define PI_SERIAL_BAUD      115200   // baud rate for USB serial port
+#define PI_SERIAL_BAUD      115200   // baud rate for USB serial port at reset, and the fallback rate
+#define PI_BAUD_CONFIRM_MS   (2000)  // a new rate must be confirmed by a command within this time (ms)
+#define PI_BAUD_MAX_ERRORS      (3)  // garbled commands in a row at a raised rate before falling back
 
 static const uint8_t PI_SERIAL_MSG_BUF_SIZE = 128;  // max length of recv'd msg
 
@@ -21,9 +34,39 @@ public:
     void clearCmd(void);                    // clear the current command buf
     const char * getMsg(uint8_t * size);    // get serial message (if any)
 
+    static bool validBaud(uint32_t baud);   // true if the link can be switched to baud
+    void setBaud(uint32_t baud);            // switch to baud once the reply in the tx buffer is sent
+    void cmdResult(bool valid);             // count a parsed command, a valid one confirms a new rate
+    bool checkBaud(uint32_t ms);            // do a pending switch, fall back if needed. Returns: true if it fell back
+
+    // return baud rate in use (or about to be)
+    uint32_t getBaud(void)                  { return pendingBaud ? pendingBaud : baud; }
+
+    // return true if the rate in use was confirmed by the Pi
+    bool     isConfirmed(void)              { return !pendingBaud && confirmed; }
+
+    // return garbled commands in a row
+    uint8_t  getErrors(void)                { return errors; }
+
+    // return count of falls back to PI_SERIAL_BAUD
+    uint16_t getFallbacks(void)             { return fallbacks; }
+
+    // return free space in the tx buffer, a longer write waits for the link to send the rest
+    uint16_t txSpace(void)                  { return Serial.availableForWrite(); }
+
+    // return true if serial input is waiting to be read
+    bool available(void)                    { return Serial.available() > 0; }
+
 private:
     char msgBuf[PI_SERIAL_MSG_BUF_SIZE];
 
     uint8_t bufIdx;
     bool    cmdRecvd;
-};
+
+    uint32_t baud;          // rate in use
+    uint32_t pendingBaud;   // rate to switch to after the reply is sent (0 if none)
+    uint32_t baudTime;      // time of the last switch (ms)
+    bool     confirmed;     // Pi sent a valid command at the rate in use
+    uint8_t  errors;        // garbled commands in a row
+    uint16_t fallbacks;     // falls back to PI_SERIAL_BAUD
+};
@@ -0,0 +1,33 @@
+// file Profile.h - markers for cycle profiling the firmware under simavr
+
+// Each marker is a single write to the GPIOR0 register (one 'out' instruction, 1 cycle).  On real
+// hardware the register is unused and the write has no effect.  Under simavr, the keybusSim harness
+// (see sim/keybusSim.c and 'make profile') watches GPIOR0 and timestamps every write with the
+// simulated cycle count, which gives exact per-function cycle profiles and ISR latency.
+
+#pragma once
+
+#include <avr/io.h>
+
+#ifndef KEYBUS_PROFILE
+#define KEYBUS_PROFILE 1  // set to 0 to compile the markers out
+#endif
+
+// profile ids (keep in sync with profName[] in sim/keybusSim.c)
+enum {
+    PROF_LOOP     = 1,  // one pass of loop()
+    PROF_RECV_ISR = 2,  // SoftwareSerial::recv() called from pin change ISR
+    PROF_TX_CLI   = 3,  // interrupts disabled in SoftwareSerial::write()
+    PROF_PARSE_F7 = 4,  // USBprotocol::parseF7()
+    PROF_KEY_MSG  = 5   // USBprotocol::keyMsg()
+};
+
+#define PROF_EXIT_BIT  (0x80)  // or'd into id on function exit
+
+#if KEYBUS_PROFILE && defined(GPIOR0)
+#define PROF_ENTER(id)  (GPIOR0 = (id))
+#define PROF_EXIT(id)   (GPIOR0 = (id) | PROF_EXIT_BIT)
+#else
+#define PROF_ENTER(id)
+#define PROF_EXIT(id)
+#endif
@@ -0,0 +1,139 @@
+// file SpscRing.h - single producer, single consumer ring buffer for ISR <-> main loop queues
+//
+// One side (an ISR, say) only pushes and the other side only pops, so neither has to turn
+// interrupts off.  head and tail are free running byte counters, each written by one side only.
+// A byte load or store can't be split by an interrupt on the AVR, and an item is copied in before
+// the tail that publishes it is stored (and copied out before the head that frees its slot).
+// N must be a power of two, so indexes are masked into the array instead of using %, and at most
+// 128 so tail - head (0..N) fits in a byte.  The bulk push/pop move several items and publish
+// them with one index store.
+//
+// Header only, it builds for the host too (see native/ringBench.cpp)
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+template<typename T, size_t N>
+class SpscRing
+{
+    static_assert(N >= 2 && N <= 128 && (N & (N - 1)) == 0, "SpscRing size must be a power of two, 2 to 128");
+
+public:
+    SpscRing(void) : head(0), tail(0) {}    // Class constructor.  Returns: none
+
+    // empty the ring, only while neither side can push or pop
+    void      clear(void)                   { head = tail = 0; }
+
+    // producer side
+    bool      push(const T & item);               // add item. Returns: false if full
+    uint8_t   push(const T * items, uint8_t n);   // add up to n items. Returns: count added
+
+    // consumer side
+    bool      pop(T * item);                      // remove oldest item. Returns: false if empty
+    uint8_t   pop(T * items, uint8_t n);          // remove up to n items. Returns: count removed
+    const T * peek(void);                         // oldest item, without removing it. Returns: NULL if empty
+
+    // return count of items in the ring
+    uint8_t   available(void)               { return (uint8_t)(load(tail) - load(head)); }
+
+    // return count of free slots
+    uint8_t   space(void)                   { return N - available(); }
+
+private:
+    static const uint8_t MASK = N - 1;
+
+    // the other side's index changes under us, read it from memory each time.  On the AVR a
+    // compiler barrier after the load (acquire) keeps buf[] reads after it, and one before the
+    // store (release) keeps buf[] writes ahead of it.  On the host the ring is used between
+    // threads, so it needs acquire/release ordering from the cpu as well
+#if defined(__AVR__)
+    static uint8_t load(const uint8_t & i)
+    {
+        uint8_t v = *(const volatile uint8_t *)&i;
+        __asm__ __volatile__("" ::: "memory");
+        return v;
+    }
+    static void    store(uint8_t & i, uint8_t v) { __asm__ __volatile__("" ::: "memory"); *(volatile uint8_t *)&i = v; }
+#else
+    static uint8_t load(const uint8_t & i)  { return __atomic_load_n(&i, __ATOMIC_ACQUIRE); }
+    static void    store(uint8_t & i, uint8_t v) { __atomic_store_n(&i, v, __ATOMIC_RELEASE); }
+#endif
+
+    T       buf[N];
+    uint8_t head;   // count of items popped, written by the consumer only
+    uint8_t tail;   // count of items pushed, written by the producer only
+};
+
+// add item.  Returns: false if full
+template<typename T, size_t N>
+bool SpscRing<T, N>::push(const T & item)
+{
+    uint8_t t = tail;
+    if ((uint8_t)(t - load(head)) >= N)
+    {
+        return false;
+    }
+    buf[t & MASK] = item;
+    store(tail, t + 1);
+    return true;
+}
+
+// add up to n items.  Returns: count added
+template<typename T, size_t N>
+uint8_t SpscRing<T, N>::push(const T * items, uint8_t n)
+{
+    uint8_t t = tail;
+    uint8_t room = N - (uint8_t)(t - load(head));
+    if (n > room)
+    {
+        n = room;
+    }
+    for (uint8_t i=0; i < n; i++)
+    {
+        buf[(uint8_t)(t + i) & MASK] = items[i];
+    }
+    store(tail, t + n);
+    return n;
+}
+
+// remove oldest item.  Returns: false if empty
+template<typename T, size_t N>
+bool SpscRing<T, N>::pop(T * item)
+{
+    uint8_t h = head;
+    if (h == load(tail))
+    {
+        return false;
+    }
+    *item = buf[h & MASK];
+    store(head, h + 1);
+    return true;
+}
+
+// remove up to n items.  Returns: count removed
+template<typename T, size_t N>
+uint8_t SpscRing<T, N>::pop(T * items, uint8_t n)
+{
+    uint8_t h = head;
+    uint8_t count = (uint8_t)(load(tail) - h);
+    if (n > count)
+    {
+        n = count;
+    }
+    for (uint8_t i=0; i < n; i++)
+    {
+        items[i] = buf[(uint8_t)(h + i) & MASK];
+    }
+    store(head, h + n);
+    return n;
+}
+
+// oldest item, without removing it.  Returns: NULL if empty
+template<typename T, size_t N>
+const T * SpscRing<T, N>::peek(void)
+{
+    uint8_t h = head;
+    return h == load(tail) ? NULL : &buf[h & MASK];
+}
@@ -0,0 +1,128 @@
+// file ToneSeq.cpp - class for sequencing keypad tone and chime patterns locally
+
+// Entry/exit delay beeps, escalation and timeouts used to need the Pi to stream a new F7 at each
+// change, and the patterns jittered with the USB link.  The patterns now run here: the Pi starts one
+// with the TONE command, and the tone and chime of the current step are put on every F7 sent to the
+// keypads while it runs (see USBprotocol::setTone).  The keypad sounds a tone each time an F7 with
+// a tone is sent, so each step start forces an F7 out, and F7s are sent every f7 period in between.
+
+#include "ToneSeq.h"
+
+static const t_TonePattern tonePatterns[NUM_TONES] PROGMEM = {
+    //  name   steps rep  stop   steps {tone, chime, ms}
+    { "entry",   2,   1,   30,  { { 0x5, 0, 20000 }, { 0x4, 0, 10000 } } },
+    { "exit",    2,   1,   60,  { { 0x6, 0, 45000 }, { 0x4, 0, 15000 } } },
+    { "chime",   1,   1,    0,  { { 0x3, 1,  2000 } } },
+    { "beep3",   2,   3,    0,  { { 0x1, 0,   400 }, { 0x0, 0,   400 } } },
+    { "error",   2,   3,    0,  { { 0x4, 0,  1500 }, { 0x0, 0,   500 } } },
+    { "alarm",   1,   0,  240,  { { 0x7, 0, 60000 } } },
+};
+
+// init the class, no pattern running
+void ToneSeq::init(void)
+{
+    active = false;
+    changed = false;
+    pat = NUM_TONES;
+    stepIdx = rep = 0;
+    memset(&cur, 0, sizeof(cur));
+}
+
+// start pattern p from its first step.  stopSec overrides the pattern's auto stop time (0 for default)
+void ToneSeq::start(uint8_t p, uint16_t secs, uint32_t ms)
+{
+    if (p >= NUM_TONES)
+    {
+        return;
+    }
+    pat = p;
+    stepIdx = rep = 0;
+    stopSec = secs ? secs : pgm_read_word(&tonePatterns[p].stopSec);
+    startMs = ms;
+    active = true;
+    loadStep(ms);
+}
+
+// stop the running pattern, the F7 goes back to the Pi's own tone and chime
+void ToneSeq::stop(void)
+{
+    if (active)
+    {
+        active = false;
+        changed = true;
+        memset(&cur, 0, sizeof(cur));
+    }
+}
+
+// load the current step
+void ToneSeq::loadStep(uint32_t ms)
+{
+    memcpy_P(&cur, &tonePatterns[pat].step[stepIdx], sizeof(t_ToneStep));
+    stepMs = ms;
+    changed = true;
+}
+
+// step the pattern, called every loop pass. Returns: true if the F7 must be resent
+bool ToneSeq::update(uint32_t ms)
+{
+    if (active)
+    {
+        if (stopSec && ms - startMs >= (uint32_t)stopSec * 1000)
+        {
+            stop();
+        }
+        else if (ms - stepMs >= cur.ms)
+        {
+            if (++stepIdx >= pgm_read_byte(&tonePatterns[pat].numSteps))
+            {
+                uint8_t repeat = pgm_read_byte(&tonePatterns[pat].repeat);
+                stepIdx = 0;
+                if (rep < 0xFF)
+                    rep++;
+                if (repeat && rep >= repeat)
+                {
+                    stop();
+                }
+            }
+            if (active)
+            {
+                loadStep(ms);
+            }
+        }
+    }
+
+    bool ret = changed;
+    changed = false;
+    return ret;
+}
+
+// time to the auto stop (s), 0 if no pattern running or no time limit
+uint16_t ToneSeq::getSecsLeft(uint32_t ms)
+{
+    if (!active || !stopSec)
+    {
+        return 0;
+    }
+    uint32_t elapsed = (ms - startMs) / 1000;
+    return elapsed < stopSec ? stopSec - elapsed : 0;
+}
+
+// copy name of pattern p (TONE_NAME_LEN+1 bytes).  Names in the table are always terminated
+void ToneSeq::getName(uint8_t p, char * name)  // declared static
+{
+    strcpy_P(name, tonePatterns[p < NUM_TONES ? p : 0].name);
+}
+
+// find pattern by name (len chars, not terminated). Returns: NUM_TONES if not found
+uint8_t ToneSeq::find(const char * name, uint8_t len)  // declared static
+{
+    for (uint8_t p=0; p < NUM_TONES; p++)
+    {
+        if (len <= TONE_NAME_LEN && strncmp_P(name, tonePatterns[p].name, len) == 0 &&
+            pgm_read_byte(&tonePatterns[p].name[len]) == '\0')
+        {
+            return p;
+        }
+    }
+    return NUM_TONES;
+}
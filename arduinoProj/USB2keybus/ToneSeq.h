@@ -0,0 +1,82 @@
+// file ToneSeq.h - class for sequencing keypad tone and chime patterns locally
+
+#pragma once
+
+#include <Arduino.h>
+
+#define TONE_NAME_LEN     (5)  // max length of a pattern name
+#define TONE_MAX_STEPS    (4)  // max steps in a pattern
+#define TONE_MAX_SECS  (3600)  // max auto stop time given with the TONE command (s)
+
+// patterns, see tonePatterns[] in ToneSeq.cpp for the steps
+enum {
+    TONE_ENTRY = 0,  // entry delay, slow pulse then fast pulse for the last 10 s
+    TONE_EXIT  = 1,  // exit delay, slow pulse then fast pulse for the last 15 s
+    TONE_CHIME = 2,  // door chime, three chimes once
+    TONE_BEEP3 = 3,  // three single beeps
+    TONE_ERROR = 4,  // fast pulse bursts, rejected code
+    TONE_ALARM = 5,  // continuous tone until stopped or timed out
+    NUM_TONES
+};
+
+// one step of a pattern: tone nibble for F7 byte1, chime bit for byte3, held for ms
+typedef struct {
+    uint8_t  tone;
+    uint8_t  chime;
+    uint16_t ms;
+} t_ToneStep;
+
+// a named pattern.  Steps run in order, the whole pattern repeat times (0 runs until stopped or
+// timed out), and the pattern stops after stopSec seconds (0 for no time limit)
+typedef struct {
+    char       name[TONE_NAME_LEN+1];
+    uint8_t    numSteps;
+    uint8_t    repeat;
+    uint16_t   stopSec;
+    t_ToneStep step[TONE_MAX_STEPS];
+} t_TonePattern;
+
+class ToneSeq
+{
+public:
+    ToneSeq(void) {}                         // Class constructor.  Returns: none
+
+    void init(void);                         // init the class, no pattern running
+    void start(uint8_t p, uint16_t stopSec, uint32_t ms);  // start pattern p, stopSec 0 for its default
+    void stop(void);                         // stop the running pattern
+    bool update(uint32_t ms);                // step the pattern. Returns: true if the F7 must be resent
+
+    // return true if a pattern is running
+    bool    isActive(void)                   { return active; }
+
+    // return tone nibble of the current step
+    uint8_t getTone(void)                    { return cur.tone; }
+
+    // return chime bit of the current step
+    bool    getChime(void)                   { return cur.chime; }
+
+    // return running pattern (NUM_TONES if none)
+    uint8_t getPattern(void)                 { return active ? pat : NUM_TONES; }
+
+    // return current step and repeat of the running pattern
+    uint8_t getStep(void)                    { return stepIdx; }
+    uint8_t getRepeat(void)                  { return rep; }
+
+    uint16_t getSecsLeft(uint32_t ms);       // time to the auto stop (s), 0 if none
+
+    static void    getName(uint8_t p, char * name);         // copy name of pattern p
+    static uint8_t find(const char * name, uint8_t len);    // find pattern by name. Returns: NUM_TONES if not found
+
+private:
+    void loadStep(uint32_t ms);
+
+    bool       active;
+    bool       changed;   // output changed or a step started, F7 must be resent
+    uint8_t    pat;       // running pattern
+    uint8_t    stepIdx;   // current step
+    uint8_t    rep;       // completed passes of the pattern
+    uint16_t   stopSec;   // auto stop time (s), 0 for none
+    uint32_t   startMs;   // millis() at start
+    uint32_t   stepMs;    // millis() at start of current step
+    t_ToneStep cur;       // current step
+};
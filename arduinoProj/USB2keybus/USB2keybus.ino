@@ -1,34 +1,118 @@
 // USB2keybus.ino - implement adapter between alarm processor serial port and keybus protocol keypad
 
-#include "PiSerial.h"  // declare first to define SERIAL_RX_BUFFER_SIZE
+#include "PiSerial.h"
 #include <Arduino.h>
 #include "KeypadSerial.h"
 #include "USBprotocol.h"
 #include "Volts.h"
+#include "LoopMon.h"
+#include "KeyWindow.h"
+#include "EEStore.h"
+#include "Idle.h"
+#include "ToneSeq.h"
+#include "Profile.h"
+#include <util/crc16.h>
 
 #define PRINT_BUF_SIZE   (128)
 static char pBuf[PRINT_BUF_SIZE];  // sprintf buffer
 
-static const uint32_t KP_POLL_PERIOD =  330;  // how often to poll keypad (ms)
-static const uint32_t KP_F7_PERIOD   = 4000;  // how often to send F7 status message (ms)
-static const uint32_t VOLT_PERIOD    = 5000;  // how often to sample the voltage rails (ms)
-static const uint32_t MIN_TX_GAP     =   50;  // allow at least this many ms between transmits to keypads
-static const uint32_t READ_KEY_DELAY =   40;  // delay between keypad poll response and keypad read
+// poll/F7/volt periods, tx gaps, read delay, retransmit and EEPROM snapshot timing are runtime
+// tunable with the CFG command, see Config.cpp for defaults and ranges
+
+// display state and runtime tunables snapshotted to EEPROM, restored at reset so the keypads show
+// the last alarm state before the Pi reconnects
+typedef struct {
+    t_MesgF7 f7[2];                 // F7 pages
+    uint8_t  altMsgActive;          // alternate page in rotation
+    uint8_t  rel;                   // reliable key delivery on
+    uint8_t  merge;                 // merged keybus writes on
+    uint8_t  vote;                  // majority voted keybus receive on
+    uint8_t  idle;                  // idle sleep on
+    uint8_t  echo;                  // local code entry echo on
+    uint16_t loopBudget;            // loop stall budget (ms)
+    uint16_t failLevel[NUM_VOLTS];  // power fail trip levels
+    uint16_t cfg[NUM_CFG];          // CFG parameters
+} t_Snapshot;
 
 PiSerial     piSerial;     // piSerial class
 KeypadSerial kpSerial;     // keypadSerial class
 USBprotocol  usbProtocol;  // protocol class for converting msgs to/from USB serial
 Volts        volts;        // voltage monitoring class
+LoopMon      loopMon;      // main loop latency monitor
+KeyWindow    keyWindow;    // retransmit window for reliable key delivery
+EEStore      eeStore;      // wear-levelled EEPROM store for the snapshot
+Config       config;       // runtime tunable timing
+Idle         idle;         // idle sleep between loop passes
+ToneSeq      toneSeq;      // local tone/chime pattern sequencer
 
 uint32_t kpF7time;       // global, last time F7 message sent
 uint32_t kpPollTime;     // global, last time keypad was polled
 uint32_t voltTime;       // global, last time volt message sent
 uint32_t lastSendTime;   // global, last time message sent to keypad
+uint32_t eeTime;         // global, last time snapshot was checked
+uint16_t snapCrc;        // global, crc of last snapshot saved (or restored)
+bool     snapRestored;   // global, true if the snapshot was restored at reset
 
 bool     keyPadRead;     // if true, in keypad read mode
 uint8_t  keyPad;         // next keypad to read
 uint8_t  numKeyPads;     // number of keypads that responded to poll
 
+// ---------------------------------------- snapshot ----------------------------------------
+
+// push config values that live in other classes
+void applyConfig(void)
+{
+    keyWindow.setRetx(config.get(CFG_KEY_RETX), config.get(CFG_KEY_RETRIES));
+}
+
+// fill snapshot of display state and tunables.  Returns: crc of the snapshot
+uint16_t takeSnapshot(t_Snapshot * s)
+{
+    memset(s, 0, sizeof(t_Snapshot));
+    s->f7[0] = *usbProtocol.getPage(0);
+    s->f7[1] = *usbProtocol.getPage(1);
+    s->altMsgActive = usbProtocol.getAltActive();
+    s->rel = keyWindow.isEnabled();
+    s->merge = kpSerial.getMerge();
+    s->vote = kpSerial.getVote();
+    s->idle = idle.isEnabled();
+    s->echo = usbProtocol.getEcho();
+    s->loopBudget = loopMon.getBudget();
+    for (uint8_t r=0; r < NUM_VOLTS; r++)
+    {
+        s->failLevel[r] = volts.getFailLevel(r);
+    }
+    for (uint8_t p=0; p < NUM_CFG; p++)
+    {
+        s->cfg[p] = config.get(p);
+    }
+
+    uint16_t crc = 0xFFFF;
+    for (uint8_t i=0; i < sizeof(t_Snapshot); i++)
+    {
+        crc = _crc16_update(crc, ((const uint8_t *)s)[i]);
+    }
+    return crc;
+}
+
+// apply snapshot restored from EEPROM
+void restoreSnapshot(const t_Snapshot * s)
+{
+    usbProtocol.restoreF7(s->f7, s->altMsgActive);
+    keyWindow.setEnabled(s->rel);
+    kpSerial.setMerge(s->merge);
+    kpSerial.setVote(s->vote);
+    idle.setEnabled(s->idle);
+    usbProtocol.setEcho(s->echo);
+    loopMon.setBudget(s->loopBudget);
+    for (uint8_t r=0; r < NUM_VOLTS; r++)
+    {
+        volts.setFailLevel(r, s->failLevel[r]);
+    }
+    config.load(s->cfg);  // a value out of range keeps the default
+    applyConfig();
+}
+
 // ------------------------------------------ setup -----------------------------------------
 
 void setup(void)
@@ -37,10 +121,25 @@ void setup(void)
     piSerial.init();        // init class
     kpSerial.init();        // init class
     volts.init();           // init class
+    loopMon.init();         // init class
+    keyWindow.init();       // init class
+    config.init();          // init class
+    idle.init();            // init class
+    toneSeq.init();         // init class
+    eeStore.init();         // init class, finds newest snapshot
+
+    t_Snapshot snap;
+    snapRestored = eeStore.load(&snap, sizeof(snap));
+    if (snapRestored)       // show the last display state instead of the init message
+    {
+        restoreSnapshot(&snap);
+    }
+    snapCrc = takeSnapshot(&snap);
 
     uint32_t ms = millis();
   
     kpF7time = ms;
+    eeTime = ms;
     kpPollTime = ms;
     voltTime = ms;
     lastSendTime = ms;
@@ -50,91 +149,377 @@ void setup(void)
     numKeyPads = 0;
 }
 
+// -------------------------------------- power events --------------------------------------
+
+// send the power events queued by the ADC ISR, ahead of any other USB output.  Called at the top of
+// loop and after each blocking keybus step, so an event waits at most for the longest step (an F7,
+// ~124ms) plus room for its msg in the Serial tx buffer.  An event is only taken once its msg fits,
+// so lat in the msg runs up to the handoff to Serial
+void sendPowerEvents(void)
+{
+    uint8_t  pfRail;
+    bool     pfFail;
+    uint16_t pfLevel;
+    uint32_t pfLat;
+
+    while (volts.eventPending())
+    {
+        while (piSerial.txSpace() < POWER_MSG_LEN)
+        {
+            // wait for the link to drain, at most POWER_MSG_LEN bytes (~4ms at 115200)
+        }
+        volts.powerEvent(&pfRail, &pfFail, &pfLevel, &pfLat);
+        piSerial.write(usbProtocol.powerMsg(pBuf, PRINT_BUF_SIZE, pfRail, pfFail, pfLevel, pfLat));
+    }
+}
+
+// ------------------------------------------ idle ------------------------------------------
+
+// return time left until since + period has passed, matching the 'ms - since > period' checks in loop
+uint32_t timeLeft(uint32_t ms, uint32_t since, uint32_t period)
+{
+    uint32_t elapsed = ms - since;
+    return elapsed > period ? 0 : period - elapsed + 1;
+}
+
+// time until the scheduler in loop has something to do (ms)
+uint32_t idleTime(uint32_t ms)
+{
+    if (keyPadRead)
+    {
+        return timeLeft(ms, kpPollTime, config.get(CFG_READ_KEY_DELAY));
+    }
+
+    uint32_t gap = timeLeft(ms, lastSendTime,
+        kpSerial.getBusStats().txGap(config.get(CFG_MIN_TX_GAP_SHORT), config.get(CFG_MIN_TX_GAP)));
+    if (usbProtocol.f7Dirty() || usbProtocol.echoDirty())
+    {
+        return gap;
+    }
+
+    uint32_t poll = timeLeft(ms, kpPollTime, config.get(CFG_POLL_PERIOD));
+    uint32_t f7   = timeLeft(ms, kpF7time, usbProtocol.f7Periodic() ? config.get(CFG_F7_PERIOD) : config.get(CFG_F7_KEEPALIVE));
+    uint32_t next = poll < f7 ? poll : f7;
+    return next > gap ? next : gap;
+}
+
+// true if something arrived that the loop must handle (called by idle sleep with interrupts off)
+bool wakeCheck(void)
+{
+    return piSerial.available() || kpSerial.available() || volts.eventPending();
+}
+
 // ---------------------------------------- main loop ---------------------------------------
 
 void loop(void)
 {
+    PROF_ENTER(PROF_LOOP);
+    loopMon.start();
+
+    sendPowerEvents();  // power events detected by the ADC ISR go out before anything else
+
     uint8_t k = 0;
 
     if (kpSerial.read(&k, 0)) // if we have unhandled chars from keypad, consume them
     {
-        sprintf(pBuf, "WARN: unhandled keypad char %02x\n", k);
+        sprintf_P(pBuf, PSTR("WARN: unhandled keypad char %02x\n"), k);
         piSerial.write(pBuf);
     }
 
     if (piSerial.read())    // read any data available from console serial port
     {
+        loopMon.task(TASK_USB);
         uint8_t piMsgSize = 0;
         const char * piMsg = piSerial.getMsg(&piMsgSize);
 
         uint8_t msgType = usbProtocol.parseRecv(piMsg, piMsgSize);
+        piSerial.cmdResult(msgType != USB_CMD_UNKNOWN);  // a valid command confirms a new baud rate
 
-        if (msgType == 0xF7)
+        if (msgType == USB_CMD_F7)
+        {
+            // F7 content is tracked by USBprotocol, changed pages are pushed out by the scheduler below
+        }
+        else if (msgType == USB_CMD_SYNC)
+        {
+            piSerial.write(usbProtocol.syncMsg(pBuf, PRINT_BUF_SIZE, millis()));
+        }
+        else if (msgType == USB_CMD_ACK)
+        {
+            keyWindow.ack(usbProtocol.getCmdArg());
+        }
+        else if (msgType == USB_CMD_REL_Q)
+        {
+            piSerial.write(usbProtocol.relMsg(pBuf, PRINT_BUF_SIZE, keyWindow));
+        }
+        else if (msgType == USB_CMD_REL)
+        {
+            keyWindow.setEnabled(usbProtocol.getCmdArg());
+        }
+        else if (msgType == USB_CMD_CAL_Q)
+        {
+            piSerial.write(usbProtocol.calMsg(pBuf, PRINT_BUF_SIZE, kpSerial.getTiming()));
+        }
+        else if (msgType == USB_CMD_CAL)
+        {
+            if (usbProtocol.getCmdArg())
+            {
+                kpSerial.getTiming().startCal();     // tune delays as keys are pressed
+            }
+            else
+            {
+                kpSerial.getTiming().useDefaults();  // erase tuned delays
+            }
+        }
+        else if (msgType == USB_CMD_CFG_Q)
+        {
+            piSerial.write(usbProtocol.cfgMsg(pBuf, PRINT_BUF_SIZE, config, usbProtocol.getCmdParam()));
+        }
+        else if (msgType == USB_CMD_CFG)
+        {
+            // range checked by parser, set() also rejects gapshort above gap
+            if (config.set(usbProtocol.getCmdParam(), usbProtocol.getCmdArg()))
+            {
+                applyConfig();
+            }
+            else
+            {
+                sprintf_P(pBuf, PSTR("ERR_FMT: gapshort above gap at col %d '%s'\n"),
+                          (int)(strchr(piMsg, '=') - piMsg) + 1, piMsg);
+                piSerial.write(pBuf);
+            }
+        }
+        else if (msgType == USB_CMD_TONE_Q)
+        {
+            piSerial.write(usbProtocol.toneMsg(pBuf, PRINT_BUF_SIZE, toneSeq, millis()));
+        }
+        else if (msgType == USB_CMD_TONE)
+        {
+            if (usbProtocol.getCmdParam() < NUM_TONES)
+                toneSeq.start(usbProtocol.getCmdParam(), usbProtocol.getCmdArg(), millis());
+            else
+                toneSeq.stop();
+        }
+        else if (msgType == USB_CMD_ECHO)
         {
-            kpF7time = 0;  // always update keypad as soon as new F7 message arrives
+            usbProtocol.setEcho(usbProtocol.getCmdArg());
+        }
+        else if (msgType == USB_CMD_STATE_Q)
+        {
+            // header, both F7 pages and the config, see stateMsg
+            piSerial.write(usbProtocol.stateMsg(pBuf, PRINT_BUF_SIZE, kpSerial.getSeenMask(), keyWindow,
+                kpSerial.getMerge(), kpSerial.getVote(), idle));
+            piSerial.write(usbProtocol.f7PageMsg(pBuf, PRINT_BUF_SIZE, 0));
+            piSerial.write(usbProtocol.f7PageMsg(pBuf, PRINT_BUF_SIZE, 1));
+            piSerial.write(usbProtocol.cfgMsg(pBuf, PRINT_BUF_SIZE, config, NUM_CFG));
+        }
+        else if (msgType == USB_CMD_BAUD_Q)
+        {
+            piSerial.write(usbProtocol.baudMsg(pBuf, PRINT_BUF_SIZE, piSerial));
+        }
+        else if (msgType == USB_CMD_BAUD)
+        {
+            piSerial.setBaud(usbProtocol.getCmdArg());  // switched below, after this reply is sent
+            piSerial.write(usbProtocol.baudMsg(pBuf, PRINT_BUF_SIZE, piSerial));
+        }
+        else if (msgType == USB_CMD_IDLE_Q)
+        {
+            piSerial.write(usbProtocol.idleMsg(pBuf, PRINT_BUF_SIZE, idle));
+        }
+        else if (msgType == USB_CMD_IDLE)
+        {
+            idle.setEnabled(usbProtocol.getCmdArg());
+        }
+        else if (msgType == USB_CMD_EE_Q)
+        {
+            piSerial.write(usbProtocol.eeMsg(pBuf, PRINT_BUF_SIZE, eeStore, snapRestored));
+        }
+        else if (msgType == USB_CMD_MERGE)
+        {
+            kpSerial.setMerge(usbProtocol.getCmdArg());
+        }
+        else if (msgType == USB_CMD_VOTE)
+        {
+            kpSerial.setVote(usbProtocol.getCmdArg());
+        }
+        else if (msgType == USB_CMD_BUS_Q)
+        {
+            piSerial.write(usbProtocol.busMsg(pBuf, PRINT_BUF_SIZE, kpSerial.getBusStats(),
+                kpSerial.getBusStats().txGap(config.get(CFG_MIN_TX_GAP_SHORT), config.get(CFG_MIN_TX_GAP)),
+                kpSerial.getVote(), kpSerial.getVoteFixes()));
+        }
+        else if (msgType == USB_CMD_F7_Q)
+        {
+            piSerial.write(usbProtocol.f7StatMsg(pBuf, PRINT_BUF_SIZE, millis(), config.get(CFG_F7_PERIOD), KP_F7_AIR_MS, KP_POLL_AIR_MS));
+        }
+        else if (msgType == USB_CMD_LOOP_Q)
+        {
+            piSerial.write(usbProtocol.loopMsg(pBuf, PRINT_BUF_SIZE, loopMon));
+        }
+        else if (msgType == USB_CMD_LOOP)
+        {
+            loopMon.setBudget(usbProtocol.getCmdArg());
+            loopMon.clear();
+        }
+        else if (msgType == USB_CMD_PFAIL_Q)
+        {
+            piSerial.write(usbProtocol.pfailMsg(pBuf, PRINT_BUF_SIZE, volts));
+        }
+        else if (msgType == USB_CMD_PFAIL)
+        {
+            volts.setFailLevel(usbProtocol.getCmdRail(), usbProtocol.getCmdArg());
         }
         else if (msgType == 0)
         {
             // unknown console message
-            sprintf(pBuf, "ERR_FMT: garble/bad msg format '%s'\n", piMsg);
+            sprintf_P(pBuf, PSTR("ERR_FMT: garble/bad msg format at col %d '%s'\n"), usbProtocol.getErrPos(), piMsg);
             piSerial.write(pBuf);
         }
         piSerial.clearCmd();                       // mark command as processed
     }
 
+    // switch to a new USB baud rate, or fall back to the default if the Pi didn't confirm it
+    if (piSerial.checkBaud(millis()))
+    {
+        piSerial.write(usbProtocol.baudMsg(pBuf, PRINT_BUF_SIZE, piSerial));
+    }
+
     uint32_t ms = millis();  // milliseconds since start of run
 
+    // write the pending snapshot to EEPROM a byte at a time, take a new one if anything changed
+    eeStore.service();
+    if (ms - eeTime > config.get(CFG_EE_SAVE_PERIOD) && !eeStore.isBusy())
+    {
+        t_Snapshot snap;
+        uint16_t crc = takeSnapshot(&snap);
+        eeTime = ms;
+        if (crc != snapCrc && eeStore.save(&snap, sizeof(snap)))
+        {
+            snapCrc = crc;
+        }
+    }
+
+    // in reliable mode, resend one unacked key report per loop when its retransmit time is up
+    t_KeyEvent * ke = keyWindow.due(ms);
+    if (ke)
+    {
+        piSerial.write(usbProtocol.keyMsg(pBuf, PRINT_BUF_SIZE, ke->addr, ke->len, ke->data, ke->type,
+            ke->time, ke->seq));
+    }
+
+    usbProtocol.echoCheck(ms);  // end a stale local code entry echo
+
+    // step the tone sequencer, a new step or the end of the pattern pushes out an F7
+    if (toneSeq.update(ms))
+    {
+        usbProtocol.setTone(toneSeq.isActive(), toneSeq.getTone(), toneSeq.getChime());
+    }
+
+    // rails are sampled in the background by the ADC ISR, only send a msg when a rail moves
+    if (volts.update() && volts.changed() && ms - voltTime > config.get(CFG_VOLT_PERIOD))
+    {
+        loopMon.task(TASK_VOLT);
+        voltTime = ms;
+        volts.getMsg(pBuf, PRINT_BUF_SIZE);  // generate volts msg
+        piSerial.write(pBuf);
+    }
+
     if (keyPadRead)  // we are in keypad read mode
     {
-        if (ms - kpPollTime > READ_KEY_DELAY)  // after waiting the appropriate time after polling, read the keypad data
+        if (ms - kpPollTime > config.get(CFG_READ_KEY_DELAY))  // after waiting the appropriate time after polling, read the keypad data
         {
             // read the next keypad, send message to USB serial
+            loopMon.task(TASK_KP_READ);
             kpPollTime = ms;
 
-            uint8_t msgType = kpSerial.requestData(keyPad);
-            lastSendTime = millis();
-
-            if (msgType == KEYS_MESG)       // if true, key presses were returned for this keypad
-            {
-                piSerial.write(usbProtocol.keyMsg(pBuf, PRINT_BUF_SIZE,
-                    kpSerial.getAddr(keyPad), kpSerial.getKeyCount(), kpSerial.getKeys(), msgType));
-            }
-            else if (msgType != NO_MESG)  // we received some other type of message
+            // with merging on, the ack leaves the line low when another write can follow, and the
+            // next keypad (or a changed F7) goes out right away under the same preamble
+            do
             {
-                piSerial.write(usbProtocol.keyMsg(pBuf, PRINT_BUF_SIZE, 
-                    kpSerial.getAddr(keyPad), kpSerial.getRecvMsgLen(), kpSerial.getRecvMsg(), msgType));
-            }
+                bool more = keyPad + 1 < numKeyPads || usbProtocol.f7Dirty();
+                uint8_t msgType = kpSerial.requestData(keyPad, more);
 
-            if (++keyPad >= numKeyPads)  // this was the last keypad with data
-            {
-                keyPad = numKeyPads = 0;
-                keyPadRead = false;  // end keypad read mode
-            }
-            else
+                if (volts.eventPending())
+                {
+                    kpSerial.releaseHold();  // a power event goes out first, the next write takes its own preamble
+                    sendPowerEvents();
+                }
+
+                if (msgType != NO_MESG)  // key presses (KEYS_MESG) or some other type of message were returned
+                {
+                    uint8_t  len  = kpSerial.getDataLen();
+                    uint8_t *data = kpSerial.getData();
+                    uint16_t seq  = usbProtocol.nextKeySeq();
+
+                    usbProtocol.keyMsg(pBuf, PRINT_BUF_SIZE, kpSerial.getAddr(keyPad), len, data, msgType,
+                        kpSerial.getRecvTime(), seq);
+                    if (kpSerial.isHeld() && strlen(pBuf) > piSerial.txSpace())
+                    {
+                        kpSerial.releaseHold();  // USB write would wait for the link, too long to hold the line low
+                    }
+                    piSerial.write(pBuf);
+                    keyWindow.add(seq, kpSerial.getRecvTime(), kpSerial.getAddr(keyPad), msgType, len, data);
+                    if (msgType == KEYS_MESG)
+                    {
+                        usbProtocol.echoKeys(kpSerial.getAddr(keyPad), data, len, ms);  // masked echo, if on
+                    }
+                }
+
+                if (++keyPad >= numKeyPads)  // this was the last keypad with data
+                {
+                    keyPad = numKeyPads = 0;
+                    keyPadRead = false;  // end keypad read mode
+                }
+                else
+                {
+                    // still in keyPadRead mode
+                }
+            } while (keyPadRead && kpSerial.isHeld());
+
+            if (kpSerial.isHeld())  // line held low after the last ack for the changed F7
             {
-                // still in keyPadRead mode
+                loopMon.task(TASK_F7);
+                kpF7time = ms;
+                kpSerial.write(usbProtocol.getF7(), usbProtocol.getF7size());
             }
+            lastSendTime = millis();
+            sendPowerEvents();
         }
     }
-    else // not in a keypad read cycle, check if time to poll keypad, send F7 msg or send volt msg
+    else // not in a keypad read cycle, check if time to poll keypad or send F7 msg
     {
-        if (ms - lastSendTime > MIN_TX_GAP)  // min time gap between any type of msg pushed to keypads
+        // min time gap between any type of msg pushed to keypads, sized by the keybus time of the last one
+        if (ms - lastSendTime > kpSerial.getBusStats().txGap(config.get(CFG_MIN_TX_GAP_SHORT), config.get(CFG_MIN_TX_GAP)))
         {
             // there is an implied priority scheme here.  Once the min time between transmits 
             // expires, look for the next thing to do in this order:
-            //   1. push out a recv'd F7 msg
-            //   2. poll the keypad (so key presses are responsive)
-            //   3. push out a periodic F7 msg (no new F7 msg from RPi, just time to send one)
-            //   4. sample the system voltage levels
+            //   1. push out a recv'd F7 msg that changed what the keypads display
+            //   2. push out the masked code entry echo to the keypad being typed on
+            //   3. poll the keypad (so key presses are responsive)
+            //   4. push out a periodic F7 msg (no change from RPi, just time to send one).  If the
+            //      pages rotate or a tone is on, use the f7 period, otherwise only the slower keep-alive
+            // Changed F7s coalesce (only the newest content is sent), but a Pi that updates the display
+            // faster than the keybus can send it would still keep 1 and 2 busy and stop polling.  An F7
+            // can't be cut short once started, so when one more F7 and its gap would push the poll past
+            // its deadline (pollmax), the poll goes first
+            bool pollFirst = ms - kpPollTime + KP_F7_AIR_MS + config.get(CFG_MIN_TX_GAP) > config.get(CFG_POLL_MAX);
             
-            if (kpF7time == 0) // just received an F7 message from RPi, push it out
+            if (usbProtocol.f7Dirty() && !pollFirst) // just received a changed F7 message from RPi, push it out
             {
+                loopMon.task(TASK_F7);
                 kpF7time = ms;
                 kpSerial.write(usbProtocol.getF7(), usbProtocol.getF7size());
                 lastSendTime = millis();
             }
-            else if (ms - kpPollTime > KP_POLL_PERIOD)  // time to poll keypad
+            else if (usbProtocol.echoDirty() && !pollFirst)  // digit typed with local echo on, show it
+            {
+                loopMon.task(TASK_F7);
+                kpSerial.write(usbProtocol.getEchoF7(), usbProtocol.getF7size());
+                lastSendTime = millis();
+            }
+            else if (ms - kpPollTime > config.get(CFG_POLL_PERIOD) || pollFirst)  // time to poll keypad
             {
+                loopMon.task(TASK_POLL);
+                kpSerial.getBusStats().pollGap(ms - kpPollTime, config.get(CFG_POLL_MAX));
                 kpPollTime = ms;
                 if (kpSerial.poll())
                 {
@@ -144,23 +529,28 @@ void loop(void)
                 }
                 lastSendTime = millis();
             }
-            else if (ms - kpF7time > KP_F7_PERIOD)  // time to send periodic F7 msg
+            else if (ms - kpF7time > (usbProtocol.f7Periodic() ? config.get(CFG_F7_PERIOD) : config.get(CFG_F7_KEEPALIVE)))  // time to send periodic F7 msg
             {
+                loopMon.task(TASK_F7);
                 kpF7time = ms;
                 kpSerial.write(usbProtocol.getF7(), usbProtocol.getF7size());
                 lastSendTime = millis();
             }
-            else if (ms - voltTime > VOLT_PERIOD)    // if time to sample voltage rails
-            {
-                voltTime = ms;
-#if 0
-                volts.read();
-                volts.getMsg(pBuf, PRINT_BUF_SIZE);  // generate volts msg
-                piSerial.write(pBuf);
-#endif
-                lastSendTime = millis();
-            }
+            sendPowerEvents();  // events seen during the keybus step
         }
     }
+
+    if (loopMon.end())  // this iteration went over the stall budget
+    {
+        char task[TASK_NAME_LEN+1];
+        LoopMon::taskName(loopMon.getLastTask(), task);
+        sprintf_P(pBuf, PSTR("WARN: loop stall %lu us in %s\n"), loopMon.getLast(), task);
+        piSerial.write(pBuf);
+    }
+
+    PROF_EXIT(PROF_LOOP);
+
+    // sleep until the scheduler has something to do, or USB/keypad data or a power event arrives
+    idle.sleepFor(idleTime(millis()), wakeCheck);
 }
 
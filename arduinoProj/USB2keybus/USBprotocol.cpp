@@ -5,6 +5,7 @@
 
 #include "USBprotocol.h"
 #include "KeypadSerial.h"
+#include "Profile.h"
 
 // when arduino code inits, use these initial keypad values
 #define INIT_MSG  "F7 z=00 t=0 c=1 r=1 a=1 s=0 p=0 b=1 1=Arduino Init     2=Completed  v1.01"
@@ -13,17 +14,107 @@
 #define F7_MSG_ALT(s)        (*((s)+0) == 'F' && *((s)+1) == '7' && *((s)+2) == 'A')
 #define F7_MSG(s)            (*((s)+0) == 'F' && *((s)+1) == '7')
 
+// macro to determine if command starts with keyword k (a string literal)
+#define CMD_IS(s,len,k)      ((len) >= sizeof(k)-1 && strncmp_P((s), PSTR(k), sizeof(k)-1) == 0)
+
+// F7 arg chars.  Range compares, a table of char classes costs a flash read per char
+#define IS_TEXT(c)           ((uint8_t)((c) - ' ') <= '~' - ' ')  // printable char allowed in lcd text
+#define NOT_DIGIT            (0xFF)                                // hexVal/boolVal of a bad char
+
+// F7 command fields
+enum { FLD_Z, FLD_T, FLD_C, FLD_R, FLD_A, FLD_S, FLD_P, FLD_B, FLD_1, FLD_2, FLD_X, FLD_Y, NUM_F7_FIELDS };
+
+#define FLD_BIT(f)           ((uint16_t)1 << (f))
+
+// value of hex digit c (0-9, A-F, a-f). Returns: NOT_DIGIT if c is not one
+static inline uint8_t hexVal(char c)
+{
+    if ((uint8_t)(c - '0') <= 9)
+        return c - '0';
+    c |= 0x20;  // 'A'-'F' to 'a'-'f'
+    if ((uint8_t)(c - 'a') <= 5)
+        return c - 'a' + 10;
+    return NOT_DIGIT;
+}
+
+// value of bool digit c (0, 1). Returns: NOT_DIGIT if c is not one
+static inline uint8_t boolVal(char c)
+{
+    return (uint8_t)(c - '0') <= 1 ? c - '0' : NOT_DIGIT;
+}
+
+// find field index for parm char.  A switch, the compiler makes it a compare tree or jump table
+// where a scan of the key column costs a flash read per field. Returns: NUM_F7_FIELDS if not found
+static uint8_t findF7Field(char parm)
+{
+    switch (parm)
+    {
+    case 'z': return FLD_Z;
+    case 't': return FLD_T;
+    case 'c': return FLD_C;
+    case 'r': return FLD_R;
+    case 'a': return FLD_A;
+    case 's': return FLD_S;
+    case 'p': return FLD_P;
+    case 'b': return FLD_B;
+    case '1': return FLD_1;
+    case '2': return FLD_2;
+    case 'x': return FLD_X;
+    case 'y': return FLD_Y;
+    default:  return NUM_F7_FIELDS;
+    }
+}
+
+// replace an lcd line with n chars of text, zero padded.  The backlight bit in line1[0] is not
+// text, the caller clears it first. Returns: true if the text changed
+static bool setLine(char * line, const char * text, uint8_t n)
+{
+    if (n == LCD_LINE_LEN)  // Pi pads its lines, a fixed size compare and copy is quickest
+    {
+        bool changed = memcmp(line, text, LCD_LINE_LEN) != 0;
+        memcpy(line, text, LCD_LINE_LEN);
+        return changed;
+    }
+
+    bool changed = false;
+
+    for (uint8_t j=0; j < LCD_LINE_LEN; j++)
+    {
+        char c = j < n ? *(text+j) : 0;
+        changed |= *(line+j) != c;
+        *(line+j) = c;
+    }
+    return changed;
+}
+
 // init class
 void USBprotocol::init(void)
 {
     count = 0;
+    errPos = 0;
     altMsgActive = false;
+    f7Sends = f7DirtySends = f7Coalesced = 0;
+    keySeq = 0;
+    echoOn = false;
+    echoPending = false;
+    echoAddr = 0;
+    toneOn = toneChanged = false;
+    toneVal = 0;
+    toneChime = false;
+
+    for (uint8_t i=0; i < 2; i++)
+    {
+        version[i] = sentVersion[i] = 0;
+    }
+    resendMask = 0;
     
     // init F7 message structs
     initF7(&msgF7[0]);
     initF7(&msgF7[1]);
 
-    parseRecv(INIT_MSG, strlen(INIT_MSG));
+    char init[sizeof(INIT_MSG)];  // parsed in place, so copy it out of flash
+    strcpy_P(init, PSTR(INIT_MSG));
+    parseRecv(init, strlen(init));
 }
 
 // initialize F7 message struct
@@ -42,37 +133,269 @@ void USBprotocol::initF7(t_MesgF7 * pMsgF7)
 // parse received command string
 uint8_t USBprotocol::parseRecv(const char * msg, const uint8_t len)
 {
+    errPos = 0;
+    cmdArg = 0;
+
+    // F7 is the command the Pi sends most, so it is tested first.  'F7?' is too short to match
     if (len > 4 && F7_MSG_ALT(msg)) // an alt F7 command only updates the secondary F7 message
     {
+        bool changed;
+        PROF_ENTER(PROF_PARSE_F7);
+        uint8_t type = parseF7(msg+4, len-4, &msgF7[1], 4, &changed);  // parse the command after 'F7A '
+        PROF_EXIT(PROF_PARSE_F7);
+        if (type == 0)
+            return 0x0;
+        updateVersion(1, changed);
+        if (!altMsgActive)
+            forceResend(1);  // rotation starts, keypads have not seen page 1 even if it is unchanged
         altMsgActive = true;
-        return parseF7(msg+4, len-4, &msgF7[1]);  // parse the command after 'F7A '
+        endEcho();  // Pi answered the code entry, its display replaces the echo
+        return 0xF7;
     }
     else if (len > 4 && F7_MSG(msg)) // a primary F7 command sets altMsg false, so send F7A msg second if needed
     {
+        bool changed;
+        PROF_ENTER(PROF_PARSE_F7);
+        uint8_t type = parseF7(msg+3, len-3, &msgF7[0], 3, &changed);  // parse the command after 'F7 '
+        PROF_EXIT(PROF_PARSE_F7);
+        if (type == 0)
+            return 0x0;
+        updateVersion(0, changed);
         count = 0;  // zero count so primary F7 msg is the next one displayed
+        if (altMsgActive)
+            forceResend(0);  // rotation ends, keypads may be showing page 1, so put page 0 back now
         altMsgActive = false;
-        return parseF7(msg+3, len-3, &msgF7[0]);  // parse the command after 'F7 '
+        endEcho();  // Pi answered the code entry, its display replaces the echo
+        return 0xF7;
+    }
+    else if (len == 3 && CMD_IS(msg, len, "F7?"))
+    {
+        return USB_CMD_F7_Q;
+    }
+    else if (CMD_IS(msg, len, "SYNC "))
+    {
+        // token is echoed back, it must be one word
+        syncToken = msg+5;
+        syncLen = len-5;
+        for (uint8_t i=0; i < syncLen; i++)
+        {
+            if (*(syncToken+i) == ' ' || i >= SYNC_TOKEN_LEN)
+            {
+                errPos = 5 + i;
+                return USB_CMD_UNKNOWN;
+            }
+        }
+        return syncLen ? USB_CMD_SYNC : USB_CMD_UNKNOWN;
+    }
+    else if (CMD_IS(msg, len, "ACK "))
+    {
+        return parseUint(msg+4, len-4, 4, &cmdArg) && cmdArg <= 0xFFFF ? USB_CMD_ACK : USB_CMD_UNKNOWN;
+    }
+    else if (len == 4 && CMD_IS(msg, len, "REL?"))
+    {
+        return USB_CMD_REL_Q;
+    }
+    else if (CMD_IS(msg, len, "REL "))
+    {
+        return parseUint(msg+4, len-4, 4, &cmdArg) && cmdArg <= 1 ? USB_CMD_REL : USB_CMD_UNKNOWN;
+    }
+    else if (len == 4 && CMD_IS(msg, len, "CAL?"))
+    {
+        return USB_CMD_CAL_Q;
+    }
+    else if (CMD_IS(msg, len, "CAL "))
+    {
+        return parseUint(msg+4, len-4, 4, &cmdArg) && cmdArg <= 1 ? USB_CMD_CAL : USB_CMD_UNKNOWN;
+    }
+    else if (len == 4 && CMD_IS(msg, len, "CFG?"))
+    {
+        cmdParam = NUM_CFG;
+        return USB_CMD_CFG_Q;
+    }
+    else if (CMD_IS(msg, len, "CFG "))
+    {
+        return parseCfg(msg, len);
+    }
+    else if (len == 5 && CMD_IS(msg, len, "TONE?"))
+    {
+        return USB_CMD_TONE_Q;
+    }
+    else if (CMD_IS(msg, len, "TONE "))
+    {
+        return parseTone(msg, len);
+    }
+    else if (CMD_IS(msg, len, "ECHO "))
+    {
+        return parseUint(msg+5, len-5, 5, &cmdArg) && cmdArg <= 1 ? USB_CMD_ECHO : USB_CMD_UNKNOWN;
+    }
+    else if (len == 6 && CMD_IS(msg, len, "STATE?"))
+    {
+        return USB_CMD_STATE_Q;
+    }
+    else if (len == 5 && CMD_IS(msg, len, "BAUD?"))
+    {
+        return USB_CMD_BAUD_Q;
+    }
+    else if (CMD_IS(msg, len, "BAUD "))
+    {
+        return parseUint(msg+5, len-5, 5, &cmdArg) && PiSerial::validBaud(cmdArg) ? USB_CMD_BAUD : USB_CMD_UNKNOWN;
+    }
+    else if (len == 5 && CMD_IS(msg, len, "IDLE?"))
+    {
+        return USB_CMD_IDLE_Q;
+    }
+    else if (CMD_IS(msg, len, "IDLE "))
+    {
+        return parseUint(msg+5, len-5, 5, &cmdArg) && cmdArg <= 1 ? USB_CMD_IDLE : USB_CMD_UNKNOWN;
+    }
+    else if (len == 3 && CMD_IS(msg, len, "EE?"))
+    {
+        return USB_CMD_EE_Q;
+    }
+    else if (CMD_IS(msg, len, "MERGE "))
+    {
+        return parseUint(msg+6, len-6, 6, &cmdArg) && cmdArg <= 1 ? USB_CMD_MERGE : USB_CMD_UNKNOWN;
+    }
+    else if (CMD_IS(msg, len, "VOTE "))
+    {
+        return parseUint(msg+5, len-5, 5, &cmdArg) && cmdArg <= 1 ? USB_CMD_VOTE : USB_CMD_UNKNOWN;
+    }
+    else if (len == 4 && CMD_IS(msg, len, "BUS?"))
+    {
+        return USB_CMD_BUS_Q;
+    }
+    else if (len == 5 && CMD_IS(msg, len, "LOOP?"))
+    {
+        return USB_CMD_LOOP_Q;
+    }
+    else if (CMD_IS(msg, len, "LOOP "))
+    {
+        return parseUint(msg+5, len-5, 5, &cmdArg) && cmdArg <= 0xFFFF ? USB_CMD_LOOP : USB_CMD_UNKNOWN;
+    }
+    else if (len == 6 && CMD_IS(msg, len, "PFAIL?"))
+    {
+        return USB_CMD_PFAIL_Q;
+    }
+    else if (CMD_IS(msg, len, "PFAIL "))
+    {
+        // rail is a single digit followed by a space, then the level
+        if (len < 9 || *(msg+6) < '0' || *(msg+6) >= '0' + NUM_VOLTS || *(msg+7) != ' ')
+        {
+            errPos = 6;
+            return USB_CMD_UNKNOWN;
+        }
+        cmdRail = *(msg+6) - '0';
+        return parseUint(msg+8, len-8, 8, &cmdArg) && cmdArg <= 0xFFFF ? USB_CMD_PFAIL : USB_CMD_UNKNOWN;
     }
     return 0x0;  // received unknown command
 }
 
+// parse decimal arg that fills the rest of the command. Returns: true if valid
+bool USBprotocol::parseUint(const char * msg, uint8_t len, uint8_t col, uint32_t * val)
+{
+    uint32_t v = 0;
+    uint8_t  i = 0;
+
+    for ( ; i < len && *(msg+i) != '\0'; i++)
+    {
+        char c = *(msg+i);
+        if (c < '0' || c > '9' || v > 99999999)  // not a digit, or too many digits
+        {
+            errPos = col + i;
+            return false;
+        }
+        v = v * 10 + (c - '0');
+    }
+    if (i == 0)  // no digits
+    {
+        errPos = col;
+        return false;
+    }
+    *val = v;
+    return true;
+}
+
+// generate power event message
+const char * USBprotocol::powerMsg(char * buf, uint8_t bufLen, uint8_t rail, bool fail, uint16_t level, uint32_t latUs)
+{
+    // format is POWER FAIL rail=<N> v=0x<100ths of volts> lat=<us>  (or POWER OK when the rail recovers)
+    // lat is the time from detection in the ADC ISR to this message being handed to Serial, the
+    // caller only takes the event once the message fits in the Serial tx buffer
+
+    snprintf_P(buf, bufLen, fail ? PSTR("POWER FAIL rail=%u v=0x%04x lat=%lu\n") : PSTR("POWER OK rail=%u v=0x%04x lat=%lu\n"),
+        rail, level, latUs);
+    return (const char *)buf;
+}
+
+// generate power fail settings and stats message
+const char * USBprotocol::pfailMsg(char * buf, uint8_t bufLen, Volts & volts)
+{
+    // format is PFAIL levels=0x<rail0> 0x<rail1> 0x<rail2> trips=<N> maxlat=<us> lost=<N>
+    //   lost is the count of power events dropped because the queue from the ISR was full
+
+    uint8_t idx = 0;
+    idx += sprintf_P(buf+idx, PSTR("PFAIL levels="));
+    for (uint8_t i=0; i < NUM_VOLTS && bufLen - idx > 7; i++)
+    {
+        idx += sprintf_P(buf+idx, PSTR("0x%04x "), volts.getFailLevel(i));
+    }
+    snprintf_P(buf+idx, bufLen-idx, PSTR("trips=%u maxlat=%lu lost=%u\n"), volts.getTrips(), volts.getMaxLatency(),
+        volts.getLost());
+    return (const char *)buf;
+}
+
+// generate main loop latency message
+const char * USBprotocol::loopMsg(char * buf, uint8_t bufLen, LoopMon & mon)
+{
+    // format is LOOP max=<us> task=<name> last=<us> budget=<ms> over=<N> wdt=<N> hist=<N0> .. <N6>
+    // hist buckets are iteration times <256us, <1ms, <4ms, <16ms, <64ms, <256ms, longer
+
+    char task[TASK_NAME_LEN+1];
+    LoopMon::taskName(mon.getMaxTask(), task);
+
+    uint8_t idx = 0;
+    idx += snprintf_P(buf+idx, bufLen-idx, PSTR("LOOP max=%lu task=%s last=%lu budget=%u over=%u wdt=%u hist="),
+        mon.getMax(), task, mon.getLast(), mon.getBudget(),
+        mon.getOverruns(), mon.getWdtAlarms());
+    idx = min(idx, bufLen-1);  // snprintf returns the untruncated length
+    for (uint8_t b=0; b < LOOP_HIST_BUCKETS && bufLen - idx > 7; b++)
+    {
+        idx += sprintf_P(buf+idx, PSTR("%u "), mon.getHist(b));
+    }
+    sprintf_P(buf+idx-1, PSTR("\n"));
+    return (const char *)buf;
+}
+
 // generate message from data received from keypad
-const char * USBprotocol::keyMsg(char * buf, uint8_t bufLen, uint8_t addr, uint8_t len, uint8_t * pData, uint8_t type)
+const char * USBprotocol::keyMsg(char * buf, uint8_t bufLen, uint8_t addr, uint8_t len, const uint8_t * pData, uint8_t type,
+    uint32_t time, uint16_t seq)
 {
-    // format of message is KEYS_XX[N] key0 key1 ... keyN-1, where XX is keypad number, N is key count
-    // or                   UNK__XX[N] byte0 byte1 .. byteN-1 for unknown message from keypad XX with N bytes
+    // format of message is KEYS_XX[N] key0 key1 ... keyN-1 t=T q=Q, where XX is keypad number, N is key count
+    // or                   NAME_XX[N] byte0 byte1 .. byteN-1 t=T q=Q for other message from keypad XX with N bytes,
+    //   NAME is the mesg type name from kpMsgTypes[] in KeypadSerial.cpp (PWUP for the 0x87 power-up
+    //   mesg), or UNK_ for a mesg type not in the table
+    //   T is millis() when the keypad response was decoded, Q is the sequence number of this report
+    //   (from nextKeySeq(), incremented for every key/unknown report, so the host can detect lost
+    //   reports).  A retransmit in reliable mode repeats the original T and Q
+
+    PROF_ENTER(PROF_KEY_MSG);
+    char name[KP_MSG_NAME_LEN+1];
+    KeypadSerial::msgName(type, name);
 
     uint8_t idx = 0;
-    idx += sprintf(buf+idx, "%s_%2d[%02d] ", type == KEYS_MESG ? "KEYS" : "UNK_", addr, len);
-    for (uint8_t i=0; i < len && bufLen - idx > 6; i++)
+    idx += sprintf_P(buf+idx, PSTR("%s_%2d[%02d] "), name, addr, len);
+    for (uint8_t i=0; i < len && bufLen - idx > 6 + KEY_MSG_SUFFIX_LEN; i++)
     {
-        idx += sprintf(buf+idx, "0x%02x ", *(pData+i));
+        idx += sprintf_P(buf+idx, PSTR("0x%02x "), *(pData+i));
     }
-    sprintf(buf+idx-1, "\n");
+    sprintf_P(buf+idx, PSTR("t=%lu q=%u\n"), time, seq);
+    PROF_EXIT(PROF_KEY_MSG);
     return (const char *)buf;
 }
 
 // parse F7 command, form is F7[A] z=FC t=0 c=1 r=0 a=0 s=0 p=1 b=1 1=1234567890123456 2=ABCDEFGHIJKLMNOP
+//   fields may appear in any order, each is optional.  If any field is bad, the F7 mesg is left
+//   unchanged and the column of the error (counted from the start of the command) is saved in errPos
 //   z - zone             (byte arg)
 //   t - tone             (nibble arg)
 //   c - chime            (bool arg)
@@ -83,6 +406,8 @@ const char * USBprotocol::keyMsg(char * buf, uint8_t bufLen, uint8_t addr, uint8
 //   b - lcd-backlight-on (bool arg)
 //   1 - line1 text       (16-chars)
 //   2 - line2 text       (16-chars)
+//   x - line1 as hex     (32 hex digits, 16 bytes, for a line with chars text can't hold)
+//   y - line2 as hex     (32 hex digits)
 
 // BYTE1 tone notes
 //   00-03 - low two bits define chime count for each F7 msg (0 none, 1,2,3 chime count per msg)
@@ -94,122 +419,617 @@ const char * USBprotocol::keyMsg(char * buf, uint8_t bufLen, uint8_t addr, uint8
 // BYTE2 notes: bit(0x80) 1 -> ARMED-STAY, bit(0x10) 1 -> READY (1 when ok, 0 when exit delay)
 // BYTE3 notes: bit(0x20) 1 -> chime on, bit(0x08) 1 -> ac power ok, bit(0x04) 1 -> ARMED_AWAY
 
-uint8_t USBprotocol::parseF7(const char * msg, uint8_t len, t_MesgF7 * pMsgF7)
-{   
-    bool success = true;
-    bool lcd_backlight = false;
+uint8_t USBprotocol::parseF7(const char * msg, uint8_t len, t_MesgF7 * pMsgF7, uint8_t col, bool * pChanged)
+{
+    // one pass over the command: each arg is checked as it is read and kept in a local, hex and
+    // bool args as their value, text args as where they start and how long they are.  pMsgF7 is
+    // only written once the whole command is known to be good.  Fields may be given in any order
 
-    t_MesgF7 newF7;
-    t_MesgF7 * pNewF7 = &newF7;
-    memcpy(pNewF7, pMsgF7, sizeof(t_MesgF7)); // copy existing F7 mesg struct
+    uint8_t      val[FLD_B+1];   // value of each hex or bool arg
+    const char * text[2];        // line1 and line2 args
+    uint8_t      textLen[2];
+    char         hexLine[2][LCD_LINE_LEN];  // x and y args decoded, text[] points here for them
+    uint16_t     found = 0;      // bitmask of fields present in command
 
-    for (uint8_t i=0; i < len && *(msg+i) != '\0'; i++)  // msg pointer starts after 'F7 ' or 'F7A '
+    const char * p = msg;        // msg pointer starts after 'F7 ' or 'F7A '
+    const char * end = msg + len;
+    while (p < end && *p != '\0')
     {
-        if (*(msg+i) != ' ')  // skip over spaces
+        if (*p == ' ')  // skip over spaces
         {
-            char parm = *(msg+i);
-            i += 2;  // move past parm and '=', msg+i now points at arg 
+            p++;
+            continue;
+        }
+
+        uint8_t fld = findF7Field(*p);
+        if (fld >= NUM_F7_FIELDS)
+            return f7Error(col + (p - msg));     // unknown parm
+        if (p+1 >= end || *(p+1) != '=')
+            return f7Error(col + (p - msg) + 1); // parm not followed by '='
+        p += 2;                                  // move past parm and '=', p now points at arg
+        found |= FLD_BIT(fld);
 
-            switch (parm)
+        if (fld >= FLD_X)  // hex line, the 16 bytes as they are stored
+        {
+            uint8_t ln = fld - FLD_X;
+            for (uint8_t j=0; j < LCD_LINE_LEN; j++)
+            {
+                uint8_t hi = p < end ? hexVal(*p) : NOT_DIGIT;
+                if (hi == NOT_DIGIT)
+                    return f7Error(col + (p - msg));     // line cut short or a bad hex digit
+                uint8_t lo = p+1 < end ? hexVal(*(p+1)) : NOT_DIGIT;
+                if (lo == NOT_DIGIT)
+                    return f7Error(col + (p - msg) + 1);
+                hexLine[ln][j] = (hi << 4) | lo;
+                p += 2;
+            }
+            text[ln] = hexLine[ln];
+            textLen[ln] = LCD_LINE_LEN;
+            found |= FLD_BIT(FLD_1 + ln);            // applied as the line's text
+            if (p < end && *p != ' ' && *p != '\0')
+                return f7Error(col + (p - msg));     // arg too long
+            continue;
+        }
+        if (fld >= FLD_1)  // text, up to 16 printable chars (spaces too), may end early
+        {
+            uint8_t max = end - p < LCD_LINE_LEN ? end - p : LCD_LINE_LEN;
+            uint8_t n = 0;
+            if (max == LCD_LINE_LEN)  // Pi pads its lines, check a whole line without a test per char
             {
-            case 'z':
-                pNewF7->zone = GET_BYTE(*(msg+i), *(msg+i+1)); i += 2;
-                break;
-            case 't':
-                pNewF7->byte1 = GET_NIBBLE(*(msg+i)); i++;
-                break;
-            case 'c':
-                pNewF7->byte3 = SET_CHIME(pNewF7->byte3, GET_BOOL(*(msg+i))); i++;
-                break;
-            case 'r':
-                pNewF7->byte2 = SET_READY(pNewF7->byte2, GET_BOOL(*(msg+i))); i++;
-                break;
-            case 'a':
-                pNewF7->byte3 = SET_ARMED_AWAY(pNewF7->byte3, GET_BOOL(*(msg+i))); i++;
-                break;
-            case 's':
-                pNewF7->byte2 = SET_ARMED_STAY(pNewF7->byte2, GET_BOOL(*(msg+i))); i++;
-                break;
-            case 'p':
-                pNewF7->byte3 = SET_POWER(pNewF7->byte3, GET_BOOL(*(msg+i))); i++;
-                break;
-            case 'b':
-                lcd_backlight = GET_BOOL(*(msg+i)); i++;
-                break;
-            case '1':  // line1 arg must occur after 'b' parameter for this code to work
-                memset(pNewF7->line1, 0, LCD_LINE_LEN);
-                for (uint8_t j=0; j < LCD_LINE_LEN && i < len; j++)
-                {
-                    pNewF7->line1[j] = *(msg+i) & 0x7f; 
-                    i++;
-                }
-                pNewF7->line1[0] |= lcd_backlight ? 0x80 : 0x00;  // or in backlight bit
-                break;
-            case '2':
-                memset(pNewF7->line2, 0, LCD_LINE_LEN);
-                for (uint8_t j=0; j < LCD_LINE_LEN && i < len; j++)
-                {
-                    pNewF7->line2[j] = *(msg+i) & 0x7f; 
-                    i++;
-                }
-                break;
-            default:
-                success = false;
-                break;
+                uint8_t bad = 0;
+                for (uint8_t j=0; j < LCD_LINE_LEN; j++)
+                    bad |= !IS_TEXT(*(p+j));
+                n = bad ? 0 : LCD_LINE_LEN;
             }
+            while (n < max && IS_TEXT(*(p+n)))  // short or cut short text
+                n++;
+            text[fld - FLD_1] = p;
+            textLen[fld - FLD_1] = n;
+            p += n;
+            continue;
         }
+
+        uint8_t v = 0;
+        uint8_t n = fld == FLD_Z ? 2 : 1;        // z is a byte, t a nibble, the rest bools
+        do
+        {
+            uint8_t d = p >= end ? NOT_DIGIT : fld >= FLD_C ? boolVal(*p) : hexVal(*p);
+            if (d == NOT_DIGIT)
+                return f7Error(col + (p - msg)); // arg too short or contains a bad char, b= too
+            v = (v << 4) | d;
+            p++;
+        } while (--n);
+        val[fld] = v;
+
+        if (p < end && *p != ' ' && *p != '\0')
+            return f7Error(col + (p - msg));     // arg too long
     }
 
-    if (success)
+    // command is valid, apply the fields directly to the F7 mesg.  The bytes the fields
+    // set are kept to compare against, and lines note their own change, so no hash or copy of
+    // the whole mesg is needed to tell if the page changed
+
+    uint8_t  prev[4] = { pMsgF7->zone, pMsgF7->byte1, pMsgF7->byte2, pMsgF7->byte3 };
+    char     prevLine1 = pMsgF7->line1[0];
+    bool     changed = false;
+
+    if (found & FLD_BIT(FLD_Z))
+        pMsgF7->zone = val[FLD_Z];
+    if (found & FLD_BIT(FLD_T))
+        pMsgF7->byte1 = val[FLD_T];
+    if (found & FLD_BIT(FLD_C))
+        pMsgF7->byte3 = SET_CHIME(pMsgF7->byte3, val[FLD_C]);
+    if (found & FLD_BIT(FLD_R))
+        pMsgF7->byte2 = SET_READY(pMsgF7->byte2, val[FLD_R]);
+    if (found & FLD_BIT(FLD_A))
+        pMsgF7->byte3 = SET_ARMED_AWAY(pMsgF7->byte3, val[FLD_A]);
+    if (found & FLD_BIT(FLD_S))
+        pMsgF7->byte2 = SET_ARMED_STAY(pMsgF7->byte2, val[FLD_S]);
+    if (found & FLD_BIT(FLD_P))
+        pMsgF7->byte3 = SET_POWER(pMsgF7->byte3, val[FLD_P]);
+    if (found & FLD_BIT(FLD_1))
     {
-        memcpy(pMsgF7, pNewF7, sizeof(t_MesgF7)); // replace existing F7 mesg with updated version
+        pMsgF7->line1[0] &= 0x7f;  // backlight bit, set again below
+        changed |= setLine(pMsgF7->line1, text[0], textLen[0]);
+    }
+    if (found & FLD_BIT(FLD_2))
+        changed |= setLine(pMsgF7->line2, text[1], textLen[1]);
 
-        pMsgF7->chksum = 0;
+    // backlight bit lives in line1[0].  New line1 text without 'b' turns backlight off
+    if (found & (FLD_BIT(FLD_B) | FLD_BIT(FLD_1)))
+    {
+        bool lcd_backlight = (found & FLD_BIT(FLD_B)) ? val[FLD_B] : false;
+        pMsgF7->line1[0] = (pMsgF7->line1[0] & 0x7f) | (lcd_backlight ? 0x80 : 0x00);
+    }
 
-        for (uint8_t i=0; i < 44; i++)
-        {
-            pMsgF7->chksum += *(((uint8_t *)pMsgF7) + i);
-        }
+    *pChanged = changed || pMsgF7->line1[0] != prevLine1 || prev[0] != pMsgF7->zone ||
+                prev[1] != pMsgF7->byte1 || prev[2] != pMsgF7->byte2 || prev[3] != pMsgF7->byte3;
 
-        pMsgF7->chksum = 0x100 - pMsgF7->chksum;  // two's compliment
+    if (*pChanged)
+        setChksum(pMsgF7);  // same mesg keeps its checksum
+    return 0xF7;
+}
 
-        return 0xF7;
+// record the column of a parse error. Returns: 0 (failed to parse message)
+uint8_t USBprotocol::f7Error(uint8_t col)
+{
+    errPos = col;
+    return 0;
+}
+
+// calculate and store the F7 mesg checksum
+void USBprotocol::setChksum(t_MesgF7 * pMsgF7)
+{
+    uint8_t sum = 0;  // kept local, summing into chksum stores it on every byte
+
+    for (uint8_t i=0; i < 44; i++)
+    {
+        sum += *(((uint8_t *)pMsgF7) + i);
+    }
+
+    pMsgF7->chksum = 0x100 - sum;  // two's compliment
+}
+
+// bump the version of an F7 page if its content changed.  A tone/chime in the mesg sounds each
+// time the mesg is sent, so a resend of the same mesg with a tone set also counts as a change
+void USBprotocol::updateVersion(uint8_t page, bool changed)
+{
+    if (changed || (msgF7[page].byte1 & 0x07) != 0)
+    {
+        if (version[page] != sentVersion[page])
+            f7Coalesced++;  // last change not sent yet, only this newest one will be
+        version[page]++;
+    }
+}
+
+// send page next although its content did not change (the keypads show something else).  Not a
+// content change, so it doesn't count in f7DirtySends
+void USBprotocol::forceResend(uint8_t page)
+{
+    resendMask |= 1 << page;
+}
+
+// restore both F7 pages (from the EEPROM snapshot).  Tone/chime is cleared so a reset doesn't
+// replay a sound, and the pages are marked changed so they go out to the keypads right away
+void USBprotocol::restoreF7(const t_MesgF7 * pPages, bool alt)
+{
+    if (pPages[0].type != 0xF7 || pPages[1].type != 0xF7)
+    {
+        return;  // not F7 pages, keep the init message
+    }
+
+    for (uint8_t page=0; page < 2; page++)
+    {
+        msgF7[page] = pPages[page];
+        msgF7[page].byte1 &= ~0x07;
+        setChksum(&msgF7[page]);
+        updateVersion(page, true);
     }
-    return 0;  // failed to parse message
+    altMsgActive = alt;
 }
 
-// returned mesg always alternates between 2 stored messages (which may be the same)
+// returned mesg alternates between 2 stored messages (which may be the same) when the alternate
+// message is active.  A page that changed since it was last sent is returned first
 const uint8_t * USBprotocol::getF7(void)
 { 
+    uint8_t page = 0;
+
     if (altMsgActive)
-        return (const uint8_t *)&(msgF7[count++ & 0x1]);
-    else
-        return (const uint8_t *)&(msgF7[0]);
+    {
+        if (pageDirty(0))
+            page = 0;
+        else if (pageDirty(1))
+            page = 1;
+        else
+            page = count & 0x1;
+        count = page + 1;  // other page is next in rotation
+    }
+
+    f7Sends++;
+    if (version[page] != sentVersion[page])
+        f7DirtySends++;
+    sentVersion[page] = version[page];
+    resendMask &= ~(1 << page);
+    echoPending = echoAddr != 0;  // this F7 goes to every keypad, put the echo back on its keypad
+    toneChanged = false;
+
+    if (toneOn)  // tone sequencer running, send the page with its tone/chime
+    {
+        toneF7 = msgF7[page];
+        toneF7.byte1 = (toneF7.byte1 & ~0x07) | toneVal;
+        toneF7.byte3 = SET_CHIME(toneF7.byte3, toneChime);
+        setChksum(&toneF7);
+        return (const uint8_t *)&toneF7;
+    }
+    return (const uint8_t *)&(msgF7[page]);
+}
+
+// put the tone sequencer's tone/chime on sent F7s (on false goes back to the Pi's own), and resend
+void USBprotocol::setTone(bool on, uint8_t tone, bool chime)
+{
+    toneOn = on;
+    toneVal = tone & 0x07;
+    toneChime = chime;
+    toneChanged = true;
+}
+
+// Local echo of code entry.  With echo on, digit keys from a keypad are shown right away as '*'s at
+// the end of line2 of an F7 sent only to that keypad, instead of waiting for the round trip through
+// the Pi.  The keys still go to the Pi as usual.  Echo ends on '*', '#' or a function key, after
+// ECHO_TIMEOUT_MS without keys, or when the Pi sends any F7 (it can cancel or replace the prompt).
+// However echo ends, page 0 is resent so the keypad shows the Pi's line2 again.
+void USBprotocol::echoKeys(uint8_t addr, const uint8_t * pKeys, uint8_t len, uint32_t ms)
+{
+    if (!echoOn || addr < 16 || addr > 23)
+    {
+        return;
+    }
+
+    for (uint8_t i=0; i < len; i++)
+    {
+        if (pKeys[i] > 0x09)  // '*', '#' or function key ends the entry
+        {
+            endEcho();
+            return;
+        }
+        if (echoAddr != addr)  // new entry, or a different keypad took over
+        {
+            echoAddr = addr;
+            echoDigits = 0;
+        }
+        if (echoDigits < 0xFF)
+            echoDigits++;
+        echoMs = ms;
+        echoPending = true;
+    }
+}
+
+// end echo after ECHO_TIMEOUT_MS without keys
+void USBprotocol::echoCheck(uint32_t ms)
+{
+    if (echoAddr && ms - echoMs > ECHO_TIMEOUT_MS)
+    {
+        endEcho();
+    }
+}
+
+// stop echoing digits.  The echo keypad still shows the masked digits, so page 0 goes out again
+// to restore its line2
+void USBprotocol::endEcho(void)
+{
+    if (echoAddr)
+    {
+        forceResend(0);
+    }
+    echoAddr = 0;
+    echoDigits = 0;
+    echoPending = false;
+}
+
+// F7 with the masked digits at the end of line2 of page 0, addressed only to the echo keypad
+const uint8_t * USBprotocol::getEchoF7(void)
+{
+    uint8_t n = echoDigits < ECHO_MAX_DIGITS ? echoDigits : ECHO_MAX_DIGITS;
+
+    echoF7 = msgF7[0];
+    echoF7.keypads = 1 << (echoAddr - 16);  // lsb is keypad 16
+    echoF7.byte1 &= ~0x07;                  // no tone/chime, the keypad already beeped for the key
+    memset(&echoF7.line2[LCD_LINE_LEN - n], '*', n);
+    setChksum(&echoF7);
+    echoPending = false;
+
+    return (const uint8_t *)&echoF7;
+}
+
+// generate clock sync reply
+const char * USBprotocol::syncMsg(char * buf, uint8_t bufLen, uint32_t time)
+{
+    // format is SYNC <token> t=T q=Q, token is from the SYNC command, T is millis() when the command was
+    // parsed and Q is the sequence number the next key report will use.  Host can use T against its
+    // own send/recv times to map the t= values of key reports onto its clock
+
+    snprintf_P(buf, bufLen, PSTR("SYNC %.*s t=%lu q=%u\n"), syncLen, syncToken, time, keySeq);
+    return (const char *)buf;
+}
+
+// generate reliable key delivery stats message
+const char * USBprotocol::relMsg(char * buf, uint8_t bufLen, KeyWindow & win)
+{
+    // format is REL on=<0|1> window=<size> pending=<N> sent=<N> acked=<N> retx=<N> dropped=<N> expired=<N>
+
+    snprintf_P(buf, bufLen, PSTR("REL on=%u window=%u pending=%u sent=%u acked=%u retx=%u dropped=%u expired=%u\n"),
+        win.isEnabled(), KEY_WINDOW_SIZE, win.getPending(), win.getAdded(), win.getAcked(), win.getRetx(),
+        win.getDropped(), win.getExpired());
+    return (const char *)buf;
+}
+
+// generate keybus timing calibration message
+const char * USBprotocol::calMsg(char * buf, uint8_t bufLen, KeybusTiming & kt)
+{
+    // format is CAL state=<idle|run|done|fail> param=<name> poll=<us> byte=<us> gap=<us> pre=<us> saved=<us>
+    //   param is the delay being calibrated (- when not running), saved is the keybus time saved per
+    //   poll cycle (one poll and one keypad read) compared to the default delays
+
+    char state[KT_NAME_LEN+1], param[KT_NAME_LEN+1];
+    KeybusTiming::stateName(kt.getState(), state);
+    KeybusTiming::paramName(kt.getState() == CAL_RUN ? kt.getCalParam() : NUM_KT, param);
+
+    snprintf_P(buf, bufLen, PSTR("CAL state=%s param=%s poll=%u byte=%u gap=%u pre=%u saved=%lu\n"),
+        state, param, kt.getVal(KT_POLL_LOW), kt.getVal(KT_BYTE), kt.getVal(KT_GAP), kt.getVal(KT_PRE), kt.getSavedUs());
+    return (const char *)buf;
+}
+
+// parse CFG <name>? or CFG <name>=<val>, value must be in the range of the parameter
+uint8_t USBprotocol::parseCfg(const char * msg, uint8_t len)
+{
+    uint8_t n = 4;  // end of name
+    while (n < len && msg[n] != '=' && msg[n] != '?')
+    {
+        n++;
+    }
+
+    cmdParam = Config::find(msg+4, n-4);
+    if (cmdParam >= NUM_CFG || n >= len)
+    {
+        errPos = 4;  // unknown parameter
+        return USB_CMD_UNKNOWN;
+    }
+    if (msg[n] == '?')
+    {
+        return n == len-1 ? USB_CMD_CFG_Q : USB_CMD_UNKNOWN;
+    }
+
+    t_CfgParam param;
+    Config::getParam(cmdParam, &param);
+    if (!parseUint(msg+n+1, len-n-1, n+1, &cmdArg))
+    {
+        return USB_CMD_UNKNOWN;
+    }
+    if (cmdArg < param.min || cmdArg > param.max)
+    {
+        errPos = n+1;  // value out of range
+        return USB_CMD_UNKNOWN;
+    }
+    return USB_CMD_CFG;
+}
+
+// parse TONE <name> [secs] command.  Pattern is returned in cmdParam (NUM_TONES for 'off'), secs in
+// cmdArg (0 for the pattern's default auto stop)
+uint8_t USBprotocol::parseTone(const char * msg, uint8_t len)
+{
+    uint8_t n = 5;  // end of name
+    while (n < len && msg[n] != ' ')
+    {
+        n++;
+    }
+
+    cmdArg = 0;
+    if (n-5 == 3 && strncmp_P(msg+5, PSTR("off"), 3) == 0)
+    {
+        cmdParam = NUM_TONES;
+        return n == len ? USB_CMD_TONE : USB_CMD_UNKNOWN;
+    }
+    cmdParam = ToneSeq::find(msg+5, n-5);
+    if (cmdParam >= NUM_TONES)
+    {
+        errPos = 5;  // unknown pattern
+        return USB_CMD_UNKNOWN;
+    }
+    if (n < len)
+    {
+        if (!parseUint(msg+n+1, len-n-1, n+1, &cmdArg))
+        {
+            return USB_CMD_UNKNOWN;
+        }
+        if (cmdArg > TONE_MAX_SECS)
+        {
+            errPos = n+1;  // auto stop time out of range
+            return USB_CMD_UNKNOWN;
+        }
+    }
+    return USB_CMD_TONE;
+}
+
+// generate config message
+const char * USBprotocol::cfgMsg(char * buf, uint8_t bufLen, Config & cfg, uint8_t p)
+{
+    // format is CFG <name>=<val> def=<N> min=<N> max=<N> for one parameter
+    // or        CFG <name>=<val> <name>=<val> ... for all parameters
+
+    t_CfgParam param;
+    uint8_t idx = 0;
+
+    if (p < NUM_CFG)
+    {
+        Config::getParam(p, &param);
+        snprintf_P(buf, bufLen, PSTR("CFG %s=%u def=%u min=%u max=%u\n"), param.name, cfg.get(p), param.def, param.min, param.max);
+        return (const char *)buf;
+    }
+
+    idx += sprintf_P(buf+idx, PSTR("CFG"));
+    for (p=0; p < NUM_CFG && bufLen - idx > CFG_NAME_LEN + 8; p++)
+    {
+        Config::getParam(p, &param);
+        idx += sprintf_P(buf+idx, PSTR(" %s=%u"), param.name, cfg.get(p));
+    }
+    sprintf_P(buf+idx, PSTR("\n"));
+    return (const char *)buf;
+}
+
+// generate tone sequencer message
+const char * USBprotocol::toneMsg(char * buf, uint8_t bufLen, ToneSeq & seq, uint32_t ms)
+{
+    // format is TONE off                                                 if no pattern running
+    // or        TONE <name> step=<N> rep=<N> tone=<T> chime=<C> left=<secs>  for the running pattern
+    //   left is the time to the auto stop, 0 if the pattern only ends by its repeat count or TONE off
+
+    if (!seq.isActive())
+    {
+        snprintf_P(buf, bufLen, PSTR("TONE off\n"));
+        return (const char *)buf;
+    }
+
+    char name[TONE_NAME_LEN+1];
+    ToneSeq::getName(seq.getPattern(), name);
+    snprintf_P(buf, bufLen, PSTR("TONE %s step=%u rep=%u tone=%1x chime=%c left=%u\n"), name, seq.getStep(),
+        seq.getRepeat(), seq.getTone(), seq.getChime() ? '1' : '0', seq.getSecsLeft(ms));
+    return (const char *)buf;
+}
+
+// generate idle sleep message
+const char * USBprotocol::idleMsg(char * buf, uint8_t bufLen, Idle & idle)
+{
+    // format is IDLE on=<0|1> frac=<permille> sleeps=<N> wakes=<N>
+    //   frac is the time the processor was asleep since the stats were cleared, sleeps is the count
+    //   of loop passes that slept, wakes the count of interrupts during those sleeps
+
+    snprintf_P(buf, bufLen, PSTR("IDLE on=%u frac=%u sleeps=%lu wakes=%lu\n"), idle.isEnabled(), idle.getFraction(),
+        idle.getSleeps(), idle.getWakes());
+    return (const char *)buf;
+}
+
+// generate USB serial rate message
+const char * USBprotocol::baudMsg(char * buf, uint8_t bufLen, PiSerial & pi)
+{
+    // format is BAUD rate=<baud> ok=<0|1> err=<N> fallback=<N> rxbuf=<bytes> txbuf=<bytes>
+    //   ok is 0 until the Pi confirms a new rate, err counts garbled commands in a row and fallback
+    //   the times the link went back to 115200
+
+    snprintf_P(buf, bufLen, PSTR("BAUD rate=%lu ok=%u err=%u fallback=%u rxbuf=%u txbuf=%u\n"), pi.getBaud(),
+        pi.isConfirmed(), pi.getErrors(), pi.getFallbacks(), SERIAL_RX_BUFFER_SIZE, SERIAL_TX_BUFFER_SIZE);
+    return (const char *)buf;
+}
+
+// generate EEPROM snapshot store message
+const char * USBprotocol::eeMsg(char * buf, uint8_t bufLen, EEStore & store, bool restored)
+{
+    // format is EE restored=<0|1> slot=<N>/<slots> seq=<N> saves=<N> busy=<0|1>
+    //   restored is 1 if the display state was restored from EEPROM at reset, slot and seq are those
+    //   of the newest record, saves counts records written since reset
+
+    snprintf_P(buf, bufLen, PSTR("EE restored=%u slot=%u/%u seq=%u saves=%u busy=%u\n"), restored, store.getSlot(),
+        store.getNumSlots(), store.getSeq(), store.getSaves(), store.isBusy());
+    return (const char *)buf;
+}
+
+// generate keybus utilisation message
+const char * USBprotocol::busMsg(char * buf, uint8_t bufLen, BusStats & bus, uint32_t gap, bool vote, uint16_t fixed)
+{
+    // format is BUS util=<N> poll=<N> f6=<N> resp=<N> ack=<N> f7=<N> gap=<ms> merged=<N> saved=<us> late=<N> maxgap=<ms>
+    //           vote=<0|1> fixed=<N>
+    //   util and per op values are permille of keybus time over the last BUS_WINDOW_SLOTS seconds
+    //   gap is the tx gap the scheduler is using after the last transaction
+    //   merged is the count of writes that shared the preamble of an ack (MERGE 1), saved is the
+    //   keybus time that saved per poll cycle
+    //   late is the count of polls that started after the pollmax deadline, maxgap the longest time
+    //   between polls
+    //   vote is 1 if received bits are majority voted (VOTE 1), fixed the count of received bits a
+    //   glitch was voted out of since reset (it keeps counting after VOTE 0 turns voting off)
+
+    char name[BUS_OP_NAME_LEN+1];
+    uint8_t idx = 0;
+    idx += sprintf_P(buf+idx, PSTR("BUS util=%u "), bus.getTotalUtil());
+    for (uint8_t op=0; op < NUM_BUS_OPS && bufLen - idx > 12; op++)
+    {
+        BusStats::opName(op, name);
+        idx += sprintf_P(buf+idx, PSTR("%s=%u "), name, bus.getUtil(op));
+    }
+    snprintf_P(buf+idx, bufLen-idx, PSTR("gap=%lu merged=%lu saved=%lu late=%lu maxgap=%lu vote=%u fixed=%u\n"), gap,
+        bus.getMerges(), bus.getSavedPerPoll(), bus.getPollLate(), bus.getMaxPollGap(), vote, fixed);
+    return (const char *)buf;
+}
+
+// generate F7 transmit stats message
+const char * USBprotocol::f7StatMsg(char * buf, uint8_t bufLen, uint32_t uptime, uint32_t period, uint16_t f7Ms, uint16_t pollMs)
+{
+    // format is F7STAT sent=<N> changed=<N> coalesced=<N> saved=<N> savedms=<ms> headroom=<polls/min>
+    //   coalesced - changed F7s replaced by a newer one before they were sent
+    //   saved    - F7 mesgs not sent compared to resending every period (estimated from uptime)
+    //   savedms  - keybus time not spent on those mesgs
+    //   headroom - extra keypad polls per minute that fit in the saved bus time
+
+    uint32_t legacy = uptime / period + f7DirtySends;  // sends if every period plus every change went out
+    uint32_t saved  = legacy > f7Sends ? legacy - f7Sends : 0;
+    uint32_t savedMs = saved * f7Ms;
+    uint32_t minutes = uptime / 60000;
+    uint32_t headroom = minutes ? (savedMs / pollMs) / minutes : 0;
+
+    snprintf_P(buf, bufLen, PSTR("F7STAT sent=%u changed=%u coalesced=%u saved=%lu savedms=%lu headroom=%lu\n"),
+        f7Sends, f7DirtySends, f7Coalesced, saved, savedMs, headroom);
+    return (const char *)buf;
 }
 
 
-#if 0
-// debug: print message struct into buf (broken, needs to be updated)
-const char * USBprotocol::printF7(char * buf)
+// generate state message, the first line of the reply to STATE?
+const char * USBprotocol::stateMsg(char * buf, uint8_t bufLen, uint8_t kpMask, KeyWindow & win, bool merge, bool vote,
+                                   Idle & idle)
 {
+    // format is STATE alt=<0|1> kp=<addr>[,<addr>..] rel=<0|1> merge=<0|1> vote=<0|1> idle=<0|1> echo=<0|1> lines=<N>
+    //   kp lists the keypads that have answered a poll since reset (- if none).  lines more follow:
+    //   both F7 pages (see f7PageMsg) and the CFG line, so a host that reconnects can resend only
+    //   what differs from its own state.  The F7A page is only in rotation when alt=1
+
     uint8_t idx = 0;
-    idx += sprintf(buf+idx, "%02x msg -> kp[%02x]\n", pMsgF7->type, pMsgF7->keypads);
-    idx += sprintf(buf+idx, "  zone=%02x, tone=%1x, chime=%c, power=%c\n", pMsgF7->zone, pMsgF7->byte1,
-               GET_CHIME(pMsgF7->byte3) ? '1' : '0', GET_POWER(pMsgF7->byte3) ? '1' : '0');
-    idx += sprintf(buf+idx, "  ready=%c, armed-away=%c, armed-stay=%c\n", GET_READY(pMsgF7->byte2) ? '1' : '0',
-        GET_ARMED_AWAY(pMsgF7->byte3) ? '1' : '0', GET_ARMED_STAY(pMsgF7->byte2) ? '1' : '0');
-    idx += sprintf(buf+idx, "  line1='");
-    for (uint8_t i=0; i < 16; i++)
-        *(buf+idx+i) = *(pMsgF7->line1+i) & 0x7F;
-    idx += 16;
-    idx += sprintf(buf+idx, "'\n");
-    idx += sprintf(buf+idx, "  line2='");
-    for (uint8_t i=0; i < 16; i++)
-        *(buf+idx+i) = *(pMsgF7->line2+i) & 0x7F;
-    idx += 16;
-    idx += sprintf(buf+idx, "'\n");
-    idx += sprintf(buf+idx, "checksum %02x\n", pMsgF7->chksum);
-    return (const char *)buf;
-}
-#endif
-
+    idx += snprintf_P(buf+idx, bufLen-idx, PSTR("STATE alt=%u kp="), altMsgActive);
+    if (!kpMask)
+    {
+        idx += snprintf_P(buf+idx, bufLen-idx, PSTR("-"));
+    }
+    for (uint8_t i=0; i < 8; i++)
+    {
+        if (kpMask & (1 << i))
+        {
+            idx += snprintf_P(buf+idx, bufLen-idx, PSTR("%u,"), 16 + i);
+        }
+    }
+    if (kpMask)
+    {
+        idx--;  // drop the last comma
+    }
+    snprintf_P(buf+idx, bufLen-idx, PSTR(" rel=%u merge=%u vote=%u idle=%u echo=%u lines=3\n"), win.isEnabled(),
+        merge, vote, idle.isEnabled(), echoOn);
+    return (const char *)buf;
+}
+
+// generate the F7 arg for lcd line ln (0 or 1): ' 1=<16 chars>', or ' x=<32 hex digits>' if the
+// line holds a char text can't. Returns: chars written
+static uint8_t lineArg(char * buf, uint8_t bufLen, const char * line, uint8_t ln)
+{
+    char l[LCD_LINE_LEN];
+    bool text = true;
+
+    memcpy(l, line, LCD_LINE_LEN);
+    if (ln == 0)
+        l[0] &= 0x7F;  // backlight bit, sent as b=
+    for (uint8_t i=0; i < LCD_LINE_LEN; i++)
+        text &= IS_TEXT(l[i]);
+
+    if (text)
+        return snprintf_P(buf, bufLen, PSTR(" %c=%.16s"), '1' + ln, l);
+
+    uint8_t idx = snprintf_P(buf, bufLen, PSTR(" %c="), 'x' + ln);
+    for (uint8_t i=0; i < LCD_LINE_LEN; i++)
+        idx += snprintf_P(buf+idx, bufLen-idx, PSTR("%02X"), (uint8_t)l[i]);
+    return idx;
+}
+
+// generate F7 page message, in the form of the F7/F7A command that sets it
+const char * USBprotocol::f7PageMsg(char * buf, uint8_t bufLen, uint8_t page)
+{
+    // format is F7[A] z=<hex> t=<hex> c=<0|1> r=<0|1> a=<0|1> s=<0|1> p=<0|1> b=<0|1> 1=<16 chars> 2=<16 chars>
+    //   a line with a char text can't hold (the zeros a short line is padded with, for one) is sent
+    //   as x=<32 hex digits> or y=<32 hex digits> instead, so the line can be sent back unchanged
+
+    const t_MesgF7 * pMsgF7 = &msgF7[page & 0x1];
+
+    uint8_t idx = sprintf_P(buf, page ? PSTR("F7A") : PSTR("F7"));
+    idx += snprintf_P(buf+idx, bufLen-idx, PSTR(" z=%02X t=%X c=%u r=%u a=%u s=%u p=%u b=%u"), pMsgF7->zone, pMsgF7->byte1 & 0x0F, GET_CHIME(pMsgF7->byte3) ? 1 : 0, GET_READY(pMsgF7->byte2) ? 1 : 0,
+        GET_ARMED_AWAY(pMsgF7->byte3) ? 1 : 0, GET_ARMED_STAY(pMsgF7->byte2) ? 1 : 0, GET_POWER(pMsgF7->byte3) ? 1 : 0,
+        (pMsgF7->line1[0] & 0x80) ? 1 : 0);
+    idx += lineArg(buf+idx, bufLen-idx, pMsgF7->line1, 0);
+    idx += lineArg(buf+idx, bufLen-idx, pMsgF7->line2, 1);
+    snprintf_P(buf+idx, bufLen-idx, PSTR("\n"));
+    return (const char *)buf;
+}
+
+
@@ -6,6 +6,53 @@
 
 #include <Arduino.h>
 #include "F7msg.h"
+#include "LoopMon.h"
+#include "Volts.h"
+#include "BusStats.h"
+#include "KeyWindow.h"
+#include "KeybusTiming.h"
+#include "EEStore.h"
+#include "Config.h"
+#include "Idle.h"
+#include "ToneSeq.h"
+#include "PiSerial.h"
+
+#define KEY_MSG_SUFFIX_LEN  (20)  // room for ' t=<ms> q=<seq>' at end of key msg
+#define SYNC_TOKEN_LEN      (20)  // max length of SYNC command token
+#define ECHO_MAX_DIGITS      (8)  // max masked digits shown at the end of line2
+#define ECHO_TIMEOUT_MS  (10000)  // local echo ends if no key for this long (ms)
+#define POWER_MSG_LEN       (42)  // longest POWER event msg, 'POWER FAIL rail=N v=0xNNNN lat=<10 digits>\n'
+
+// command types returned by parseRecv
+enum {
+    USB_CMD_UNKNOWN = 0x00,  // not a valid command
+    USB_CMD_LOOP_Q  = 0x01,  // LOOP?       - query main loop latency stats
+    USB_CMD_LOOP    = 0x02,  // LOOP <ms>   - set loop stall budget (0 to disable)
+    USB_CMD_PFAIL_Q = 0x03,  // PFAIL?      - query power fail levels and stats
+    USB_CMD_PFAIL   = 0x04,  // PFAIL <rail> <level> - set power fail level of rail (100ths of volts, 0 to disable)
+    USB_CMD_F7_Q    = 0x05,  // F7?         - query F7 transmit stats
+    USB_CMD_BUS_Q   = 0x06,  // BUS?        - query keybus utilisation
+    USB_CMD_SYNC    = 0x07,  // SYNC <token> - clock sync, reply with token and millis()
+    USB_CMD_ACK     = 0x08,  // ACK <seq>   - host received all key reports up to seq
+    USB_CMD_REL_Q   = 0x09,  // REL?        - query reliable key delivery stats
+    USB_CMD_REL     = 0x0A,  // REL <0|1>   - turn reliable key delivery off/on
+    USB_CMD_MERGE   = 0x0B,  // MERGE <0|1> - turn merging of keybus writes onto acks off/on
+    USB_CMD_CAL_Q   = 0x0C,  // CAL?        - query keybus timing calibration
+    USB_CMD_CAL     = 0x0D,  // CAL <0|1>   - back to default keybus timing / start calibration
+    USB_CMD_EE_Q    = 0x0E,  // EE?         - query EEPROM snapshot store
+    USB_CMD_CFG_Q   = 0x0F,  // CFG?        - dump config, CFG <name>? - query one parameter
+    USB_CMD_CFG     = 0x10,  // CFG <name>=<val> - set config parameter
+    USB_CMD_IDLE_Q  = 0x11,  // IDLE?       - query idle sleep stats
+    USB_CMD_IDLE    = 0x12,  // IDLE <0|1>  - turn idle sleep off/on (clears stats)
+    USB_CMD_ECHO    = 0x13,  // ECHO <0|1>  - turn local masked echo of code digits off/on
+    USB_CMD_TONE_Q  = 0x14,  // TONE?       - query running tone pattern
+    USB_CMD_TONE    = 0x15,  // TONE <name> [secs] - start tone pattern (auto stop after secs), TONE off - stop
+    USB_CMD_BAUD_Q  = 0x16,  // BAUD?       - query USB serial rate and fallback stats
+    USB_CMD_BAUD    = 0x17,  // BAUD <rate> - switch USB serial rate (115200, 250000, 500000, 1000000), see PiSerial.h
+    USB_CMD_STATE_Q = 0x18,  // STATE?      - dump F7 pages, keypads and config, for a host that reconnects
+    USB_CMD_VOTE    = 0x19,  // VOTE <0|1>  - turn majority vote of 3 samples per received keybus bit off/on
+    USB_CMD_F7      = 0xF7   // F7[A] ...   - update F7 message
+};
 
 class USBprotocol
 {
@@ -14,19 +61,114 @@ public:
 
     void init(void);                                // init the class
 
-    const char * keyMsg(char * buf, uint8_t bufLen, uint8_t addr, uint8_t len, uint8_t * pData, uint8_t type);
+    const char * keyMsg(char * buf, uint8_t bufLen, uint8_t addr, uint8_t len, const uint8_t * pData, uint8_t type,
+                        uint32_t time, uint16_t seq);
+    const char * relMsg(char * buf, uint8_t bufLen, KeyWindow & win);
+    const char * calMsg(char * buf, uint8_t bufLen, KeybusTiming & kt);
+    const char * eeMsg(char * buf, uint8_t bufLen, EEStore & store, bool restored);
+    const char * cfgMsg(char * buf, uint8_t bufLen, Config & cfg, uint8_t param);
+    const char * idleMsg(char * buf, uint8_t bufLen, Idle & idle);
+    const char * toneMsg(char * buf, uint8_t bufLen, ToneSeq & seq, uint32_t ms);
+    const char * baudMsg(char * buf, uint8_t bufLen, PiSerial & pi);
+    const char * stateMsg(char * buf, uint8_t bufLen, uint8_t kpMask, KeyWindow & win, bool merge, bool vote,
+                          Idle & idle);
+    const char * f7PageMsg(char * buf, uint8_t bufLen, uint8_t page);
+    const char * syncMsg(char * buf, uint8_t bufLen, uint32_t time);
+    const char * loopMsg(char * buf, uint8_t bufLen, LoopMon & mon);
+    const char * powerMsg(char * buf, uint8_t bufLen, uint8_t rail, bool fail, uint16_t level, uint32_t latUs);
+    const char * pfailMsg(char * buf, uint8_t bufLen, Volts & volts);
+    const char * busMsg(char * buf, uint8_t bufLen, BusStats & bus, uint32_t gap, bool vote, uint16_t fixed);
+    const char * f7StatMsg(char * buf, uint8_t bufLen, uint32_t uptime, uint32_t period, uint16_t f7Ms, uint16_t pollMs);
     uint8_t      parseRecv(const char * msg, const uint8_t len);
-    //const char * printF7(char * buf);
 
     const uint8_t * getF7(void);
     const uint8_t   getF7size(void) { return (const uint8_t)F7_MSG_SIZE; }
+    void            restoreF7(const t_MesgF7 * pPages, bool alt);
+
+    // return F7 page (0 primary, 1 alternate)
+    const t_MesgF7 * getPage(uint8_t page) { return &msgF7[page & 0x1]; }
+
+    // true if the alternate F7 page is in rotation
+    bool getAltActive(void)         { return altMsgActive; }
+
+    // true if an F7 page that is being displayed changed (or must be resent) since it was last sent
+    bool f7Dirty(void)              { return toneChanged || pageDirty(0) || (altMsgActive && pageDirty(1)); }
+
+    void setTone(bool on, uint8_t tone, bool chime);  // put the tone sequencer's tone/chime on sent F7s
+
+    // local code entry echo, see echoKeys()
+    void echoKeys(uint8_t addr, const uint8_t * pKeys, uint8_t len, uint32_t ms);
+    void echoCheck(uint32_t ms);            // end echo after ECHO_TIMEOUT_MS without keys
+    const uint8_t * getEchoF7(void);        // F7 with the masked digits for the echo keypad
+
+    // true if the echo F7 needs to be sent to the keypad
+    bool echoDirty(void)            { return echoPending; }
+
+    // turn local echo off/on
+    void setEcho(bool on)           { echoOn = on; endEcho(); }
+
+    // return true if local echo is on
+    bool getEcho(void)              { return echoOn; }
+
+    // true if the F7 must still be sent every period when nothing changed (pages rotate, or tone/chime each msg)
+    bool f7Periodic(void)           { return altMsgActive || (toneOn ? toneVal : msgF7[0].byte1 & 0x07) != 0; }
+
+    // return column of the last parse error (0 if command was not recognized)
+    uint8_t getErrPos(void)         { return errPos; }
+
+    // return numeric arg of the last parsed command
+    uint32_t getCmdArg(void)        { return cmdArg; }
+
+    // return sequence number for the next key report
+    uint16_t nextKeySeq(void)       { return keySeq++; }
+
+    // return rail number of the last parsed command
+    uint8_t  getCmdRail(void)       { return cmdRail; }
+
+    // return config parameter (NUM_CFG for all) or tone pattern (NUM_TONES for off) of the last parsed command
+    uint8_t  getCmdParam(void)      { return cmdParam; }
 
 private:
     bool    altMsgActive; // if true, altenate between primary and alternate messages
     uint8_t count;        // incremented each time getF7 is called
+    uint8_t errPos;       // column of last parse error
+    uint32_t cmdArg;      // numeric arg of last parsed command
+    uint8_t  cmdRail;     // rail number of last parsed command
+    uint8_t  cmdParam;    // config parameter of last parsed command
+    uint16_t keySeq;      // sequence number of next key report
+    const char * syncToken;  // token of last SYNC command (points into command buf)
+    uint8_t  syncLen;        // length of syncToken
     t_MesgF7 msgF7[2];    // 2 F7 mesgs, primary and alternate
+    uint8_t  version[2];      // bumped each time an F7 mesg changes
+    uint8_t  sentVersion[2];  // version of each F7 mesg last sent to keypads
+    uint8_t  resendMask;      // bit per page to send next although its content did not change
+    uint16_t f7Sends;         // count of F7 mesgs sent
+    uint16_t f7DirtySends;    // count of F7 mesgs sent because content changed
+    uint16_t f7Coalesced;     // count of changed F7 mesgs replaced before they were sent
+    bool     echoOn;          // local echo mode on
+    bool     echoPending;     // echo F7 needs to be sent
+    uint8_t  echoAddr;        // keypad the digits are echoed to (0 if no entry in progress)
+    uint8_t  echoDigits;      // digits entered so far
+    uint32_t echoMs;          // millis() of last echoed key
+    t_MesgF7 echoF7;          // page 0 with masked digits, sent only to the echo keypad
+    bool     toneOn;          // tone sequencer running, its tone/chime replace the Pi's
+    bool     toneChanged;     // sequencer step changed, F7 must be resent
+    uint8_t  toneVal;         // sequencer tone nibble for byte1
+    bool     toneChime;       // sequencer chime bit for byte3
+    t_MesgF7 toneF7;          // page with the sequencer's tone/chime, as sent
 
     void initF7(t_MesgF7 * pMsgF7);
-    uint8_t parseF7(const char * msg, uint8_t len, t_MesgF7 * pMsgF7);
+    uint8_t parseF7(const char * msg, uint8_t len, t_MesgF7 * pMsgF7, uint8_t col, bool * pChanged);
+    uint8_t f7Error(uint8_t col);
+    bool    parseUint(const char * msg, uint8_t len, uint8_t col, uint32_t * val);
+    uint8_t parseCfg(const char * msg, uint8_t len);
+    uint8_t parseTone(const char * msg, uint8_t len);
+    void    setChksum(t_MesgF7 * pMsgF7);
+    void    updateVersion(uint8_t page, bool changed);
+    void    forceResend(uint8_t page);
+
+    // true if page changed or must be resent since it was last sent
+    bool    pageDirty(uint8_t page)  { return version[page] != sentVersion[page] || (resendMask & (1 << page)); }
+    void    endEcho(void);
 };
 
@@ -1,26 +1,145 @@
 // file Volts.cpp - class for handling reading and outputing project voltages
 
+// The ADC runs continuously in the background.  Each conversion complete interrupt adds the result
+// to the current rail and starts the next conversion, so sampling costs a few us of ISR time every
+// ~104us and the main loop never waits on analogRead().  Each rail gets VOLT_OVERSAMPLE conversions
+// (plus one discarded conversion after the mux switch) before moving on to the next rail.
+
+// Power fail detection runs in the same ISR, comparing each finished rail sum against its trip
+// level.  A full pass over the rails is (VOLT_OVERSAMPLE + 1) * NUM_VOLTS conversions (~5.3ms), so
+// a rail drop is seen within that time.  Each fail and each recovery is queued on its own, so a
+// rail that fails and recovers before the main loop gets to it still reports both.  The main loop
+// reads pending events between its blocking keybus steps, and powerEvent() reports the time since
+// detection so the total can be measured.
+
 #include "Volts.h"
 
+Volts * Volts::pVolts = NULL;  // pointer to class for ISR
+
 // init
 void Volts::init(void)
 {
     for (uint8_t i=0; i < NUM_VOLTS; i++)
     {
         rail[i] = 0;
+        reported[i] = 0;
+        sum[i] = 0;
+        failLevel[i] = 0;
+        failSum[i] = 0;
+        okSum[i] = 0;
     }
+    trips = 0;
+    maxLatUs = 0;
+    failMask = 0;
+    lost = 0;
+    events.clear();
+    fresh = false;
+    acc = 0;
+    chan = 0;
+    count = 0;
+    pVolts = this;  // setup class pointer for ISR
+
+    setMux(0);
+    // enable ADC and conversion complete interrupt, clk/128 (125kHz @16MHz), start first conversion
+    ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0) | _BV(ADSC);
+}
+
+// select AVcc reference and the analog input for rail r
+inline void Volts::setMux(uint8_t r)  // declared static
+{
+    uint8_t ch = pin[r] - A0;
+    ADMUX = _BV(REFS0) | (ch & 0x07);
+#if defined(MUX5)
+    ADCSRB = (ADCSRB & ~_BV(MUX5)) | ((ch & 0x08) ? _BV(MUX5) : 0);
+#endif
 }
 
-// read the voltage rails. Returns: none
-void Volts::read(void)
+// copy the latest oversampled sums into rail[]. Returns: true if a new set of samples was ready
+bool Volts::update(void)
 {
-    int32_t v;
+    uint16_t s[NUM_VOLTS];
+
+    if (!fresh)
+        return false;
+
+    uint8_t oldSREG = SREG;
+    cli();
+    for (uint8_t i=0; i < NUM_VOLTS; i++)
+    {
+        s[i] = sum[i];
+    }
+    fresh = false;
+    SREG = oldSREG;
 
     for (uint8_t i=0; i < NUM_VOLTS; i++)
     {
-        v = analogRead(pin[i]) * scale[i];
-        rail[i] = (v >> 10) & 0x0FFFF;  // rail value is in 100ths of volts
+        rail[i] = toRail(i, s[i]);
     }
+    return true;
+}
+
+// convert rail sum to 100ths of volts
+uint16_t Volts::toRail(uint8_t r, uint16_t s)  // declared static
+{
+    uint32_t v = (uint32_t)s * scale[r];
+    return (v >> (10 + VOLT_OVERSAMPLE_SHIFT)) & 0x0FFFF;  // rail value is in 100ths of volts
+}
+
+// convert 100ths of volts to rail sum (rounded up)
+uint16_t Volts::toSum(uint8_t r, uint16_t level)  // declared static
+{
+    uint32_t s = (((uint32_t)level << (10 + VOLT_OVERSAMPLE_SHIFT)) + scale[r] - 1) / scale[r];
+    return s > 0xFFFF ? 0xFFFF : s;
+}
+
+// set power fail trip level of rail r in 100ths of volts, 0 turns detection off for the rail
+void Volts::setFailLevel(uint8_t r, uint16_t level)
+{
+    if (r >= NUM_VOLTS)
+        return;
+
+    failLevel[r] = level;
+    uint16_t fs = level ? toSum(r, level) : 0;
+    uint16_t os = level ? toSum(r, level + VOLT_HYSTERESIS) : 0;
+
+    uint8_t oldSREG = SREG;
+    cli();
+    failSum[r] = fs;
+    okSum[r] = os;
+    failMask &= ~(1 << r);
+    SREG = oldSREG;
+}
+
+// get the oldest queued power event, latUs is the time since the ISR saw it. Returns: true if an
+// event was pending
+bool Volts::powerEvent(uint8_t * r, bool * fail, uint16_t * level, uint32_t * latUs)
+{
+    t_PowerEvent ev;
+
+    if (!events.pop(&ev))  // the queue is lock free, no need to disable interrupts
+        return false;
+
+    *r = ev.rail;
+    *fail = ev.fail;
+    *level = toRail(ev.rail, ev.sum);
+    *latUs = micros() - ev.us;
+    if (*latUs > maxLatUs)
+        maxLatUs = *latUs;
+    if (ev.fail)
+        trips++;
+    return true;
+}
+
+// Returns: true if any rail moved more than VOLT_HYSTERESIS since the last msg
+bool Volts::changed(void)
+{
+    for (uint8_t i=0; i < NUM_VOLTS; i++)
+    {
+        uint16_t d = rail[i] > reported[i] ? rail[i] - reported[i] : reported[i] - rail[i];
+        if (d > VOLT_HYSTERESIS)
+            return true;
+    }
+    return false;
 }
 
 // generate voltages mesg in text string for sending to USB serial
@@ -28,11 +147,53 @@ void Volts::read(void)
 void Volts::getMsg(char * buf, uint8_t bufLen)
 {
     uint8_t idx = 0;
-    idx += sprintf(buf+idx, "VOLTS[%02d] ", 3);
+    idx += sprintf_P(buf+idx, PSTR("VOLTS[%02d] "), 3);
     for (uint8_t i=0; i < NUM_VOLTS && bufLen - idx > 6; i++)
     {
-        idx += sprintf(buf+idx, "0x%04x ", rail[i]);
+        idx += sprintf_P(buf+idx, PSTR("0x%04x "), rail[i]);
+        reported[i] = rail[i];
     }
-    sprintf(buf+idx-1, "\n");
+    sprintf_P(buf+idx-1, PSTR("\n"));
+}
+
+// ADC conversion complete, accumulate result and start the next conversion
+inline void Volts::adcIsr(void)  // declared static
+{
+    Volts * v = pVolts;
+
+    if (v->count > 0)  // first conversion after a mux switch is discarded
+        v->acc += ADC;
+
+    if (++v->count > VOLT_OVERSAMPLE)
+    {
+        uint8_t c = v->chan;
+        uint8_t bit = 1 << c;
+
+        v->sum[c] = v->acc;
+        if (v->failSum[c])  // power fail detection on for this rail
+        {
+            bool fail = v->failMask & bit;
+            if ((!fail && v->acc < v->failSum[c]) || (fail && v->acc > v->okSum[c]))
+            {
+                t_PowerEvent ev = { c, !fail, v->acc, micros() };
+                v->failMask ^= bit;
+                if (!v->events.push(ev) && v->lost < 0xFF)
+                    v->lost++;
+            }
+        }
+        v->acc = 0;
+        v->count = 0;
+        if (++v->chan >= NUM_VOLTS)
+        {
+            v->chan = 0;
+            v->fresh = true;
+        }
+        setMux(v->chan);
+    }
+    ADCSRA |= _BV(ADSC);  // start next conversion
+}
+
+ISR(ADC_vect)
+{
+    Volts::adcIsr();
 }
-
@@ -3,6 +3,7 @@
 #pragma once
 
 #include <Arduino.h>
+#include "SpscRing.h"
 
 #define NUM_VOLTS (3)  // number of voltages to monitor
 
@@ -13,16 +14,76 @@
 static const uint16_t scale[NUM_VOLTS] = { 2850, 2850, 2850 };
 static const uint8_t  pin[NUM_VOLTS]   = {   A0,   A1,   A2 };  // analog input pins monitoring rails
 
+#define VOLT_OVERSAMPLE_SHIFT  (4)                           // log2 of conversions averaged per rail sample
+#define VOLT_OVERSAMPLE        (1 << VOLT_OVERSAMPLE_SHIFT)  // conversions averaged per rail sample
+#define VOLT_HYSTERESIS        (10)                          // report when a rail moves more than this (100ths of volts)
+#define VOLT_EVENT_QUEUE        (8)                          // power events the ISR can queue ahead of the main loop
+
+// power fail or recovery of one rail, queued by the ADC ISR
+typedef struct {
+    uint8_t  rail;   // rail number
+    bool     fail;   // true for power fail, false for recovery
+    uint16_t sum;    // rail sum that crossed the level
+    uint32_t us;     // micros() at detection
+} t_PowerEvent;
+
 class Volts
 {
 public:
     Volts (void) {}                          // Class constructor.  Returns: none
 
-    void init(void);                         // init the class
-    void read(void);                         // read the voltages
+    void init(void);                         // init the class, start the ADC
+    bool update(void);                       // copy latest samples into rail[]. Returns: true if new samples
+    bool changed(void);                      // true if a rail moved more than VOLT_HYSTERESIS since last msg
     void getMsg(char * buf, uint8_t bufLen); // write the voltage message into the provided buf
 
+    // power fail detection, runs in the ADC ISR
+    void setFailLevel(uint8_t r, uint16_t level);  // trip when rail r drops below level (100ths of volts), 0 is off
+    bool powerEvent(uint8_t * r, bool * fail, uint16_t * level, uint32_t * latUs);  // get next pending power event
+
+    // return power fail trip level of rail i (in 100ths of volts)
+    uint16_t getFailLevel(uint8_t i)         { return i < NUM_VOLTS ? failLevel[i] : 0; }
+
+    // return count of power fail trips
+    uint16_t getTrips(void)                  { return trips; }
+
+    // return true if the ISR queued a power event
+    bool     eventPending(void)              { return events.available() != 0; }
+
+    // return count of power events lost to a full queue
+    uint8_t  getLost(void)                   { return lost; }
+
+    // return longest time from detection in the ISR to the event being read by the main loop
+    uint32_t getMaxLatency(void)             { return maxLatUs; }
+
+    // return voltage of rail i (in 100ths of volts)
+    uint16_t getRail(uint8_t i)              { return i < NUM_VOLTS ? rail[i] : 0; }
+
+    static inline void adcIsr(void) __attribute__((__always_inline__));
+    static Volts * pVolts;
+
 private:
-    uint16_t rail[NUM_VOLTS];  // voltage rails (in 100ths of volts)
+    uint16_t rail[NUM_VOLTS];      // voltage rails (in 100ths of volts)
+    uint16_t reported[NUM_VOLTS];  // rail values sent in the last msg
+    uint16_t failLevel[NUM_VOLTS]; // power fail trip levels (100ths of volts)
+    uint16_t trips;                // count of power fail trips
+    uint32_t maxLatUs;             // longest power event latency (us)
+
+    // written by the ADC ISR
+    volatile uint16_t sum[NUM_VOLTS];  // latest oversampled sum of conversions for each rail
+    volatile bool     fresh;           // true when a full set of rail sums is ready
+    uint16_t acc;                      // sum of conversions for the current rail
+    uint8_t  chan;                     // rail being converted
+    uint8_t  count;                    // conversions done for the current rail
+
+    volatile uint16_t failSum[NUM_VOLTS];   // trip power fail when rail sum drops below this (0 is off)
+    volatile uint16_t okSum[NUM_VOLTS];     // clear power fail when rail sum rises above this
+    volatile uint8_t  failMask;             // bit set for each rail in power fail
+    volatile uint8_t  lost;                 // power events lost to a full queue
+    SpscRing<t_PowerEvent, VOLT_EVENT_QUEUE> events;  // each fail and recovery, in the order seen
+
+    static uint16_t toSum(uint8_t r, uint16_t level);
+    static uint16_t toRail(uint8_t r, uint16_t s);
 
-};
+    static inline void setMux(uint8_t rail) __attribute__((__always_inline__));
+};
@@ -0,0 +1,65 @@
+// file F7Builder.cpp - build F7 display commands in the syntax USBprotocol::parseF7() accepts
+
+#include "F7Builder.h"
+
+#include <string.h>
+
+static const char hexDigit[] = "0123456789ABCDEF";
+static const char fieldKey[] = "ztcrasp";  // single digit fields after z, b is separate
+
+// no fields set, primary page
+void F7Builder::clear(void)
+{
+    altPage = false;
+    found = 0;
+    memset(val, 0, sizeof(val));
+    memset(line, ' ', sizeof(line));
+}
+
+// copy text padded with spaces to a full line, chars outside ' '..'~' become spaces
+void F7Builder::setLine(char * dst, const char * text)  // declared static
+{
+    for (uint8_t i=0; i < F7B_LINE_LEN; i++)
+    {
+        char c = *text ? *text++ : ' ';
+        dst[i] = (c >= ' ' && c <= '~') ? c : ' ';
+    }
+}
+
+// build the command (no newline).  Returns: terminated command, valid until the next build()
+const char * F7Builder::build(size_t * len)
+{
+    char * p = cmd;
+
+    *p++ = 'F';
+    *p++ = '7';
+    if (altPage)
+        *p++ = 'A';
+
+    for (uint8_t f=FB_Z; f <= FB_B; f++)
+    {
+        if (!(found & (1 << f)))
+            continue;
+        *p++ = ' ';
+        *p++ = f == FB_B ? 'b' : fieldKey[f];
+        *p++ = '=';
+        if (f == FB_Z)
+            *p++ = hexDigit[val[f] >> 4];
+        *p++ = hexDigit[val[f] & 0x0F];  // tone is a nibble, bools are 0/1
+    }
+    for (uint8_t l=0; l < 2; l++)
+    {
+        if (!(found & (1 << (FB_1 + l))))
+            continue;
+        *p++ = ' ';
+        *p++ = '1' + l;
+        *p++ = '=';
+        memcpy(p, line[l], F7B_LINE_LEN);
+        p += F7B_LINE_LEN;
+    }
+    *p = '\0';
+
+    if (len)
+        *len = p - cmd;
+    return cmd;
+}
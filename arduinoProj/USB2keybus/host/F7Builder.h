@@ -0,0 +1,49 @@
+// file F7Builder.h - build F7 display commands in the syntax USBprotocol::parseF7() accepts
+//
+// Form is F7[A] z=FC t=0 c=1 r=0 a=0 s=0 p=1 b=1 1=<16 chars> 2=<16 chars>.  Only the fields that
+// were set are sent, the Arduino keeps the others as they were.  Text runs to 16 chars and may
+// contain spaces, so lines are always padded to 16 chars and chars the keypad can't show are sent
+// as spaces.  Note the firmware turns the backlight off when line1 is sent without b=1.
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define F7B_LINE_LEN   (16)   // chars per lcd line
+#define F7B_CMD_LEN    (80)   // longest command, all fields set
+
+class F7Builder
+{
+public:
+    F7Builder(void)                          { clear(); }
+
+    void clear(void);                        // no fields set, primary page
+
+    F7Builder & alt(bool on)                 { altPage = on; return *this; }  // F7A, alternate page
+    F7Builder & zone(uint8_t z)              { return setField(FB_Z, z); }
+    F7Builder & tone(uint8_t t)              { return setField(FB_T, t & 0x0F); }
+    F7Builder & chime(bool on)               { return setField(FB_C, on); }
+    F7Builder & ready(bool on)               { return setField(FB_R, on); }
+    F7Builder & armAway(bool on)             { return setField(FB_A, on); }
+    F7Builder & armStay(bool on)             { return setField(FB_S, on); }
+    F7Builder & power(bool on)               { return setField(FB_P, on); }
+    F7Builder & backlight(bool on)           { return setField(FB_B, on); }
+    F7Builder & line1(const char * text)     { setLine(line[0], text); found |= 1 << FB_1; return *this; }
+    F7Builder & line2(const char * text)     { setLine(line[1], text); found |= 1 << FB_2; return *this; }
+
+    const char * build(size_t * len);        // build the command (no newline). Returns: command, terminated
+
+private:
+    // fields in the order they are sent, same as FLD_xxx in USBprotocol.cpp
+    enum { FB_Z, FB_T, FB_C, FB_R, FB_A, FB_S, FB_P, FB_B, FB_1, FB_2, NUM_FB };
+
+    F7Builder & setField(uint8_t f, uint8_t v) { val[f] = v; found |= 1 << f; return *this; }
+    static void setLine(char * dst, const char * text);
+
+    bool     altPage;
+    uint16_t found;                          // bitmask of fields set
+    uint8_t  val[FB_B+1];
+    char     line[2][F7B_LINE_LEN];
+    char     cmd[F7B_CMD_LEN];
+};
@@ -0,0 +1,529 @@
+// file KeybusClient.cpp - Pi side client for the USB2keybus serial protocol
+
+#include "KeybusClient.h"
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+
+// termios2, for rates with no Bxxx constant (250000).  It is in <asm/termbits.h>, which can't be
+// included along with <termios.h>
+struct termios2 {
+    tcflag_t c_iflag;
+    tcflag_t c_oflag;
+    tcflag_t c_cflag;
+    tcflag_t c_lflag;
+    cc_t     c_line;
+    cc_t     c_cc[19];
+    speed_t  c_ispeed;
+    speed_t  c_ospeed;
+};
+
+#ifndef BOTHER
+#define BOTHER  (0010000)  // c_cflag speed: use c_ispeed/c_ospeed
+#endif
+
+// macro to determine if a string of len chars starts with keyword k (a string literal)
+#define STR_IS(s,len,k)      ((len) >= sizeof(k)-1 && memcmp((s), (k), sizeof(k)-1) == 0)
+
+// cursor over the line being parsed
+typedef struct {
+    const char * p;
+    const char * end;
+} t_Cur;
+
+// skip spaces
+static void skipSpace(t_Cur * c)
+{
+    while (c->p < c->end && *c->p == ' ')
+        c->p++;
+}
+
+// parse decimal number. Returns: false if no digits
+static bool getDec(t_Cur * c, uint32_t * val)
+{
+    const char * start = c->p;
+    uint32_t v = 0;
+
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9')
+    {
+        v = v * 10 + (*c->p - '0');
+        c->p++;
+    }
+    *val = v;
+    return c->p != start;
+}
+
+// parse 0x prefixed hex number. Returns: false if not hex
+static bool getHex(t_Cur * c, uint32_t * val)
+{
+    if (c->end - c->p < 3 || c->p[0] != '0' || c->p[1] != 'x')
+        return false;
+    c->p += 2;
+
+    const char * start = c->p;
+    uint32_t v = 0;
+    for (; c->p < c->end; c->p++)
+    {
+        char ch = *c->p;
+        if (ch >= '0' && ch <= '9')      v = v << 4 | (ch - '0');
+        else if (ch >= 'a' && ch <= 'f') v = v << 4 | (ch - 'a' + 10);
+        else if (ch >= 'A' && ch <= 'F') v = v << 4 | (ch - 'A' + 10);
+        else break;
+    }
+    *val = v;
+    return c->p != start;
+}
+
+// match keyword k at the cursor and move past it. Returns: false if not there
+static bool getWord(t_Cur * c, const char * k)
+{
+    size_t n = strlen(k);
+    if ((size_t)(c->end - c->p) < n || memcmp(c->p, k, n) != 0)
+        return false;
+    c->p += n;
+    return true;
+}
+
+// find ' t=T q=Q' at the end of the line, and cut it off. Returns: false if not there
+static bool getStamp(t_Cur * c, t_KbEvent * ev)
+{
+    const char * q = c->end;
+    while (q > c->p && !(q[-1] == ' ' && q + 1 < c->end && q[0] == 'q' && q[1] == '='))
+        q--;
+    if (q == c->p)
+        return false;
+    const char * t = q - 1;
+    while (t > c->p && !(t[-1] == ' ' && t[0] == 't' && t[1] == '='))
+        t--;
+    if (t[0] != 't' || t[1] != '=')  // may start the args, a mesg with no data bytes
+        return false;
+
+    t_Cur s = { t + 2, q - 1 };
+    uint32_t time, seq;
+    if (!getDec(&s, &time) || s.p != s.end)
+        return false;
+    s.p = q + 2;
+    s.end = c->end;
+    if (!getDec(&s, &seq) || s.p != s.end)
+        return false;
+
+    ev->hasStamp = true;
+    ev->time = time;
+    ev->seq = seq;
+    c->end = t > c->p ? t - 1 : t;
+    return true;
+}
+
+// parse NAME_XX[NN] byte0 .. t=T q=Q, cursor is after the first word
+static bool parseKeyMsg(t_Cur * c, t_KbEvent * ev)
+{
+    // name is up to the last '_' before the '[', so UNK__16 is name UNK_ keypad 16
+    const char * open = (const char *)memchr(ev->name.p, '[', ev->name.len);
+    const char * us = open;
+    while (us > ev->name.p && us[-1] != '_')
+        us--;
+    if (us <= ev->name.p + 1)
+        return false;
+
+    t_Cur a = { us, open };
+    uint32_t addr, len;
+    skipSpace(&a);  // address is %2d
+    if (!getDec(&a, &addr) || a.p != open)
+        return false;
+    a.p = open + 1;
+    a.end = ev->name.p + ev->name.len;
+    if (!getDec(&a, &len) || !getWord(&a, "]") || a.p != a.end)
+        return false;
+
+    ev->name.len = us - 1 - ev->name.p;
+    ev->addr = addr;
+    if (STR_IS(ev->name.p, ev->name.len, "KEYS") && ev->name.len == 4)
+        ev->type = KB_EV_KEYS;
+    else if (STR_IS(ev->name.p, ev->name.len, "PWUP") && ev->name.len == 4)
+        ev->type = KB_EV_PWUP;
+    else
+        ev->type = KB_EV_UNK;
+
+    getStamp(c, ev);  // always there from current firmware, older firmware doesn't send it
+    for (;;)
+    {
+        uint32_t v;
+        skipSpace(c);
+        if (c->p >= c->end)
+            break;
+        if (!getHex(c, &v) || ev->len >= KB_MAX_DATA)
+            return false;
+        ev->data[ev->len++] = v;
+    }
+    return ev->len == len;
+}
+
+// parse one line (without the newline) into ev.  Returns: false if the line is garbled, ev then has
+// the line, name and args, and type KB_EV_STATUS
+bool KeybusClient::parseLine(const char * p, uint16_t len, t_KbEvent * ev)  // declared static
+{
+    memset(ev, 0, offsetof(t_KbEvent, data));  // data is only valid up to len, skip clearing it
+    ev->type = KB_EV_STATUS;
+    ev->line.p = p;
+    ev->line.len = len;
+
+    const char * sp = (const char *)memchr(p, ' ', len);
+    if (sp && sp > p && sp[-1] == '_' && sp + 1 < p + len && sp[1] >= '0' && sp[1] <= '9')
+        sp = (const char *)memchr(sp + 1, ' ', p + len - sp - 1);  // keypad address below 10, KEYS_ 7[01]
+    ev->name.p = p;
+    ev->name.len = sp ? sp - p : len;
+
+    t_Cur c = { p + ev->name.len, p + len };
+    skipSpace(&c);
+    ev->args.p = c.p;
+    ev->args.len = c.end - c.p;
+
+    uint32_t v;
+    if (STR_IS(p, len, "VOLTS["))
+    {
+        ev->type = KB_EV_VOLTS;
+        ev->name.len = 5;
+        for (uint8_t r=0; r < KB_NUM_RAILS; r++)
+        {
+            skipSpace(&c);
+            if (!getHex(&c, &v))
+                return false;
+            ev->rail[r] = v;
+        }
+        return true;
+    }
+    if (ev->name.len > 4 && p[ev->name.len-1] == ']' && memchr(p, '[', ev->name.len))
+    {
+        return parseKeyMsg(&c, ev);
+    }
+    if (STR_IS(p, ev->name.len, "POWER") && ev->name.len == 5)
+    {
+        ev->type = KB_EV_POWER;
+        ev->fail = getWord(&c, "FAIL");
+        if (!ev->fail && !getWord(&c, "OK"))
+            return false;
+        skipSpace(&c);
+        if (!getWord(&c, "rail=") || !getDec(&c, &v))
+            return false;
+        ev->addr = v;  // rail number
+        skipSpace(&c);
+        if (!getWord(&c, "v=") || !getHex(&c, &v))
+            return false;
+        ev->rail[0] = v;
+        return true;
+    }
+    if (STR_IS(p, ev->name.len, "SYNC") && ev->name.len == 4)
+    {
+        ev->type = KB_EV_SYNC;
+        if (!getStamp(&c, ev))
+            return false;
+        ev->args.len = c.end - ev->args.p;  // args is the token
+        return true;
+    }
+    if (STR_IS(p, len, "ERR_FMT:"))
+    {
+        ev->type = KB_EV_ERR;
+        ev->name.len = 7;
+        const char * col = NULL;
+        for (const char * s = c.p; s + 4 <= c.end; s++)
+        {
+            if (memcmp(s, "col ", 4) == 0)
+            {
+                col = s + 4;
+                break;
+            }
+        }
+        t_Cur n = { col, c.end };
+        if (!col || !getDec(&n, &v))
+            return false;
+        ev->col = v;
+        return true;
+    }
+    if (STR_IS(p, len, "WARN:"))
+    {
+        ev->type = KB_EV_WARN;
+        ev->name.len = 4;
+        return true;
+    }
+    return true;  // reply to a query, LOOP, BUS, CFG, ..
+}
+
+// Class constructor
+KeybusClient::KeybusClient(void)
+{
+    fd = epfd = -1;
+    ownFd = outWatched = false;
+    pCb = NULL;
+    pCtx = NULL;
+    rxLen = txLen = 0;
+    rxSkip = false;
+    lines = bytes = 0;
+    badLines = overflows = 0;
+}
+
+// Class destructor
+KeybusClient::~KeybusClient(void)
+{
+    close();
+}
+
+// map a baud rate to its termios speed. Returns: B0 if not supported
+static speed_t ttySpeed(uint32_t baud)
+{
+    switch (baud)
+    {
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 500000:  return B500000;
+        case 1000000: return B1000000;
+        default:      return B0;
+    }
+}
+
+// set the baud rate of tty fd, waiting for queued output first if drain. Returns: false on error (errno set)
+static bool setTtySpeed(int fd, uint32_t baud, bool drain)
+{
+    speed_t speed = ttySpeed(baud);
+    if (speed != B0)
+    {
+        struct termios tio;
+        if (tcgetattr(fd, &tio) != 0)
+            return false;
+        cfsetispeed(&tio, speed);
+        cfsetospeed(&tio, speed);
+        return tcsetattr(fd, drain ? TCSADRAIN : TCSANOW, &tio) == 0;
+    }
+
+    if (baud != 250000)  // the other U2X exact rate the firmware takes
+    {
+        errno = EINVAL;
+        return false;
+    }
+    struct termios2 tio2;
+    if (ioctl(fd, TCGETS2, &tio2) != 0)
+        return false;
+    tio2.c_cflag = (tio2.c_cflag & ~(CBAUD | CIBAUD)) | BOTHER;  // input speed 0 is the same as output
+    tio2.c_ispeed = tio2.c_ospeed = baud;
+    return ioctl(fd, drain ? TCSETSW2 : TCSETS2, &tio2) == 0;
+}
+
+// open dev and set it up as a raw, non-blocking tty at baud. Returns: false on error (errno set)
+bool KeybusClient::open(const char * dev, uint32_t baud)
+{
+    close();
+
+    fd = ::open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    ownFd = true;
+
+    if (!setTtySpeed(fd, baud, false))  // raw mode is set in setup()
+    {
+        close();
+        return false;
+    }
+
+    if (!setup())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+// change the baud rate of the open tty, once queued commands are sent.  The firmware switches after its
+// reply to 'BAUD <rate>', then wants a command at the new rate to confirm it (see PiSerial.h).
+// Returns: false on error (errno set)
+bool KeybusClient::setSpeed(uint32_t baud)
+{
+    return setTtySpeed(fd, baud, true);
+}
+
+// use an already open fd, for example the slave side of a pty. Returns: false on error (errno set)
+bool KeybusClient::attach(int f)
+{
+    close();
+    fd = f;
+    ownFd = false;
+    if (!setup())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+// put the fd in raw non-blocking mode and add it to a new epoll set
+bool KeybusClient::setup(void)
+{
+    struct termios tio;
+    if (isatty(fd) && tcgetattr(fd, &tio) == 0)
+    {
+        cfmakeraw(&tio);  // no echo, no CR/LF mapping
+        tio.c_cc[VMIN] = 0;
+        tio.c_cc[VTIME] = 0;
+        if (tcsetattr(fd, TCSANOW, &tio) != 0)
+            return false;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0)
+        return false;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        return false;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        return false;
+
+    rxLen = txLen = 0;
+    rxSkip = false;
+    outWatched = false;
+    return true;
+}
+
+// close the tty (if opened by open()) and the epoll fd
+void KeybusClient::close(void)
+{
+    if (epfd >= 0)
+        ::close(epfd);
+    if (fd >= 0 && ownFd)
+        ::close(fd);
+    fd = epfd = -1;
+    ownFd = false;
+}
+
+// add or remove EPOLLOUT, it is only watched while commands are queued
+void KeybusClient::watchOut(bool on)
+{
+    if (on == outWatched)
+        return;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+    outWatched = on;
+}
+
+// wait up to timeoutMs (-1 forever, 0 to poll) for tty io, read and dispatch all complete lines and
+// write queued commands.  Returns: count of lines handled, -1 on error (errno set)
+int KeybusClient::run(int timeoutMs)
+{
+    struct epoll_event ev;
+    int n = epoll_wait(epfd, &ev, 1, timeoutMs);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    if (n == 0)
+        return 0;
+
+    if ((ev.events & EPOLLOUT) && !writeTty())
+        return -1;
+    if (ev.events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        return readTty();
+    return 0;
+}
+
+// read everything available and dispatch each complete line.  Lines are parsed where they were read,
+// only a partial line at the end is moved to the start of the buffer.  Returns: lines handled, -1 on error
+int KeybusClient::readTty(void)
+{
+    int handled = 0;
+
+    for (;;)
+    {
+        ssize_t n = read(fd, rxBuf + rxLen, KB_RX_BUF_SIZE - rxLen);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                break;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        bytes += n;
+
+        char * start = rxBuf;
+        char * end = rxBuf + rxLen + n;
+        char * nl;
+        while ((nl = (char *)memchr(start, '\n', end - start)) != NULL)
+        {
+            uint16_t len = nl - start;
+            if (len > 0 && start[len-1] == '\r')
+                len--;
+
+            if (rxSkip)  // tail of an overflowed line
+                rxSkip = false;
+            else if (len > 0)
+            {
+                t_KbEvent ev;
+                if (!parseLine(start, len, &ev))
+                    badLines++;
+                lines++;
+                handled++;
+                if (pCb)
+                    pCb(&ev, pCtx);
+            }
+            start = nl + 1;
+        }
+
+        rxLen = end - start;
+        if (rxLen == KB_RX_BUF_SIZE)  // no newline in a full buffer, drop the line
+        {
+            overflows++;
+            rxSkip = true;
+            rxLen = 0;
+        }
+        else if (rxLen && start != rxBuf)
+            memmove(rxBuf, start, rxLen);
+    }
+    return handled;
+}
+
+// queue a command (without newline) for the tty.  Returns: false if the queue is full
+bool KeybusClient::send(const char * cmd, size_t len)
+{
+    if (txLen + len + 1 > KB_TX_BUF_SIZE)
+        return false;
+
+    memcpy(txBuf + txLen, cmd, len);
+    txBuf[txLen + len] = '\n';
+    txLen += len + 1;
+    return writeTty();
+}
+
+// write as much of the queue as the tty takes.  Returns: false on error (errno set)
+bool KeybusClient::writeTty(void)
+{
+    while (txLen)
+    {
+        ssize_t n = write(fd, txBuf, txLen);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return false;
+            break;
+        }
+        txLen -= n;
+        memmove(txBuf, txBuf + n, txLen);
+    }
+    watchOut(txLen != 0);
+    return true;
+}
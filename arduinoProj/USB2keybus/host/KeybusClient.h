@@ -0,0 +1,117 @@
+// file KeybusClient.h - Pi side client for the USB2keybus serial protocol
+//
+// Reads the Arduino's USB serial port without blocking (epoll), splits it into lines and parses
+// each line in place into a typed event, so consumers don't each re-implement the line formats
+// generated by USBprotocol.cpp.  Commands go out through a non-blocking write queue.  See
+// F7Builder.h for building F7 commands.
+//
+// Events point into the client's read buffer (no copy of the line is made), so an event and the
+// strings in it are only valid until the callback returns.
+//
+// build: make host (g++, Linux only)
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define KB_RX_BUF_SIZE    (4096)  // read buffer, must hold the longest line plus one read
+#define KB_TX_BUF_SIZE    (4096)  // queued commands not yet written to the tty
+#define KB_MAX_DATA         (32)  // max data bytes decoded from a key/unknown mesg
+#define KB_NUM_RAILS         (3)  // voltage rails in a VOLTS mesg
+
+// line types sent by the Arduino
+enum {
+    KB_EV_KEYS   = 0,  // KEYS_XX[N] key0 .. keyN-1 t=T q=Q
+    KB_EV_PWUP   = 1,  // PWUP_XX[N] byte0 .. t=T q=Q, keypad power-up mesg
+    KB_EV_UNK    = 2,  // UNK__XX[N] byte0 .. t=T q=Q, or another mesg type name from the firmware
+    KB_EV_VOLTS  = 3,  // VOLTS[03] 0xNNNN 0xNNNN 0xNNNN
+    KB_EV_POWER  = 4,  // POWER FAIL|OK rail=N v=0xNNNN lat=us
+    KB_EV_SYNC   = 5,  // SYNC <token> t=T q=Q
+    KB_EV_ERR    = 6,  // ERR_FMT: .. at col N '<cmd>'
+    KB_EV_WARN   = 7,  // WARN: ..
+    KB_EV_STATUS = 8,  // reply to a query command (LOOP, BUS, CFG, ..), see name
+    NUM_KB_EV
+};
+
+// a string in the read buffer, not terminated
+typedef struct {
+    const char * p;
+    uint16_t     len;
+} t_KbStr;
+
+// one parsed line.  Fields not used by the line type are zero
+typedef struct {
+    uint8_t  type;                // KB_EV_xxx
+    t_KbStr  line;                // whole line, without the newline
+    t_KbStr  name;                // first word (mesg type name for key mesgs, LOOP for LOOP stats, ..)
+    t_KbStr  args;                // rest of the line after the first word
+    uint8_t  addr;                // keypad address (key/pwup/unknown mesgs)
+    uint8_t  len;                 // count of data bytes (key/pwup/unknown mesgs)
+    uint16_t rail[KB_NUM_RAILS];  // VOLTS rails, POWER level in rail[0]
+    bool     fail;                // POWER FAIL (false for POWER OK)
+    uint16_t col;                 // ERR_FMT column
+    bool     hasStamp;            // t= and q= present
+    uint32_t time;                // t= (Arduino millis())
+    uint16_t seq;                 // q= (key report sequence number)
+    uint8_t  data[KB_MAX_DATA];   // data bytes (key codes for KEYS), first len are valid
+} t_KbEvent;
+
+typedef void (*t_KbEventCb)(const t_KbEvent * ev, void * ctx);
+
+class KeybusClient
+{
+public:
+    KeybusClient(void);                      // Class constructor.  Returns: none
+    ~KeybusClient(void);                     // Class destructor, closes the tty.  Returns: none
+
+    bool open(const char * dev, uint32_t baud);  // open and set up a tty. Returns: false on error (errno set)
+    bool attach(int fd);                     // use an open fd (a pty, for example). Returns: false on error
+    bool setSpeed(uint32_t baud);            // change the tty baud rate, after BAUD <rate>. Returns: false on error
+    void close(void);                        // close the tty and epoll fds
+
+    // set function called for each parsed line
+    void setCallback(t_KbEventCb cb, void * ctx) { pCb = cb; pCtx = ctx; }
+
+    int  run(int timeoutMs);                 // wait for and handle tty io. Returns: lines handled, -1 on error
+    bool send(const char * cmd, size_t len); // queue a command, newline added. Returns: false if queue full
+    bool txPending(void)                     { return txLen != 0; }
+
+    static bool parseLine(const char * p, uint16_t len, t_KbEvent * ev);  // Returns: false if garbled
+
+    // return epoll fd, so the client can be added to the caller's own epoll set
+    int      getEpollFd(void)                { return epfd; }
+
+    // return tty fd
+    int      getFd(void)                     { return fd; }
+
+    // return stats
+    uint64_t getLines(void)                  { return lines; }
+    uint64_t getBytes(void)                  { return bytes; }
+    uint32_t getBadLines(void)               { return badLines; }
+    uint32_t getOverflows(void)              { return overflows; }
+
+private:
+    bool setup(void);
+    int  readTty(void);
+    bool writeTty(void);
+    void watchOut(bool on);
+
+    int         fd;
+    int         epfd;
+    bool        ownFd;      // fd was opened by open(), close it in close()
+    bool        outWatched; // EPOLLOUT is in the epoll set
+    t_KbEventCb pCb;
+    void *      pCtx;
+
+    char        rxBuf[KB_RX_BUF_SIZE];
+    size_t      rxLen;      // bytes of a partial line at the start of rxBuf
+    bool        rxSkip;     // line overflowed rxBuf, drop the rest of it
+    char        txBuf[KB_TX_BUF_SIZE];
+    size_t      txLen;
+
+    uint64_t    lines;
+    uint64_t    bytes;
+    uint32_t    badLines;
+    uint32_t    overflows;
+};
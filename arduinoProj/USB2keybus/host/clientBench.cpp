@@ -0,0 +1,292 @@
+// file clientBench.cpp - throughput benchmark for KeybusClient and F7Builder
+//
+// With no args, runs without hardware:
+//   parse - parse a mix of Arduino lines from memory
+//   f7    - build F7 commands
+//   pty   - a child process plays the Arduino on the master side of a pseudo-terminal, writing the
+//           line mix as fast as it can and reading the F7 commands the client sends back.  The
+//           client reads the slave side through epoll, as it would /dev/ttyACM0
+// With a device, measures the real link: sends SYNC commands back to back for secs seconds and
+// reports round trip times, and counts the other lines the Arduino sends meanwhile.
+//
+// build: make host
+// usage: clientBench [<tty device> [baud] [secs]]
+
+#include "KeybusClient.h"
+#include "F7Builder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pty.h>
+#include <sys/wait.h>
+
+#define PARSE_LINES   (2000000)  // lines parsed from memory
+#define F7_BUILDS     (2000000)  // F7 commands built
+#define PTY_LINES     (200000)   // lines sent through the pty
+#define PTY_F7_EVERY  (50)       // client sends an F7 for every this many lines received
+
+// lines in the form the firmware sends them
+static const char * lineMix[] = {
+    "KEYS_16[02] 0x01 0x02 t=123456 q=17\n",
+    "KEYS_17[01] 0x0b t=123789 q=18\n",
+    "PWUP_16[09] 0x87 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x79 t=1000 q=1\n",
+    "UNK__18[03] 0x44 0x01 0xbb t=130000 q=19\n",
+    "VOLTS[03] 0x04b0 0x01f4 0x0148\n",
+    "POWER FAIL rail=0 v=0x03e8 lat=212\n",
+    "SYNC host42 t=130050 q=20\n",
+    "ERR_FMT: garble/bad msg format at col 7 'F7 z=0G'\n",
+    "WARN: loop stall 5120 us in poll\n",
+    "BUS util=412 poll=120 f6=40 resp=90 ack=30 f7=132 gap=50 merged=0 saved=0\n",
+};
+
+#define NUM_MIX  (sizeof(lineMix) / sizeof(lineMix[0]))
+
+// seconds since an arbitrary start
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+    uint64_t count[NUM_KB_EV];
+    uint64_t keys;         // key codes received
+    uint32_t syncSeen;     // SYNC replies
+} t_Tally;
+
+// count events by type
+static void tally(const t_KbEvent * ev, void * ctx)
+{
+    t_Tally * t = (t_Tally *)ctx;
+    t->count[ev->type]++;
+    if (ev->type == KB_EV_KEYS)
+        t->keys += ev->len;
+    if (ev->type == KB_EV_SYNC)
+        t->syncSeen++;
+}
+
+// parse the line mix from memory
+static void benchParse(void)
+{
+    t_KbEvent ev;
+    uint64_t bytes = 0;
+    uint32_t bad = 0;
+
+    double start = now();
+    for (uint32_t i=0; i < PARSE_LINES; i++)
+    {
+        const char * l = lineMix[i % NUM_MIX];
+        uint16_t len = strlen(l) - 1;
+        if (!KeybusClient::parseLine(l, len, &ev))
+            bad++;
+        bytes += len + 1;
+    }
+    double secs = now() - start;
+
+    printf("parse: %u lines in %.3f s, %.0f lines/s, %.1f MB/s, %u bad\n", PARSE_LINES, secs,
+        PARSE_LINES / secs, bytes / secs / 1e6, bad);
+}
+
+// build F7 commands
+static void benchF7(void)
+{
+    F7Builder f7;
+    size_t len, total = 0;
+    char l2[F7B_LINE_LEN+1];
+
+    double start = now();
+    for (uint32_t i=0; i < F7_BUILDS; i++)
+    {
+        snprintf(l2, sizeof(l2), "Count %10u", i);
+        f7.clear();
+        f7.zone(i & 0xFF).tone(0).chime(true).ready(true).power(true).backlight(true)
+          .line1("DISARMED").line2(l2);
+        f7.build(&len);
+        total += len;
+    }
+    double secs = now() - start;
+
+    printf("f7:    %u commands in %.3f s, %.0f cmds/s, %.1f MB/s\n", F7_BUILDS, secs,
+        F7_BUILDS / secs, total / secs / 1e6);
+}
+
+// stand-in for the Arduino: write the line mix to the pty master, drain the commands sent back
+static void ptyArduino(int master)
+{
+    char out[16384];
+    char in[4096];
+    uint32_t sent = 0;
+    size_t len = 0, off = 0;
+
+    while (sent < PTY_LINES || off < len)
+    {
+        if (off == len)  // refill with whole lines
+        {
+            len = off = 0;
+            while (sent < PTY_LINES && len + 128 < sizeof(out))
+            {
+                const char * l = lineMix[sent++ % NUM_MIX];
+                size_t n = strlen(l);
+                memcpy(out + len, l, n);
+                len += n;
+            }
+        }
+        ssize_t n = write(master, out + off, len - off);
+        if (n > 0)
+            off += n;
+        while (read(master, in, sizeof(in)) > 0)  // master is non-blocking
+            ;
+    }
+    sleep(5);  // keep the master open until the parent has read everything
+    _exit(0);
+}
+
+// client reads the line mix through a pty, and sends F7 commands back
+static void benchPty(void)
+{
+    int master, slave;
+    if (openpty(&master, &slave, NULL, NULL, NULL) != 0)
+    {
+        printf("pty:   openpty failed: %s\n", strerror(errno));
+        return;
+    }
+
+    KeybusClient client;
+    if (!client.attach(slave))  // sets raw mode, so attach before the child starts writing
+    {
+        printf("pty:   attach failed: %s\n", strerror(errno));
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(slave);
+        fcntl(master, F_SETFL, O_NONBLOCK);
+        ptyArduino(master);
+    }
+    close(master);
+
+    t_Tally t;
+    memset(&t, 0, sizeof(t));
+    client.setCallback(tally, &t);
+
+    F7Builder f7;
+    f7.ready(true).power(true).backlight(true).line1("DISARMED");
+    uint32_t f7Sent = 0;
+    uint64_t nextF7 = PTY_F7_EVERY;
+
+    double start = now();
+    while (client.getLines() < PTY_LINES)
+    {
+        if (client.run(1000) <= 0 && !client.txPending() && client.getLines() < PTY_LINES)
+        {
+            if (now() - start > 30)
+                break;  // stand-in died
+        }
+        while (client.getLines() >= nextF7)  // one run() may handle hundreds of lines
+        {
+            char l2[F7B_LINE_LEN+1];
+            size_t len;
+            snprintf(l2, sizeof(l2), "Lines %10lu", (unsigned long)nextF7);
+            const char * cmd = f7.line2(l2).build(&len);
+            if (!client.send(cmd, len))
+                break;  // queue full, the rest go once the stand-in has read some
+            f7Sent++;
+            nextF7 += PTY_F7_EVERY;
+        }
+    }
+    double secs = now() - start;
+
+    printf("pty:   %lu lines in %.3f s, %.0f lines/s, %.1f MB/s, %u bad, %u overflows, %u F7 sent\n",
+        (unsigned long)client.getLines(), secs, client.getLines() / secs, client.getBytes() / secs / 1e6,
+        client.getBadLines(), client.getOverflows(), f7Sent);
+    printf("       keys=%lu volts=%lu power=%lu sync=%lu err=%lu warn=%lu status=%lu\n",
+        (unsigned long)t.count[KB_EV_KEYS], (unsigned long)t.count[KB_EV_VOLTS],
+        (unsigned long)t.count[KB_EV_POWER], (unsigned long)t.count[KB_EV_SYNC],
+        (unsigned long)t.count[KB_EV_ERR], (unsigned long)t.count[KB_EV_WARN],
+        (unsigned long)t.count[KB_EV_STATUS]);
+
+    client.close();
+    close(slave);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+// round trip SYNC commands to a real Arduino for secs seconds
+static int benchDevice(const char * dev, uint32_t baud, uint32_t secs)
+{
+    KeybusClient client;
+    if (!client.open(dev, baud))
+    {
+        fprintf(stderr, "can't open %s: %s\n", dev, strerror(errno));
+        return 1;
+    }
+
+    t_Tally t;
+    memset(&t, 0, sizeof(t));
+    client.setCallback(tally, &t);
+
+    double start = now(), end = start + secs;
+    double rttMin = 1e9, rttMax = 0, rttSum = 0;
+    uint32_t syncs = 0, lost = 0;
+
+    while (now() < end)
+    {
+        char cmd[32];
+        int len = snprintf(cmd, sizeof(cmd), "SYNC b%u", syncs);
+        uint32_t seen = t.syncSeen;
+        double sent = now();
+        client.send(cmd, len);
+
+        while (t.syncSeen == seen && now() - sent < 1.0)
+        {
+            if (client.run(100) < 0)
+            {
+                fprintf(stderr, "read error: %s\n", strerror(errno));
+                return 1;
+            }
+        }
+        if (t.syncSeen == seen)
+        {
+            lost++;
+            continue;
+        }
+        double rtt = now() - sent;
+        rttMin = rtt < rttMin ? rtt : rttMin;
+        rttMax = rtt > rttMax ? rtt : rttMax;
+        rttSum += rtt;
+        syncs++;
+    }
+    double elapsed = now() - start;
+
+    printf("%s: %u syncs in %.1f s, %.0f/s, rtt min=%.2f avg=%.2f max=%.2f ms, %u lost\n", dev, syncs,
+        elapsed, syncs / elapsed, rttMin * 1e3, syncs ? rttSum / syncs * 1e3 : 0.0, rttMax * 1e3, lost);
+    printf("  other lines: keys=%lu volts=%lu power=%lu err=%lu warn=%lu status=%lu, %u bad\n",
+        (unsigned long)t.count[KB_EV_KEYS], (unsigned long)t.count[KB_EV_VOLTS],
+        (unsigned long)t.count[KB_EV_POWER], (unsigned long)t.count[KB_EV_ERR],
+        (unsigned long)t.count[KB_EV_WARN], (unsigned long)t.count[KB_EV_STATUS], client.getBadLines());
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1)
+    {
+        uint32_t baud = argc > 2 ? strtoul(argv[2], NULL, 0) : 115200;
+        uint32_t secs = argc > 3 ? strtoul(argv[3], NULL, 0) : 10;
+        return benchDevice(argv[1], baud, secs);
+    }
+
+    benchParse();
+    benchF7();
+    benchPty();
+    return 0;
+}
@@ -0,0 +1,257 @@
+// file clientTest.cpp - unit tests for the KeybusClient line parser and read path
+//
+// Each line type the firmware sends is parsed and every field the event carries for it is checked:
+// keypad address and byte count, the key codes, t= and q=, rails, the POWER rail and level, the
+// ERR_FMT column, the SYNC token.  Lines that are cut short or don't add up must be reported as
+// garbled.  The read path is checked on a pipe: lines split over reads, CR LF endings and a line
+// too long for the read buffer.  A failed check prints its line and the test exits with status 1,
+// so make check fails.
+//
+// build and run: make check
+
+#include "KeybusClient.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static int checks, failures;
+
+#define CHECK(cond) \
+    do { checks++; if (!(cond)) { failures++; printf("clientTest.cpp:%d: CHECK(%s) failed\n", __LINE__, #cond); } } while (0)
+
+// parse a terminated line. Returns: parseLine() result
+static bool parse(const char * line, t_KbEvent * ev)
+{
+    return KeybusClient::parseLine(line, strlen(line), ev);
+}
+
+// true if s is the string k
+static bool strIs(t_KbStr s, const char * k)
+{
+    return s.len == strlen(k) && memcmp(s.p, k, s.len) == 0;
+}
+
+// key report: address, count, key codes and stamp
+static void testKeys(void)
+{
+    t_KbEvent ev;
+
+    CHECK(parse("KEYS_16[02] 0x01 0x0b t=123456 q=17", &ev));
+    CHECK(ev.type == KB_EV_KEYS);
+    CHECK(strIs(ev.name, "KEYS"));
+    CHECK(ev.addr == 16);
+    CHECK(ev.len == 2);
+    CHECK(ev.data[0] == 0x01 && ev.data[1] == 0x0b);
+    CHECK(ev.hasStamp);
+    CHECK(ev.time == 123456);
+    CHECK(ev.seq == 17);
+
+    CHECK(parse("KEYS_ 3[01] 0x0a t=4294967295 q=65535", &ev));  // address is %2d
+    CHECK(ev.addr == 3);
+    CHECK(ev.len == 1 && ev.data[0] == 0x0a);
+    CHECK(ev.time == 4294967295u);
+    CHECK(ev.seq == 65535);
+
+    CHECK(parse("KEYS_17[00] t=5 q=6", &ev));
+    CHECK(ev.type == KB_EV_KEYS && ev.addr == 17 && ev.len == 0);
+    CHECK(ev.hasStamp && ev.time == 5 && ev.seq == 6);
+
+    CHECK(parse("KEYS_17[01] 0x05", &ev));                        // older firmware, no stamp
+    CHECK(ev.len == 1 && ev.data[0] == 0x05);
+    CHECK(!ev.hasStamp && ev.time == 0 && ev.seq == 0);
+}
+
+// power-up and unknown keypad mesgs: the name, and all the data bytes
+static void testOtherKeypadMsgs(void)
+{
+    t_KbEvent ev;
+
+    CHECK(parse("PWUP_16[09] 0x87 0x00 0x00 0x00 0x00 0x00 0x00 0x00 0x79 t=1000 q=1", &ev));
+    CHECK(ev.type == KB_EV_PWUP);
+    CHECK(strIs(ev.name, "PWUP"));
+    CHECK(ev.addr == 16 && ev.len == 9);
+    CHECK(ev.data[0] == 0x87 && ev.data[1] == 0x00 && ev.data[8] == 0x79);
+    CHECK(ev.hasStamp && ev.time == 1000 && ev.seq == 1);
+
+    CHECK(parse("UNK__18[03] 0x44 0x01 0xBB t=130000 q=19", &ev));  // name is UNK_
+    CHECK(ev.type == KB_EV_UNK);
+    CHECK(strIs(ev.name, "UNK_"));
+    CHECK(ev.addr == 18 && ev.len == 3);
+    CHECK(ev.data[0] == 0x44 && ev.data[1] == 0x01 && ev.data[2] == 0xbb);
+    CHECK(ev.time == 130000 && ev.seq == 19);
+}
+
+// key mesgs that don't add up are garbled
+static void testBadKeyMsgs(void)
+{
+    t_KbEvent ev;
+
+    CHECK(!parse("KEYS_16[03] 0x01 0x02 t=1 q=2", &ev));         // fewer bytes than the count
+    CHECK(!parse("KEYS_16[01] 0x01 0x02 t=1 q=2", &ev));         // more
+    CHECK(!parse("KEYS_16[01] zz t=1 q=2", &ev));                // not hex
+    CHECK(!parse("KEYS_1x[01] 0x01 t=1 q=2", &ev));              // bad address
+    CHECK(!parse("KEYS_16[33] 0x01 0x02 0x03 0x04 0x05 0x06 0x07 0x08 0x09 0x0a 0x0b 0x0c 0x0d 0x0e 0x0f "
+                 "0x10 0x11 0x12 0x13 0x14 0x15 0x16 0x17 0x18 0x19 0x1a 0x1b 0x1c 0x1d 0x1e 0x1f 0x20 0x21",
+                 &ev));                                          // more than KB_MAX_DATA bytes
+}
+
+// VOLTS rails
+static void testVolts(void)
+{
+    t_KbEvent ev;
+
+    CHECK(parse("VOLTS[03] 0x04b0 0x01f4 0x0148", &ev));
+    CHECK(ev.type == KB_EV_VOLTS);
+    CHECK(strIs(ev.name, "VOLTS"));
+    CHECK(ev.rail[0] == 1200 && ev.rail[1] == 500 && ev.rail[2] == 328);
+    CHECK(!ev.hasStamp && ev.addr == 0 && ev.len == 0);
+
+    CHECK(!parse("VOLTS[03] 0x04b0 0x01f4", &ev));              // a rail missing
+}
+
+// POWER FAIL/OK: rail number in addr, level in rail[0]
+static void testPower(void)
+{
+    t_KbEvent ev;
+
+    CHECK(parse("POWER FAIL rail=0 v=0x03e8 lat=212", &ev));
+    CHECK(ev.type == KB_EV_POWER);
+    CHECK(ev.fail);
+    CHECK(ev.addr == 0);
+    CHECK(ev.rail[0] == 1000);
+
+    CHECK(parse("POWER OK rail=2 v=0x0148 lat=5", &ev));
+    CHECK(ev.type == KB_EV_POWER);
+    CHECK(!ev.fail);
+    CHECK(ev.addr == 2);
+    CHECK(ev.rail[0] == 0x148);
+
+    CHECK(!parse("POWER LOW rail=0 v=0x03e8 lat=1", &ev));
+    CHECK(!parse("POWER FAIL rail=0", &ev));
+}
+
+// SYNC token and stamp
+static void testSync(void)
+{
+    t_KbEvent ev;
+
+    CHECK(parse("SYNC host42 t=130050 q=20", &ev));
+    CHECK(ev.type == KB_EV_SYNC);
+    CHECK(strIs(ev.args, "host42"));
+    CHECK(ev.hasStamp && ev.time == 130050 && ev.seq == 20);
+
+    CHECK(!parse("SYNC host42", &ev));
+    CHECK(!parse("SYNC host42 t=1x q=2", &ev));
+}
+
+// ERR_FMT column, WARN, and query replies as status lines
+static void testErrWarnStatus(void)
+{
+    t_KbEvent ev;
+
+    CHECK(parse("ERR_FMT: garble/bad msg format at col 7 'F7 z=0G'", &ev));
+    CHECK(ev.type == KB_EV_ERR);
+    CHECK(strIs(ev.name, "ERR_FMT"));
+    CHECK(ev.col == 7);
+    CHECK(!parse("ERR_FMT: garble/bad msg format", &ev));
+
+    CHECK(parse("WARN: loop stall 5120 us in poll", &ev));
+    CHECK(ev.type == KB_EV_WARN);
+    CHECK(strIs(ev.name, "WARN"));
+
+    CHECK(parse("BUS util=412 poll=120 gap=50 merged=0", &ev));
+    CHECK(ev.type == KB_EV_STATUS);
+    CHECK(strIs(ev.name, "BUS"));
+    CHECK(strIs(ev.args, "util=412 poll=120 gap=50 merged=0"));
+    CHECK(strIs(ev.line, "BUS util=412 poll=120 gap=50 merged=0"));
+
+    CHECK(parse("F7STAT", &ev));                                 // a word with no args
+    CHECK(ev.type == KB_EV_STATUS && strIs(ev.name, "F7STAT") && ev.args.len == 0);
+}
+
+// fields of the previous line don't carry over into the next one
+static void testFieldsCleared(void)
+{
+    t_KbEvent ev;
+
+    CHECK(parse("POWER FAIL rail=1 v=0x0100 lat=9", &ev));
+    CHECK(parse("KEYS_16[01] 0x02 t=7 q=8", &ev));
+    CHECK(!ev.fail && ev.rail[0] == 0);
+    CHECK(parse("VOLTS[03] 0x0001 0x0002 0x0003", &ev));
+    CHECK(!ev.hasStamp && ev.time == 0 && ev.seq == 0 && ev.addr == 0 && ev.len == 0);
+}
+
+// events from the read path, the line text copied out while it is valid
+typedef struct {
+    int       count;
+    t_KbEvent ev;
+    char      line[64];
+} t_Seen;
+
+static void onEvent(const t_KbEvent * ev, void * ctx)
+{
+    t_Seen * s = (t_Seen *)ctx;
+    s->count++;
+    s->ev = *ev;
+    snprintf(s->line, sizeof(s->line), "%.*s", ev->line.len < 63 ? ev->line.len : 63, ev->line.p);
+}
+
+// lines through a pipe: split over reads, CR LF, and a line that overflows the read buffer
+static void testReadPath(void)
+{
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+
+    KeybusClient client;
+    t_Seen seen;
+    memset(&seen, 0, sizeof(seen));
+    CHECK(client.attach(fds[0]));
+    client.setCallback(onEvent, &seen);
+
+    static const char part1[] = "KEYS_16[02] 0x01 ";
+    static const char part2[] = "0x02 t=99 q=3\r\n";
+    CHECK(write(fds[1], part1, strlen(part1)) == (ssize_t)strlen(part1));
+    CHECK(client.run(100) == 0);                                 // no newline yet
+    CHECK(seen.count == 0);
+    CHECK(write(fds[1], part2, strlen(part2)) == (ssize_t)strlen(part2));
+    CHECK(client.run(100) == 1);
+    CHECK(seen.count == 1);
+    CHECK(strcmp(seen.line, "KEYS_16[02] 0x01 0x02 t=99 q=3") == 0);  // CR dropped
+    CHECK(seen.ev.type == KB_EV_KEYS && seen.ev.len == 2 && seen.ev.data[1] == 0x02);
+    CHECK(seen.ev.time == 99 && seen.ev.seq == 3);
+
+    static char longLine[KB_RX_BUF_SIZE + 100];
+    memset(longLine, 'x', sizeof(longLine));
+    longLine[sizeof(longLine) - 1] = '\n';
+    static const char after[] = "\nVOLTS[03] 0x0001 0x0002 0x0003\n";  // empty line is skipped
+    CHECK(write(fds[1], longLine, sizeof(longLine)) == (ssize_t)sizeof(longLine));
+    CHECK(write(fds[1], after, strlen(after)) == (ssize_t)strlen(after));
+    for (uint8_t i=0; i < 10 && seen.count < 2; i++)              // takes more than one read
+        client.run(100);
+    CHECK(client.getOverflows() == 1);
+    CHECK(seen.count == 2);
+    CHECK(seen.ev.type == KB_EV_VOLTS && seen.ev.rail[2] == 3);
+    CHECK(client.getLines() == 2);
+    CHECK(client.getBadLines() == 0);
+
+    client.close();
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main(void)
+{
+    testKeys();
+    testOtherKeypadMsgs();
+    testBadKeyMsgs();
+    testVolts();
+    testPower();
+    testSync();
+    testErrWarnStatus();
+    testFieldsCleared();
+    testReadPath();
+
+    printf("clientTest: %d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
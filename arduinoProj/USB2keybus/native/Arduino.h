@@ -0,0 +1,48 @@
+// file Arduino.h - native (Linux) stand-in for the Arduino core, used by 'make native'
+//
+// Only what the firmware uses is here.  Time comes from CLOCK_MONOTONIC, interrupts are run from
+// micros() (see NativeCore.cpp), Serial is a pseudo-terminal and the keybus is a simulated keypad
+// (see SimKeybus.cpp).
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/delay_basic.h>
+
+#define HIGH     (1)
+#define LOW      (0)
+#define INPUT    (0)
+#define OUTPUT   (1)
+
+#define A0       (54)  // mega2560 analog pins
+#define A1       (55)
+#define A2       (56)
+#define A3       (57)
+
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+
+typedef uint8_t byte;
+typedef bool    boolean;
+
+uint32_t millis(void);
+uint32_t micros(void);
+void     delay(uint32_t ms);
+void     delayMicroseconds(unsigned int us);
+
+static inline void pinMode(uint8_t pin, uint8_t mode)      {}
+static inline void digitalWrite(uint8_t pin, uint8_t val)  {}
+static inline int  digitalRead(uint8_t pin)                { return LOW; }
+
+#include "Stream.h"
+#include "HardwareSerial.h"
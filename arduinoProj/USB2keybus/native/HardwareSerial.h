@@ -0,0 +1,44 @@
+// file HardwareSerial.h - native stand-in for the Arduino USB serial port, backed by a pty
+//
+// Bytes move between the pty and the rx ring no faster than the baud rate, and the ring drops bytes
+// when full, as the UART does.  Writes block while more than the tx buffer is waiting at the baud
+// rate.  So the firmware sees the same flow limits it has on the board.
+
+#pragma once
+
+#include <stdint.h>
+
+#ifndef SERIAL_RX_BUFFER_SIZE
+#define SERIAL_RX_BUFFER_SIZE  (64)
+#endif
+#ifndef SERIAL_TX_BUFFER_SIZE
+#define SERIAL_TX_BUFFER_SIZE  (64)
+#endif
+
+class HardwareSerial : public Stream
+{
+public:
+    void begin(unsigned long baud);
+    void end(void)                           {}
+    virtual int available(void);
+    virtual int read(void);
+    virtual int peek(void);
+    virtual void flush(void);
+    virtual int availableForWrite(void);
+    virtual size_t write(uint8_t c);
+    using Print::write;
+    operator bool()                          { return true; }
+
+    void service(void);                      // move bytes from the pty into the rx ring (called from micros)
+    uint32_t getDropped(void)                { return dropped; }
+
+private:
+    uint8_t  rxRing[SERIAL_RX_BUFFER_SIZE];
+    uint16_t rxHead, rxTail;
+    uint32_t byteNs;                         // time of one byte at the baud rate
+    uint64_t rxNextNs;                       // earliest time the next byte may arrive
+    uint64_t txFreeNs;                       // time the tx buffer drains
+    uint32_t dropped;                        // bytes lost to a full rx ring
+};
+
+extern HardwareSerial Serial;
@@ -0,0 +1,351 @@
+// file NativeCore.cpp - native (Linux) Arduino core for the firmware, with Serial on a pseudo-terminal
+//
+// Runs setup() and loop() of USB2keybus.ino unchanged.  The firmware's Serial is the master side
+// of a pty, so Pi side software talks to the slave (/dev/pts/N, or the -l link) as it would to
+// /dev/ttyACM0.  The keybus is the simulated keypad in SimKeybus.cpp.
+//
+// Interrupts run from micros() and millis(), which the firmware calls in all its wait loops: the
+// ADC conversion complete ISR every 104us, the watchdog ISR when its period runs out without a
+// wdt_reset(), and the pin change ISR when the keypad sends a byte.  None run while SREG has
+// interrupts off.  The ADC reads every rail at mid scale, with -p rail 0 drops to 0V and comes back
+// every <ms>, a RAIL event at each change (see SimKeybus.cpp for events).
+//
+// Built a second time with NATIVE_NO_MAIN (native/obj/NativeLib.o), without main() and the pty, for
+// the test and bench programs that call the firmware classes directly instead of running loop().
+//
+// build: make native
+// usage: USB2keybus-native [-l <pty link>] [-e <event fd>] [-k <key period ms>] [-a <keypad addr>].. [-p <rail ms>] [-v]
+//   each -a adds a keypad (16-23), default is one at 16
+
+#include "PiSerial.h"  // first, so Serial has the firmware's rx buffer size
+#include <Arduino.h>
+#include <avr/eeprom.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include "SimKeybus.h"
+
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+
+#define ADC_CONV_NS      (104000ULL)  // 13 adc clocks at 125kHz
+#define ADC_SIM_VALUE    (0x200)      // every rail reads mid scale
+#define RAIL_START_NS    (2000000000ULL)  // first rail change, once setup() is done and power fail is set
+#define STALL_NS         (200000ULL)  // gap between clock reads that is a host stall (a sleep is ~100us)
+
+volatile uint8_t  SREG, ADCSRA, ADCSRB, ADMUX, WDTCSR, MCUSR, SMCR;
+volatile uint16_t ADC;
+uint8_t nativeEeprom[E2END + 1];
+HardwareSerial Serial;
+
+ISR(ADC_vect);   // Volts.cpp
+ISR(WDT_vect);   // LoopMon.cpp
+
+void setup(void);
+void loop(void);
+
+static uint64_t startNs;
+static int      ptyFd = -1;
+static bool     inIsr;
+static bool     adcBusy;             // conversion running
+static uint64_t adcDoneNs;
+static uint64_t wdtResetNs;
+static uint32_t railMs;              // rail 0 changes every this many ms, 0 is off
+static uint64_t railNextNs;
+static bool     railLow;             // rail 0 reads 0V
+static uint64_t lastNs;
+uint64_t nativeStallNs;              // clock at the end of the last host stall
+
+// CLOCK_MONOTONIC in ns, shared with the bench driver for latency measurements.  The firmware reads
+// the clock all the time, a longer gap between reads is time the host didn't run the process
+uint64_t nativeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    if (ns - lastNs > STALL_NS)
+        nativeStallNs = ns;
+    lastNs = ns;
+    return ns;
+}
+
+// run the interrupts that are due
+static void runInterrupts(void)
+{
+    if (inIsr || !(SREG & _BV(SREG_I)))
+        return;
+    inIsr = true;
+    uint64_t ns = nativeNs();
+
+    if (railMs && ns >= railNextNs)
+    {
+        railLow = !railLow;
+        railNextNs = ns + railMs * 1000000ULL;
+        simEvent(railLow ? "RAIL 0 LOW" : "RAIL 0 OK");
+    }
+
+    if ((ADCSRA & _BV(ADEN)) && (ADCSRA & _BV(ADSC)))
+    {
+        if (!adcBusy)
+        {
+            adcBusy = true;
+            adcDoneNs = ns + ADC_CONV_NS;
+        }
+        else if (ns >= adcDoneNs)
+        {
+            adcBusy = false;
+            ADC = railLow && (ADMUX & 0x07) == 0 ? 0 : ADC_SIM_VALUE;
+            ADCSRA &= ~_BV(ADSC);
+            if (ADCSRA & _BV(ADIE))
+                ADC_vect();
+        }
+    }
+
+    if (WDTCSR & _BV(WDIE))
+    {
+        uint8_t wdp = (WDTCSR & 0x07) | ((WDTCSR & _BV(WDP3)) ? 0x08 : 0);
+        if (ns - wdtResetNs > (16000000ULL << wdp))
+        {
+            wdtResetNs = ns;
+            WDT_vect();
+        }
+    }
+
+    Serial.service();
+    simTick(ns);
+    inIsr = false;
+}
+
+uint32_t micros(void)
+{
+    runInterrupts();
+    return (nativeNs() - startNs) / 1000;
+}
+
+uint32_t millis(void)
+{
+    runInterrupts();
+    return (nativeNs() - startNs) / 1000000;
+}
+
+void delay(uint32_t ms)
+{
+    uint32_t start = millis();
+    while (millis() - start < ms)
+        nativeSleep();
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    uint32_t start = micros();
+    while (micros() - start < us)
+        ;
+}
+
+void nativeWdtReset(void)
+{
+    wdtResetNs = nativeNs();
+}
+
+// sleep_cpu(): wait for pty input, or ~100us for the next timer tick
+void nativeSleep(void)
+{
+    struct pollfd p;
+    struct timespec ts = { 0, 100000 };
+    p.fd = ptyFd;
+    p.events = POLLIN;
+    ppoll(&p, 1, &ts, NULL);
+}
+
+// HardwareSerial ----------------------------------------------------------------------------------
+
+void HardwareSerial::begin(unsigned long baud)
+{
+    rxHead = rxTail = 0;
+    byteNs = 10000000000ULL / baud;  // start + 8 data + stop
+    rxNextNs = txFreeNs = 0;
+    dropped = 0;
+}
+
+// move bytes from the pty into the rx ring, no faster than the baud rate.  A full ring drops bytes
+void HardwareSerial::service(void)
+{
+    uint64_t ns = nativeNs();
+    if (rxNextNs < ns - byteNs)
+        rxNextNs = ns - byteNs;  // line was idle, next byte can arrive now
+
+    while (rxNextNs + byteNs <= ns)
+    {
+        uint8_t c;
+        if (ptyFd < 0 || ::read(ptyFd, &c, 1) != 1)
+            break;
+        rxNextNs += byteNs;
+
+        uint16_t next = (rxHead + 1) % SERIAL_RX_BUFFER_SIZE;
+        if (next == rxTail)
+        {
+            dropped++;
+            continue;
+        }
+        rxRing[rxHead] = c;
+        rxHead = next;
+    }
+}
+
+int HardwareSerial::available(void)
+{
+    runInterrupts();
+    return (SERIAL_RX_BUFFER_SIZE + rxHead - rxTail) % SERIAL_RX_BUFFER_SIZE;
+}
+
+int HardwareSerial::read(void)
+{
+    if (rxHead == rxTail)
+        return -1;
+    uint8_t c = rxRing[rxTail];
+    rxTail = (rxTail + 1) % SERIAL_RX_BUFFER_SIZE;
+    return c;
+}
+
+int HardwareSerial::peek(void)
+{
+    return rxHead == rxTail ? -1 : rxRing[rxTail];
+}
+
+// wait for the tx buffer to drain
+void HardwareSerial::flush(void)
+{
+    while (nativeNs() < txFreeNs)
+        runInterrupts();
+}
+
+// free space in the tx buffer, the bytes not yet sent at the baud rate are still in it
+int HardwareSerial::availableForWrite(void)
+{
+    uint64_t ns = nativeNs();
+    if (txFreeNs <= ns)
+        return SERIAL_TX_BUFFER_SIZE;
+    uint32_t waiting = (txFreeNs - ns + byteNs - 1) / byteNs;
+    return waiting < SERIAL_TX_BUFFER_SIZE ? SERIAL_TX_BUFFER_SIZE - waiting : 0;
+}
+
+// send a byte, blocks while the tx buffer is full at the baud rate
+size_t HardwareSerial::write(uint8_t c)
+{
+    uint64_t ns = nativeNs();
+    if (txFreeNs < ns)
+        txFreeNs = ns;
+    while (txFreeNs > nativeNs() + (uint64_t)SERIAL_TX_BUFFER_SIZE * byteNs)
+        runInterrupts();
+    txFreeNs += byteNs;
+
+    if (ptyFd >= 0 && ::write(ptyFd, &c, 1) != 1)
+        return 0;  // nobody reading the pty and its buffer is full, byte is lost
+    return 1;
+}
+
+// main ---------------------------------------------------------------------------------------------
+
+#ifndef NATIVE_NO_MAIN
+
+static volatile sig_atomic_t stop;
+
+static void onSignal(int sig)
+{
+    stop = 1;
+}
+
+// open the pty, the slave is set raw and kept open so the line discipline doesn't echo and reads
+// on the master don't fail while no client is attached.  Returns: slave fd, -1 on error
+static int openPty(const char * link)
+{
+    ptyFd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (ptyFd < 0 || grantpt(ptyFd) != 0 || unlockpt(ptyFd) != 0)
+        return -1;
+
+    const char * path = ptsname(ptyFd);
+    int slave = open(path, O_RDWR | O_NOCTTY);
+    if (slave < 0)
+        return -1;
+
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    if (link)
+    {
+        unlink(link);
+        if (symlink(path, link) != 0)
+            perror(link);
+    }
+    printf("PTY %s\n", path);
+    fflush(stdout);
+    simEvent("PTY %s", path);
+    return slave;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * link = NULL;
+    int eventFd = -1, addr, opt;
+    uint8_t addrMask = 0;                     // bit i is keypad 16+i
+    uint32_t keyMs = 0;
+    bool verbose = false;
+
+    while ((opt = getopt(argc, argv, "l:e:k:a:p:v")) != -1)
+    {
+        switch (opt)
+        {
+            case 'l': link = optarg;                  break;
+            case 'e': eventFd = atoi(optarg);         break;
+            case 'k': keyMs = strtoul(optarg, NULL, 0); break;
+            case 'a':
+                addr = atoi(optarg);
+                if (addr < 16 || addr > 23)
+                {
+                    fprintf(stderr, "keypad addr must be 16-23\n");
+                    return 1;
+                }
+                addrMask |= 1 << (addr - 16);
+                break;
+            case 'p': railMs = strtoul(optarg, NULL, 0); break;
+            case 'v': verbose = true;                 break;
+            default:
+                fprintf(stderr, "usage: %s [-l <pty link>] [-e <event fd>] [-k <key period ms>] [-a <keypad addr>].. [-p <rail ms>] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (!addrMask)
+        addrMask = 0x01;                      // one keypad at 16
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    signal(SIGPIPE, SIG_IGN);
+    memset(nativeEeprom, 0xFF, sizeof(nativeEeprom));  // erased
+
+    startNs = nativeNs();
+    railNextNs = startNs + RAIL_START_NS;
+    simInit(addrMask, keyMs, eventFd, verbose);
+    if (openPty(link) < 0)
+    {
+        perror("pty");
+        return 1;
+    }
+
+    sei();  // the Arduino core enables interrupts before setup()
+    setup();
+    while (!stop)
+        loop();
+
+    fprintf(stderr, "usb: rx dropped=%u\n", Serial.getDropped());
+    simReport();
+    if (link)
+        unlink(link);
+    return 0;
+}
+
+#endif // NATIVE_NO_MAIN
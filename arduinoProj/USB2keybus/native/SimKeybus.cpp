@@ -0,0 +1,516 @@
+// file SimKeybus.cpp - simulated keybus and keypad for the native firmware build
+//
+// Replaces ModSoftwareSerial.cpp.  The SoftwareSerial methods the firmware calls are implemented
+// against a model of up to 8 keypads (one per -a address), the same model sim/keybusSim.c drives
+// under simavr for one:
+//   - transmit held low > 10ms then clocked high three times is a poll.  The keypads answer each
+//     clock (a pin change ISR) when any has keys, and send the bitmask of those that do on the third
+//   - a write starting after > 3ms low starts a new transaction.  F6 <addr> to a keypad with keys
+//     pending gets its key mesg back 1ms later, one byte per frame time, through the pin change ISR
+//   - a complete F7 mesg is reported as an event, with the text of both lcd lines
+// Each keypad presses a key every key period, all at the same time, so with several keypads each
+// poll has more than one to read and the firmware can merge (MERGE 1) its requests.
+//
+// Every transaction is checked as the keypads would see it.  It is one or more segments, each
+// after a low of >= 1ms (a merged write), bytes in a segment are closer together:
+//   - a keypad reply must be acked by the next transaction, with the keypad's address
+//   - only a transaction that starts with an ack may have more segments, each an F6 <addr> or F7
+//   - an F7 is 48 bytes with a good checksum
+//   - no write may follow a low > 10ms, or come between the clocks of a poll, the keypads took
+//     that low for a poll
+// A break is reported as a TXN event and counted.  A low the host stretched by not running the
+// process is not the firmware's, a transaction with one (or after one in a keypad reply) is not
+// checked and counted as stalled.
+// Writes take the real frame time with interrupts off, as on the board, so keybus timing and the
+// scheduler behave as they do on the hardware.
+//
+// Events go to the fd given with -e, one per line, '<CLOCK_MONOTONIC ns> <event>':
+//   PTY <path>                          pty the firmware's Serial is on
+//   PRESS <addr> <key>                  key pressed on the keypad
+//   REPLY <addr> <count>                keypad sent its keys in reply to an F6
+//   F7 <keypads> <line1>|<line2>        F7 mesg written to the bus
+//   TXN <error>                         transaction the keypads would not take, see above
+//   RAIL 0 LOW|OK                       rail 0 dropped to 0V or came back (NativeCore.cpp, -p)
+
+#include <Arduino.h>
+#include "ModSoftwareSerial.h"
+#include "F7msg.h"
+#include "SimKeybus.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_POLL_LOW_NS    (10000000ULL)   // low longer than this starts a poll
+#define SIM_PREAMBLE_NS     (3000000ULL)   // low longer than this before a write starts a transaction
+#define SIM_REPLY_NS        (1000000ULL)   // keypad reply delay after an F6
+#define SIM_SEGMENT_NS       (700000ULL)   // low longer than this inside a transaction starts a segment
+#define SIM_MERGE_GAP_NS    (1000000ULL)   // shortest low before a merged segment
+#define SIM_MAX_KEYPADS     (8)
+#define SIM_MAX_KEYS        (16)
+#define SIM_WIRE_BYTES      (32)
+
+uint64_t nativeNs(void);
+extern uint64_t nativeStallNs;  // NativeCore.cpp
+ISR(PCINT0_vect);  // KeypadSerial.cpp
+
+// SoftwareSerial static data
+SoftwareSerial * SoftwareSerial::active_object = 0;
+
+// keypad model
+typedef struct {
+    uint8_t addr;
+    uint8_t keys[SIM_MAX_KEYS];
+    uint8_t numKeys;
+} t_SimKeypad;
+
+static t_SimKeypad keypads[SIM_MAX_KEYPADS];
+static uint8_t  numKeypads;
+static uint32_t keyPeriodMs;
+static uint64_t nextPressNs;
+static uint8_t  nextKey = 1;
+
+static uint8_t  txLevel;
+static uint64_t txFallNs;
+static int      pollPulse;                 // 0 when not polling, else count of poll clocks
+static bool     pollStalled;               // host stalled in the low that started the poll
+static uint8_t  txnBuf[F7_MSG_SIZE];       // bytes of the current segment of the keybus transaction
+static uint8_t  txnLen;
+static uint8_t  txnSegs;                   // segments in the current transaction, 0 before its first byte
+static bool     txnAcked;                  // current transaction started with an ack
+static uint8_t  ackAddr;                   // address of the keypad waiting for its ack, 0 if none
+static uint64_t replyNs;                   // time of the last keypad reply
+static bool     txnStalled;                // host stalled in a low of the current transaction
+static uint64_t frameNs;                   // one 8E2 frame
+
+static uint8_t  rxLevel;                   // keypad -> arduino line, read by rx_pin_read()
+static int      rxByte = -1;               // byte the pin change ISR takes with recv(), -1 if none
+static uint8_t  wire[SIM_WIRE_BYTES];      // keypad reply bytes
+static uint64_t wireNs[SIM_WIRE_BYTES];    // time each reply byte arrives
+static uint8_t  wireLen, wireIdx;
+
+static int      eventFd = -1;
+static bool     verbose;
+
+static uint32_t polls, pollsAnswered, replies, f7s, presses, rxLost, txns, merged, txnErrors, stalls;
+
+// write '<ns> <text>' to the event fd
+void simEvent(const char * fmt, ...)
+{
+    char buf[128];
+    int n = snprintf(buf, sizeof(buf), "%llu ", (unsigned long long)nativeNs());
+    va_list ap;
+    va_start(ap, fmt);
+    n += vsnprintf(buf + n, sizeof(buf) - n - 1, fmt, ap);
+    va_end(ap);
+    n = n < (int)sizeof(buf) - 1 ? n : sizeof(buf) - 2;
+    buf[n++] = '\n';
+
+    if (eventFd >= 0 && write(eventFd, buf, n) < 0)
+        eventFd = -1;  // reader went away
+    if (verbose)
+        fwrite(buf, 1, n, stderr);
+}
+
+void simInit(uint8_t addrMask, uint32_t periodMs, int fd, bool verb)
+{
+    numKeypads = 0;
+    for (uint8_t i=0; i < SIM_MAX_KEYPADS; i++)
+    {
+        if (addrMask & (1 << i))
+            keypads[numKeypads++].addr = 16 + i;
+    }
+    keyPeriodMs = periodMs;
+    nextPressNs = nativeNs() + 1000000000ULL;  // first press after a second, once setup() is done
+    eventFd = fd;
+    verbose = verb;
+}
+
+// keypad sends a byte: rx goes high (start bit) and the pin change ISR runs
+static void pinChange(int byte)
+{
+    if (!(SREG & _BV(SREG_I)))
+        return;  // edge is lost, like an ISR that is held off too long
+    rxByte = byte;
+    rxLevel = 1;
+    PCINT0_vect();
+    rxLevel = 0;
+    if (rxByte >= 0 && byte >= 0)
+        rxLost++;  // ISR did not take it
+    rxByte = -1;
+}
+
+// deliver keypad bytes and key presses due by ns.  Called with interrupts enabled
+void simTick(uint64_t ns)
+{
+    if (keyPeriodMs && ns >= nextPressNs)
+    {
+        nextPressNs += keyPeriodMs * 1000000ULL;
+        for (uint8_t k=0; k < numKeypads; k++)
+        {
+            t_SimKeypad * kp = &keypads[k];
+            if (kp->numKeys < SIM_MAX_KEYS)
+            {
+                kp->keys[kp->numKeys++] = nextKey;
+                presses++;
+                simEvent("PRESS %u %u", kp->addr, nextKey);
+            }
+        }
+        nextKey = nextKey % 9 + 1;
+    }
+
+    if (wireIdx < wireLen && ns >= wireNs[wireIdx])
+    {
+        pinChange(wire[wireIdx++]);
+        if (wireIdx == wireLen)
+            wireIdx = wireLen = 0;
+    }
+}
+
+// keypad with addr, NULL if none
+static t_SimKeypad * findKeypad(uint8_t addr)
+{
+    for (uint8_t k=0; k < numKeypads; k++)
+    {
+        if (keypads[k].addr == addr)
+            return &keypads[k];
+    }
+    return NULL;
+}
+
+// poll response: bit low for each keypad with keys, 0xFF if none
+static uint8_t pollMask(void)
+{
+    uint8_t mask = 0xFF;
+    for (uint8_t k=0; k < numKeypads; k++)
+    {
+        if (keypads[k].numKeys)
+            mask &= ~(1 << (keypads[k].addr - 16));
+    }
+    return mask;
+}
+
+// report a transaction the keypads would not take
+static void txnError(const char * fmt, ...)
+{
+    char buf[80];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (txnStalled)
+        return;
+    txnErrors++;
+    simEvent("TXN %s", buf);
+}
+
+// keypad reply to an F6 request: addr, length, keys, checksum
+static void keypadReply(t_SimKeypad * kp, uint64_t ns)
+{
+    uint8_t sum = 0;
+
+    wireLen = wireIdx = 0;
+    wire[wireLen++] = kp->addr;
+    wire[wireLen++] = kp->numKeys + 1;
+    for (uint8_t i=0; i < kp->numKeys; i++)
+        wire[wireLen++] = kp->keys[i];
+    for (uint8_t i=0; i < wireLen; i++)
+        sum += wire[i];
+    wire[wireLen++] = 0x100 - sum;
+
+    for (uint8_t i=0; i < wireLen; i++)
+        wireNs[i] = ns + SIM_REPLY_NS + i * frameNs;
+
+    replies++;
+    simEvent("REPLY %u %u", kp->addr, kp->numKeys);
+    kp->numKeys = 0;
+    ackAddr = kp->addr;
+    replyNs = ns;
+}
+
+// report a complete F7 mesg
+static void f7Written(void)
+{
+    t_MesgF7 * f7 = (t_MesgF7 *)txnBuf;
+    char l1[LCD_LINE_LEN+1], l2[LCD_LINE_LEN+1];
+
+    uint8_t sum = 0;
+    for (uint8_t i=0; i <= offsetof(t_MesgF7, chksum); i++)
+        sum += txnBuf[i];
+    if (sum)
+        txnError("F7 checksum %02x", f7->chksum);
+
+    for (uint8_t i=0; i < LCD_LINE_LEN; i++)
+    {
+        char c1 = f7->line1[i] & 0x7F;  // backlight bit in line1[0]
+        char c2 = f7->line2[i];
+        l1[i] = (c1 >= ' ' && c1 <= '~') ? c1 : ' ';
+        l2[i] = (c2 >= ' ' && c2 <= '~') ? c2 : ' ';
+    }
+    l1[LCD_LINE_LEN] = l2[LCD_LINE_LEN] = '\0';
+
+    f7s++;
+    simEvent("F7 %02x %s|%s", f7->keypads, l1, l2);
+}
+
+// the segment written so far is complete: check an F7 was not cut short
+static void segmentEnd(void)
+{
+    if (txnLen && txnBuf[0] == 0xF7 && txnLen != F7_MSG_SIZE)
+        txnError("F7 of %u bytes", txnLen);
+    txnLen = 0;
+}
+
+// a host stall stretched a low of the current transaction
+static void txnStall(void)
+{
+    if (!txnStalled)
+        stalls++;
+    txnStalled = true;
+}
+
+// first byte b of a segment, low ns before it, stalled if the host stretched it.  A stall while
+// the firmware read a reply may have cost it the reply, so an ack missing after one isn't checked
+static void segmentStart(uint8_t b, uint64_t low, bool stalled)
+{
+    if (ackAddr && nativeStallNs > replyNs)
+        stalled = true;
+    if (stalled)
+        txnStall();                        // the stretched low may have cut the segment before it short
+    segmentEnd();
+
+    if (low > SIM_PREAMBLE_NS)             // preamble, new transaction
+    {
+        txns++;
+        txnSegs = 0;
+        txnAcked = false;
+        txnStalled = stalled;
+        if (ackAddr && b == ackAddr)
+        {
+            txnAcked = true;
+            ackAddr = 0;
+        }
+        else if (ackAddr)
+        {
+            txnError("keypad %u not acked", ackAddr);
+            ackAddr = 0;
+        }
+        else if (b != 0xF6 && b != 0xF7)
+        {
+            txnError("unexpected %02x", b);
+        }
+    }
+    else                                   // merged onto the transaction
+    {
+        if (!stalled)
+            merged++;
+        if (!txnAcked)
+            txnError("segment merged onto a transaction without an ack");
+        else if (b != 0xF6 && b != 0xF7)
+            txnError("merged segment starts %02x", b);
+        if (low < SIM_MERGE_GAP_NS)
+            txnError("merge gap %u us", (unsigned)(low / 1000));
+        if (ackAddr)
+        {
+            txnError("keypad %u not acked", ackAddr);
+            ackAddr = 0;
+        }
+    }
+    txnSegs++;
+}
+
+// transmit line change: poll clocks are answered here, bytes are handled in write()
+static void txChange(uint8_t level)
+{
+    uint64_t ns = nativeNs();
+    if (level == txLevel)
+        return;
+    txLevel = level;
+
+    if (!level)
+    {
+        txFallNs = ns;
+        return;
+    }
+    segmentEnd();                          // a high line ends the transaction
+    txnSegs = 0;
+
+    if (ns - txFallNs > SIM_POLL_LOW_NS)   // long low starts a poll
+    {
+        pollPulse = 1;
+        pollStalled = nativeStallNs > txFallNs;
+        polls++;
+    }
+    else if (pollPulse && pollPulse < 3)
+    {
+        pollPulse++;
+    }
+    else                                   // rising edge after the third clock ends the poll
+    {
+        pollPulse = 0;
+        return;
+    }
+
+    uint8_t mask = pollMask();
+    if (mask == 0xFF)                      // keypads only answer the poll when they have keys
+        return;
+
+    if (pollPulse < 3)
+    {
+        pinChange(-1);                     // short pulse to clock the poll state
+    }
+    else
+    {
+        pinChange(mask);                   // poll response, bit low for each keypad with keys
+        pollsAnswered++;
+    }
+}
+
+void simReport(void)
+{
+    fprintf(stderr, "keybus: polls=%u answered=%u replies=%u f7=%u presses=%u rxlost=%u txns=%u merged=%u txnerrors=%u stalls=%u\n",
+        polls, pollsAnswered, replies, f7s, presses, rxLost, txns, merged, txnErrors, stalls);
+}
+
+// SoftwareSerial -------------------------------------------------------------------------------
+
+SoftwareSerial::SoftwareSerial(uint8_t receivePin, uint8_t transmitPin, bool inverse_logic)
+{
+    _receivePin = receivePin;
+    _inverse_logic = inverse_logic;
+    _parity = false;
+    _vote = false;
+    _rx_voted = 0;
+    _buffer_overflow = false;
+    _tx_delay = 0;
+}
+
+SoftwareSerial::~SoftwareSerial()
+{
+}
+
+void SoftwareSerial::begin(long speed)
+{
+    _tx_delay = 1;
+    frameNs = 12 * 1000000000ULL / speed;  // start + 8 data + parity + 2 stop
+    listen();
+}
+
+bool SoftwareSerial::listen()
+{
+    active_object = this;
+    _rx_ring.clear();
+    return true;
+}
+
+void SoftwareSerial::end()
+{
+}
+
+bool SoftwareSerial::stopListening()
+{
+    active_object = 0;
+    return true;
+}
+
+void SoftwareSerial::setParity(bool parity)
+{
+    _parity = parity;
+}
+
+// bytes arrive whole, there are no samples to vote on, so nothing is ever outvoted
+void SoftwareSerial::setVote(bool vote)
+{
+    _vote = vote;
+}
+
+uint16_t SoftwareSerial::getVoted()
+{
+    return _rx_voted;
+}
+
+uint8_t SoftwareSerial::rx_pin_read()
+{
+    return rxLevel;
+}
+
+void SoftwareSerial::tx_pin_write(uint8_t pin_state)
+{
+    txChange(pin_state);
+}
+
+// called by the pin change ISR at the start bit of a keypad byte
+void SoftwareSerial::recv()
+{
+    if (rxByte < 0)
+        return;
+
+    if (!_rx_ring.push(rxByte))
+        _buffer_overflow = true;
+    rxByte = -1;
+}
+
+// write one byte to the keypads, takes the frame time (less the second stop bit) with interrupts off
+size_t SoftwareSerial::write(uint8_t b)
+{
+    uint64_t ns = nativeNs();
+    uint64_t low = ns - txFallNs;
+    bool stalled = txLevel == LOW && nativeStallNs > txFallNs;
+    if (!txnSegs || (txLevel == LOW && low > SIM_SEGMENT_NS))
+        segmentStart(b, txnSegs ? low : SIM_PREAMBLE_NS + 1, stalled);
+    else if (stalled)
+        txnStall();
+    if (txLevel == LOW && low > SIM_POLL_LOW_NS)
+        txnError("write after %u us low, a poll to the keypads", (unsigned)(low / 1000));
+    if (pollPulse)                         // a long low went high, the keypads wait for poll clocks
+    {
+        if (!pollStalled)
+            txnError("write in a poll, after clock %d", pollPulse);
+        pollPulse = 0;
+    }
+
+    uint8_t oldSREG = SREG;
+    cli();
+    uint64_t end = ns + frameNs * (_parity ? 11 : 10) / 12;
+    while (nativeNs() < end)
+        ;
+    SREG = oldSREG;
+
+    txLevel = LOW;                         // stop bit level
+    txFallNs = nativeNs();
+
+    if (txnLen < sizeof(txnBuf))
+        txnBuf[txnLen++] = b;
+    if (txnLen == 2 && txnBuf[0] == 0xF6)
+    {
+        t_SimKeypad * kp = findKeypad(b);
+        if (kp && kp->numKeys)
+            keypadReply(kp, txFallNs);
+    }
+    if (txnLen == F7_MSG_SIZE && txnBuf[0] == 0xF7)
+        f7Written();
+    return 1;
+}
+
+int SoftwareSerial::available()
+{
+    return _rx_ring.available();
+}
+
+int SoftwareSerial::read()
+{
+    uint8_t d;
+    return _rx_ring.pop(&d) ? d : -1;
+}
+
+int SoftwareSerial::peek()
+{
+    const uint8_t * p = _rx_ring.peek();
+    return p ? *p : -1;
+}
+
+void SoftwareSerial::flush()
+{
+}
@@ -0,0 +1,10 @@
+// file SimKeybus.h - simulated keybus and keypad for the native firmware build
+
+#pragma once
+
+#include <stdint.h>
+
+void simInit(uint8_t addrMask, uint32_t keyPeriodMs, int eventFd, bool verbose);  // bit i is keypad 16+i
+void simTick(uint64_t ns);                   // deliver keypad bytes and key presses due by ns
+void simEvent(const char * fmt, ...);        // write '<ns> <text>' to the event fd
+void simReport(void);                        // print keybus stats to stderr
@@ -0,0 +1,40 @@
+// file Stream.h - native stand-in for the Arduino Print and Stream classes
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+class __FlashStringHelper;
+#define F(s)  ((const __FlashStringHelper *)(s))  // flash and ram are the same on the host
+
+class Print
+{
+public:
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t * buf, size_t size)
+    {
+        size_t n = 0;
+        while (size--)
+            n += write(*buf++);
+        return n;
+    }
+    size_t write(const char * s)                    { return write((const uint8_t *)s, strlen(s)); }
+
+    size_t print(const char * s)                    { return write(s); }
+    size_t print(const __FlashStringHelper * s)     { return write((const char *)s); }
+    size_t println(void)                            { return write("\r\n"); }
+    size_t println(const char * s)                  { return print(s) + println(); }
+    size_t println(const __FlashStringHelper * s)   { return print(s) + println(); }
+
+    virtual ~Print() {}
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+};
@@ -0,0 +1,21 @@
+// file eeprom.h - native stand-in for avr/eeprom.h, EEPROM is a ram array (erased at each start)
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <avr/io.h>
+
+extern uint8_t nativeEeprom[E2END + 1];
+
+#define EE_PTR(p)  (&nativeEeprom[(uintptr_t)(p) & E2END])
+
+static inline bool     eeprom_is_ready(void)                          { return true; }
+static inline uint8_t  eeprom_read_byte(const uint8_t * p)            { return *EE_PTR(p); }
+static inline uint16_t eeprom_read_word(const uint16_t * p)           { uint16_t w; memcpy(&w, EE_PTR(p), 2); return w; }
+static inline void     eeprom_read_block(void * d, const void * p, size_t n)   { memcpy(d, EE_PTR(p), n); }
+static inline void     eeprom_update_byte(uint8_t * p, uint8_t v)     { *EE_PTR(p) = v; }
+static inline void     eeprom_write_byte(uint8_t * p, uint8_t v)      { *EE_PTR(p) = v; }
+static inline void     eeprom_update_word(uint16_t * p, uint16_t v)   { memcpy(EE_PTR(p), &v, 2); }
+static inline void     eeprom_update_block(const void * s, void * p, size_t n) { memcpy(EE_PTR(p), s, n); }
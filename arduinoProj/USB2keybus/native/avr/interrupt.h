@@ -0,0 +1,19 @@
+// file interrupt.h - native stand-in for avr/interrupt.h
+//
+// An ISR is a plain function, run by NativeCore.cpp (ADC, watchdog) or SimKeybus.cpp (pin change)
+// when SREG allows it.  Only the vectors the firmware uses are defined, so the ISR_ALIASOF copies
+// for the other pin change vectors compile out.
+
+#pragma once
+
+#include <avr/io.h>
+
+#define ISR(vect, ...)    extern "C" void vect(void)
+#define ISR_ALIASOF(v)
+
+#define PCINT0_vect       native_pcint0_vect
+#define ADC_vect          native_adc_vect
+#define WDT_vect          native_wdt_vect
+
+static inline void cli(void)  { SREG &= ~_BV(SREG_I); }
+static inline void sei(void)  { SREG |= _BV(SREG_I); }
@@ -0,0 +1,36 @@
+// file io.h - native stand-in for the AVR registers the firmware touches
+//
+// Registers are plain variables.  SREG bit 7 is the global interrupt enable, checked before any
+// simulated interrupt is run.  ADC reads the simulated rail of the channel selected in ADMUX.
+// GPIOR0 is left undefined so the profile markers in Profile.h compile out.
+
+#pragma once
+
+#include <stdint.h>
+
+extern volatile uint8_t  SREG, ADCSRA, ADCSRB, ADMUX, WDTCSR, MCUSR, SMCR;
+extern volatile uint16_t ADC;
+
+#define _BV(b)   (1 << (b))
+
+#define SREG_I   (7)
+
+#define ADEN     (7)
+#define ADSC     (6)
+#define ADATE    (5)
+#define ADIF     (4)
+#define ADIE     (3)
+#define ADPS2    (2)
+#define ADPS1    (1)
+#define ADPS0    (0)
+#define REFS0    (6)
+#define MUX5     (3)
+
+#define WDIF     (7)
+#define WDIE     (6)
+#define WDP3     (5)
+#define WDCE     (4)
+#define WDE      (3)
+#define WDRF     (3)
+
+#define E2END    (0x0FFF)  // 4KB EEPROM of the mega2560
@@ -0,0 +1,20 @@
+// file pgmspace.h - native stand-in for avr/pgmspace.h, flash and ram are the same on the host
+
+#pragma once
+
+#include <string.h>
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(s)                  (s)
+#define pgm_read_byte(p)         (*(const uint8_t *)(p))
+#define pgm_read_word(p)         (*(const uint16_t *)(p))
+#define pgm_read_dword(p)        (*(const uint32_t *)(p))
+#define memcpy_P                 memcpy
+#define strcpy_P                 strcpy
+#define strncpy_P                strncpy
+#define strcmp_P                 strcmp
+#define strncmp_P                strncmp
+#define strlen_P                 strlen
+#define sprintf_P                sprintf
+#define snprintf_P               snprintf
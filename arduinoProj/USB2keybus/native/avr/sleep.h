@@ -0,0 +1,12 @@
+// file sleep.h - native stand-in for avr/sleep.h, sleep_cpu() waits for pty input or ~100us
+
+#pragma once
+
+#define SLEEP_MODE_IDLE      (0)
+
+void nativeSleep(void);
+
+#define set_sleep_mode(m)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()          nativeSleep()
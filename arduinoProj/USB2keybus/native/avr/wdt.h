@@ -0,0 +1,10 @@
+// file wdt.h - native stand-in for avr/wdt.h, the watchdog is run from micros() (see NativeCore.cpp)
+
+#pragma once
+
+#include <avr/io.h>
+
+void nativeWdtReset(void);
+
+#define wdt_reset()          nativeWdtReset()
+#define wdt_disable()        (WDTCSR = 0)
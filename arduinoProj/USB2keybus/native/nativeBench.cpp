@@ -0,0 +1,502 @@
+// file nativeBench.cpp - full stack benchmark for the native firmware build
+//
+// Starts native/USB2keybus-native with its event pipe on fd 3, connects a KeybusClient to the
+// firmware's pty, as Pi side software would to /dev/ttyACM0, and for secs seconds:
+//   - sends batches of F7 commands, each with a sequence number in line 2, and a SYNC after each
+//     batch.  A batch is accepted when its SYNC comes back; ERR lines count rejected commands
+//   - matches the F7 bus events from the simulated keybus to the send time of each command
+//     (command-to-bus latency).  F7s replaced by a newer one before reaching the bus are counted
+//   - the simulated keypads (keypads of them, at 16 up) press a key every keyMs.  Each PRESS event
+//     is matched to the key code in the KEYS report of that keypad (key-report latency)
+//   - with merge, MERGE 1 is sent before the run, and BUS? after it for the merged count and the
+//     keybus time saved per poll.  The simulated keybus checks every transaction, TXN events are
+//     the ones the keypads would not take
+//   - with railMs, rail 0 of the simulated board drops out and comes back every railMs, with power
+//     fail on (PFAIL 0).  Each POWER event is matched to its rail change (rail-to-USB latency, which
+//     includes the up to ~5ms the ADC takes to see it), and its lat= (ISR to Serial handoff) is kept
+//   - with queries, each batch also sends that many CFG?/BUS?/LOOP?/REL? queries, a stand-in for a
+//     Pi streaming metrics off the board.  The USB bytes received are reported against the link rate
+// Both processes time stamp with CLOCK_MONOTONIC, so the latencies are end to end.
+// With baud, the link is switched with the BAUD command before the run, as Pi software would.  The
+// native HardwareSerial paces bytes at the baud rate, but doesn't model USART overruns.
+//
+// build: make native
+// usage: nativeBench <native firmware> [secs] [batch] [keyMs] [baud] [queries] [keypads] [merge] [railMs]
+
+#include "KeybusClient.h"
+#include "F7Builder.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#define EVENT_FD      (3)      // fd the firmware writes events to
+#define MAX_F7_SEQ    (1<<20)  // F7 send times kept
+#define SYNC_WAIT_MS  (2000)   // batch is lost if its SYNC is not back in this time
+#define BAUD_WAIT_MS   (250)   // BAUD reply wait
+#define BAUD_TRIES       (6)   // BAUD? sent this many times to confirm, within the firmware's confirm time
+#define MAX_KEYPADS      (8)   // keypads 16-23
+#define BUS_WAIT_MS    (500)   // BUS? and PFAIL? reply wait
+#define PFAIL_LEVEL   "1200"   // power fail level for rail 0 (100ths of volts), the sim reads 14.25V or 0V
+
+// queries sent round robin as the metrics stream
+static const char * queries[] = { "CFG?", "BUS?", "LOOP?", "REL?" };
+
+#define NUM_QUERIES  (sizeof(queries) / sizeof(queries[0]))
+
+// nanoseconds, CLOCK_MONOTONIC, as the firmware's event time stamps
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef struct {
+    uint32_t syncSeen;          // SYNC replies
+    uint32_t errs;              // ERR lines
+    uint32_t warns;             // WARN lines
+    uint32_t keyReports;        // KEYS lines
+    uint32_t keysUnmatched;     // key codes with no PRESS event to match
+    uint32_t baudSeen;          // BAUD replies
+    bool     baudOk;            // last BAUD reply had ok=1
+    char     bus[160];          // last BUS reply
+    char     pfail[96];         // last PFAIL reply
+    uint32_t powerFail;         // POWER FAIL events
+    uint32_t powerOk;           // POWER OK events
+    uint32_t powerUnmatched;    // POWER events with no rail change to match
+    std::deque<std::pair<bool,uint64_t> > railChanges;  // rail low, change time
+    std::vector<double> railLat; // ms
+    std::vector<double> handoffLat; // lat= of POWER events, ms
+    std::deque<std::pair<uint8_t,uint64_t> > presses[MAX_KEYPADS];  // key code, press time per keypad
+    std::vector<double> keyLat; // ms
+} t_Bench;
+
+// client callback: match key codes to presses, count replies
+static void onLine(const t_KbEvent * ev, void * ctx)
+{
+    t_Bench * b = (t_Bench *)ctx;
+    uint64_t ns = nowNs();
+
+    switch (ev->type)
+    {
+        case KB_EV_SYNC: b->syncSeen++;  break;
+        case KB_EV_ERR:  b->errs++;      break;
+        case KB_EV_WARN: b->warns++;     break;
+        case KB_EV_STATUS:
+            if (ev->name.len == 4 && memcmp(ev->name.p, "BAUD", 4) == 0)
+            {
+                b->baudSeen++;
+                b->baudOk = memmem(ev->args.p, ev->args.len, "ok=1", 4) != NULL;
+            }
+            else if (ev->name.len == 3 && memcmp(ev->name.p, "BUS", 3) == 0)
+            {
+                snprintf(b->bus, sizeof(b->bus), "%.*s", (int)ev->args.len, ev->args.p);
+            }
+            else if (ev->name.len == 5 && memcmp(ev->name.p, "PFAIL", 5) == 0)
+            {
+                snprintf(b->pfail, sizeof(b->pfail), "%.*s", (int)ev->args.len, ev->args.p);
+            }
+            break;
+        case KB_EV_POWER:
+        {
+            ev->fail ? b->powerFail++ : b->powerOk++;
+            const char * lat = (const char *)memmem(ev->line.p, ev->line.len, "lat=", 4);
+            uint64_t seenNs = ns;  // the firmware saw the change before this
+            if (lat)
+            {
+                uint32_t us = strtoul(lat + 4, NULL, 10);
+                b->handoffLat.push_back(us / 1e3);
+                seenNs -= us * 1000ULL;
+            }
+            // changes alternate, skip the ones the firmware didn't see: a change of the other kind,
+            // or one followed by a change of the same kind that was also in time to be seen
+            std::deque<std::pair<bool,uint64_t> > & rc = b->railChanges;
+            while (!rc.empty() && (rc.front().first != ev->fail ||
+                   (rc.size() > 2 && rc[2].first == ev->fail && rc[2].second <= seenNs)))
+                rc.pop_front();
+            if (b->railChanges.empty())
+            {
+                b->powerUnmatched++;
+                break;
+            }
+            b->railLat.push_back((ns - b->railChanges.front().second) / 1e6);
+            b->railChanges.pop_front();
+            break;
+        }
+        case KB_EV_KEYS:
+        {
+            b->keyReports++;
+            if (ev->addr < 16 || ev->addr >= 16 + MAX_KEYPADS)
+            {
+                b->keysUnmatched += ev->len;
+                break;
+            }
+            std::deque<std::pair<uint8_t,uint64_t> > & presses = b->presses[ev->addr - 16];
+            for (uint8_t i=0; i < ev->len; i++)
+            {
+                while (!presses.empty() && presses.front().first != ev->data[i])
+                    presses.pop_front();  // press the keypad dropped
+                if (presses.empty())
+                {
+                    b->keysUnmatched++;
+                    continue;
+                }
+                b->keyLat.push_back((ns - presses.front().second) / 1e6);
+                presses.pop_front();
+            }
+            break;
+        }
+    }
+}
+
+typedef struct {
+    char     buf[4096];
+    size_t   len;
+    char     pty[64];           // path from the PTY event
+    uint32_t f7Bus;             // F7 mesgs seen on the bus
+    uint32_t f7Other;           // F7 mesgs not from the bench (init banner, ..)
+    uint32_t txnErrors;         // TXN events
+    std::vector<uint64_t> * sendNs;
+    std::vector<double> f7Lat;  // ms
+} t_Events;
+
+// handle one event line from the firmware
+static void onEvent(t_Events * e, char * line)
+{
+    unsigned long long ns;
+    int off;
+    if (sscanf(line, "%llu %n", &ns, &off) != 1)
+        return;
+    char * ev = line + off;
+
+    if (strncmp(ev, "PTY ", 4) == 0)
+    {
+        snprintf(e->pty, sizeof(e->pty), "%s", ev + 4);
+    }
+    else if (strncmp(ev, "F7 ", 3) == 0)
+    {
+        e->f7Bus++;
+        const char * l2 = strchr(ev, '|');
+        unsigned seq;
+        if (l2 && sscanf(l2 + 1, "Bench %u", &seq) == 1 && seq < e->sendNs->size() && (*e->sendNs)[seq])
+            e->f7Lat.push_back((ns - (*e->sendNs)[seq]) / 1e6);
+        else
+            e->f7Other++;
+    }
+    else if (strncmp(ev, "TXN ", 4) == 0)
+    {
+        if (e->txnErrors++ < 5)
+            printf("  bus: %s\n", ev);
+    }
+}
+
+// read firmware events, pass press events to the key matcher.  Returns: false on eof
+static bool readEvents(int fd, t_Events * e, t_Bench * b)
+{
+    ssize_t n = read(fd, e->buf + e->len, sizeof(e->buf) - e->len - 1);
+    if (n == 0)
+        return false;
+    if (n < 0)
+        return errno == EAGAIN;
+    e->len += n;
+
+    char * start = e->buf;
+    char * nl;
+    while ((nl = (char *)memchr(start, '\n', e->buf + e->len - start)) != NULL)
+    {
+        *nl = '\0';
+        unsigned long long ns;
+        unsigned addr, key;
+        char state[4];
+        if (sscanf(start, "%llu PRESS %u %u", &ns, &addr, &key) == 3 && addr >= 16 && addr < 16 + MAX_KEYPADS)
+            b->presses[addr - 16].push_back(std::make_pair((uint8_t)key, (uint64_t)ns));
+        else if (sscanf(start, "%llu RAIL 0 %3s", &ns, state) == 2)
+            b->railChanges.push_back(std::make_pair(strcmp(state, "LOW") == 0, (uint64_t)ns));
+        else
+            onEvent(e, start);
+        start = nl + 1;
+    }
+    e->len -= start - e->buf;
+    memmove(e->buf, start, e->len);
+    return true;
+}
+
+// print min/median/99th/max of a set of latencies
+static void printLat(const char * name, std::vector<double> & v)
+{
+    if (v.empty())
+    {
+        printf("  %-10s none\n", name);
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    printf("  %-10s n=%zu min=%.2f p50=%.2f p99=%.2f max=%.2f ms\n", name, v.size(), v.front(),
+        v[v.size() / 2], v[v.size() * 99 / 100], v.back());
+}
+
+// run the client until a BAUD reply arrives.  Returns: false on timeout
+static bool waitBaud(KeybusClient & client, t_Bench * b, uint32_t seen)
+{
+    uint64_t end = nowNs() + BAUD_WAIT_MS * 1000000ULL;
+    while (b->baudSeen == seen && nowNs() < end)
+    {
+        if (client.run(10) < 0)
+            return false;
+    }
+    return b->baudSeen != seen;
+}
+
+// switch the link as the Pi side would: BAUD <rate>, switch the tty when the reply (sent at the old
+// rate) arrives, confirm with BAUD? at the new rate.  A BAUD? that arrives while the firmware is still
+// switching is lost, so it is sent again until a reply comes.  Returns: false if the rate wasn't confirmed
+static bool switchBaud(KeybusClient & client, t_Bench * b, uint32_t baud)
+{
+    char cmd[32];
+    int len = snprintf(cmd, sizeof(cmd), "BAUD %u", baud);
+    uint32_t seen = b->baudSeen;
+    client.send(cmd, len);
+    if (!waitBaud(client, b, seen) || !client.setSpeed(baud))
+        return false;
+
+    for (uint8_t i=0; i < BAUD_TRIES; i++)
+    {
+        seen = b->baudSeen;
+        client.send("BAUD?", 5);
+        if (waitBaud(client, b, seen))
+            return b->baudOk;
+    }
+    return false;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <native firmware> [secs] [batch] [keyMs] [baud] [queries] [keypads] [merge] [railMs]\n",
+            argv[0]);
+        return 1;
+    }
+    uint32_t secs  = argc > 2 ? strtoul(argv[2], NULL, 0) : 10;
+    uint32_t batch = argc > 3 ? strtoul(argv[3], NULL, 0) : 1;
+    const char * keyMs = argc > 4 ? argv[4] : "250";
+    uint32_t baud  = argc > 5 ? strtoul(argv[5], NULL, 0) : 115200;
+    uint32_t nQuery = argc > 6 ? strtoul(argv[6], NULL, 0) : 0;
+    uint32_t nKeypads = argc > 7 ? strtoul(argv[7], NULL, 0) : 1;
+    bool     merge = argc > 8 && atoi(argv[8]) != 0;
+    const char * railMs = argc > 9 ? argv[9] : "0";
+    if (nKeypads < 1 || nKeypads > MAX_KEYPADS)
+    {
+        fprintf(stderr, "keypads must be 1-%u\n", MAX_KEYPADS);
+        return 1;
+    }
+
+    int ev[2];
+    if (pipe(ev) != 0)
+    {
+        perror("pipe");
+        return 1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(ev[0]);  // may be EVENT_FD itself, so close it before the dup
+        dup2(ev[1], EVENT_FD);
+        if (ev[1] != EVENT_FD)
+            close(ev[1]);
+        char fdArg[8], addrArg[MAX_KEYPADS][4];
+        const char * args[9 + 2 * MAX_KEYPADS];
+        int n = 0;
+        snprintf(fdArg, sizeof(fdArg), "%d", EVENT_FD);
+        args[n++] = argv[1];
+        args[n++] = "-e";
+        args[n++] = fdArg;
+        args[n++] = "-k";
+        args[n++] = keyMs;
+        for (uint32_t k=0; k < nKeypads; k++)
+        {
+            snprintf(addrArg[k], sizeof(addrArg[k]), "%u", 16 + k);
+            args[n++] = "-a";
+            args[n++] = addrArg[k];
+        }
+        args[n++] = "-p";
+        args[n++] = railMs;
+        args[n] = NULL;
+        execv(argv[1], (char * const *)args);
+        perror(argv[1]);
+        _exit(1);
+    }
+    close(ev[1]);
+    fcntl(ev[0], F_SETFL, O_NONBLOCK);
+
+    t_Bench b;
+    b.syncSeen = b.errs = b.warns = b.keyReports = b.keysUnmatched = b.baudSeen = 0;
+    b.baudOk = false;
+    b.bus[0] = b.pfail[0] = '\0';
+    b.powerFail = b.powerOk = b.powerUnmatched = 0;
+    std::vector<uint64_t> sendNs(MAX_F7_SEQ, 0);
+    t_Events e;
+    e.len = 0;
+    e.pty[0] = '\0';
+    e.f7Bus = e.f7Other = e.txnErrors = 0;
+    e.sendNs = &sendNs;
+
+    // wait for the firmware's pty
+    uint64_t waitEnd = nowNs() + 5000000000ULL;
+    while (!e.pty[0] && nowNs() < waitEnd)
+    {
+        struct pollfd p = { ev[0], POLLIN, 0 };
+        poll(&p, 1, 100);
+        if (!readEvents(ev[0], &e, &b))
+            break;
+    }
+    KeybusClient client;
+    if (!e.pty[0] || !client.open(e.pty, 115200))
+    {
+        fprintf(stderr, "no pty from %s\n", argv[1]);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+    client.setCallback(onLine, &b);
+
+    if (baud != 115200 && !switchBaud(client, &b, baud))
+    {
+        fprintf(stderr, "firmware didn't switch to %u baud\n", baud);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return 1;
+    }
+
+    if (merge)
+        client.send("MERGE 1", 7);
+    if (atoi(railMs))
+        client.send("PFAIL 0 " PFAIL_LEVEL, 8 + strlen(PFAIL_LEVEL));
+
+    F7Builder f7;
+    f7.ready(true).power(true).backlight(true).line1("DISARMED");
+    uint32_t seq = 0, batches = 0, lost = 0, accepted = 0;
+    bool waiting = false;
+    uint32_t syncWant = 0;
+    uint64_t batchNs = 0;
+
+    uint32_t nSent = 0;
+    uint64_t rxStart = client.getBytes();
+    uint64_t start = nowNs(), end = start + secs * 1000000000ULL;
+    while (nowNs() < end && seq + batch < MAX_F7_SEQ)
+    {
+        if (!waiting)  // send the next batch and its SYNC
+        {
+            for (uint32_t i=0; i < batch; i++)
+            {
+                char l2[F7B_LINE_LEN+1];
+                size_t len;
+                snprintf(l2, sizeof(l2), "Bench %u", seq);
+                const char * cmd = f7.zone(seq & 0xFF).line2(l2).build(&len);
+                sendNs[seq++] = nowNs();
+                client.send(cmd, len);
+            }
+            for (uint32_t i=0; i < nQuery; i++, nSent++)
+            {
+                const char * q = queries[nSent % NUM_QUERIES];
+                client.send(q, strlen(q));
+            }
+            char cmd[32];
+            int len = snprintf(cmd, sizeof(cmd), "SYNC b%u", batches);
+            client.send(cmd, len);
+            syncWant = b.syncSeen + 1;
+            batchNs = nowNs();
+            waiting = true;
+        }
+
+        struct pollfd p[2] = { { client.getEpollFd(), POLLIN, 0 }, { ev[0], POLLIN, 0 } };
+        poll(p, 2, 10);
+        if (client.run(0) < 0)
+        {
+            fprintf(stderr, "read error: %s\n", strerror(errno));
+            break;
+        }
+        if (p[1].revents && !readEvents(ev[0], &e, &b))
+        {
+            fprintf(stderr, "firmware exited\n");
+            break;
+        }
+
+        if (b.syncSeen >= syncWant)
+        {
+            batches++;
+            accepted += batch;
+            waiting = false;
+        }
+        else if (nowNs() - batchNs > SYNC_WAIT_MS * 1000000ULL)
+        {
+            lost++;
+            waiting = false;
+        }
+    }
+    double elapsed = (nowNs() - start) / 1e9;
+    uint64_t rxBytes = client.getBytes() - rxStart;
+
+    // let the last F7s and key reports reach the bench
+    uint64_t drainEnd = nowNs() + 500000000ULL;
+    while (nowNs() < drainEnd)
+    {
+        struct pollfd p[2] = { { client.getEpollFd(), POLLIN, 0 }, { ev[0], POLLIN, 0 } };
+        poll(p, 2, 10);
+        client.run(0);
+        if (p[1].revents)
+            readEvents(ev[0], &e, &b);
+    }
+
+    client.send("BUS?", 4);
+    client.send("PFAIL?", 6);
+    uint64_t busEnd = nowNs() + BUS_WAIT_MS * 1000000ULL;
+    while ((!b.bus[0] || !b.pfail[0]) && nowNs() < busEnd)
+    {
+        if (client.run(10) < 0)
+            break;
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    client.close();
+
+    uint32_t f7Sent = seq;
+    uint32_t f7Matched = e.f7Lat.size();
+    size_t pending = 0;
+    for (uint8_t k=0; k < MAX_KEYPADS; k++)
+        pending += b.presses[k].size();
+
+    printf("%s: %.1f s, batch=%u, queries=%u, %u keypads, key every %s ms, %u baud, merge=%u\n", argv[1],
+        elapsed, batch, nQuery, nKeypads, keyMs, baud, merge);
+    printf("  F7 sent=%u accepted=%u (%.0f cmds/s) batches lost=%u err=%u warn=%u\n", f7Sent, accepted,
+        accepted / elapsed, lost, b.errs, b.warns);
+    printf("  F7 on bus=%u from bench=%u replaced before bus=%u other=%u\n", e.f7Bus, f7Matched,
+        f7Sent > f7Matched ? f7Sent - f7Matched : 0, e.f7Other);
+    printf("  keys: reports=%u unmatched=%u presses pending=%zu, %u bad lines\n", b.keyReports,
+        b.keysUnmatched, pending, client.getBadLines());
+    printf("  bus: %s, %u bad transactions\n", b.bus[0] ? b.bus : "no BUS reply", e.txnErrors);
+    if (atoi(railMs))
+    {
+        printf("  power: rail every %s ms, POWER FAIL=%u OK=%u unmatched=%u, %s\n", railMs, b.powerFail,
+            b.powerOk, b.powerUnmatched, b.pfail[0] ? b.pfail : "no PFAIL reply");
+        printLat("rail->usb", b.railLat);
+        printLat("lat=", b.handoffLat);
+    }
+    printf("  usb rx %.1f kB/s, %.0f%% of the link\n", rxBytes / elapsed / 1e3, rxBytes * 10 * 100.0 / elapsed / baud);
+    printLat("cmd->bus", e.f7Lat);
+    printLat("key->usb", b.keyLat);
+    return 0;
+}
@@ -0,0 +1,244 @@
+// file parseBench.cpp - host benchmark for the F7 command parser
+//
+// Times the firmware's USBprotocol::parseRecv against the parser it replaced (the per-char switch
+// that copied the whole F7 mesg in and out, kept here as legacyParseRecv) on the same F7 lines.
+// Both build the same F7 mesgs, which is checked first.  parseRecv is the whole path a command
+// takes in the firmware: the command dispatch, the parse, the checksum and the change check that
+// bumps the page version.  Both parsers are called through a pointer, as the firmware's parser is
+// an out of line call into another object file.  They are timed in short alternating batches and
+// the fastest batch of each is kept, so time lost to other processes doesn't count.  Host numbers only show the
+// relative cost, the AVR is a few hundred times slower.
+//
+// Links the firmware objects without USB2keybus.o and with NativeLib.o, see NativeCore.cpp
+//
+// build: make native
+// usage: parseBench [batches]
+
+#include "USBprotocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// F7 lines the Pi sends: both pages, every field or only a few.  Most of the time the Pi sends
+// the same status again, so that is timed too.  'b' ahead of '1', which the
+// legacy parser needs
+static const char * f7Lines[] = {
+    "F7 z=00 t=0 c=0 r=1 a=0 s=0 p=1 b=1 1=DISARMED         2=Ready to Arm    ",
+    "F7A z=05 t=0 c=0 r=0 a=0 s=0 p=1 b=1 1=FAULT 05         2=Front Door      ",
+    "F7 z=00 t=5 c=0 r=0 a=1 s=0 p=1 b=1 1=ARMED AWAY       2=Exit Now 45     ",
+    "F7 t=0 r=1",
+    "F7 z=FC t=7 c=1 r=0 a=1 s=1 p=0 b=0 1=** ALARM **      2=Zone 12 Motion  ",
+    "F7A b=1 1=Garage Open      2=since 18:42     ",
+};
+
+#define NUM_LINES  (sizeof(f7Lines) / sizeof(f7Lines[0]))
+
+// seconds since an arbitrary start
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the parser before the single pass one ------------------------------------------------------
+
+static t_MesgF7 legacyF7[2];
+
+static void legacyInitF7(t_MesgF7 * pMsgF7)
+{
+    memset((void *)pMsgF7, 0, sizeof(t_MesgF7));
+    pMsgF7->type    = 0xF7;
+    pMsgF7->keypads = 0xFF;
+    pMsgF7->addr4   = 0x00;
+    pMsgF7->prog    = 0x00;
+    pMsgF7->zone    = 0xFC;
+}
+
+static uint8_t legacyParseF7(const char * msg, uint8_t len, t_MesgF7 * pMsgF7)
+{
+    bool success = true;
+    bool lcd_backlight = false;
+
+    t_MesgF7 newF7;
+    t_MesgF7 * pNewF7 = &newF7;
+    memcpy(pNewF7, pMsgF7, sizeof(t_MesgF7)); // copy existing F7 mesg struct
+
+    for (uint8_t i=0; i < len && *(msg+i) != '\0'; i++)  // msg pointer starts after 'F7 ' or 'F7A '
+    {
+        if (*(msg+i) != ' ')  // skip over spaces
+        {
+            char parm = *(msg+i);
+            i += 2;  // move past parm and '=', msg+i now points at arg
+
+            switch (parm)
+            {
+            case 'z':
+                pNewF7->zone = GET_BYTE(*(msg+i), *(msg+i+1)); i += 2;
+                break;
+            case 't':
+                pNewF7->byte1 = GET_NIBBLE(*(msg+i)); i++;
+                break;
+            case 'c':
+                pNewF7->byte3 = SET_CHIME(pNewF7->byte3, GET_BOOL(*(msg+i))); i++;
+                break;
+            case 'r':
+                pNewF7->byte2 = SET_READY(pNewF7->byte2, GET_BOOL(*(msg+i))); i++;
+                break;
+            case 'a':
+                pNewF7->byte3 = SET_ARMED_AWAY(pNewF7->byte3, GET_BOOL(*(msg+i))); i++;
+                break;
+            case 's':
+                pNewF7->byte2 = SET_ARMED_STAY(pNewF7->byte2, GET_BOOL(*(msg+i))); i++;
+                break;
+            case 'p':
+                pNewF7->byte3 = SET_POWER(pNewF7->byte3, GET_BOOL(*(msg+i))); i++;
+                break;
+            case 'b':
+                lcd_backlight = GET_BOOL(*(msg+i)); i++;
+                break;
+            case '1':  // line1 arg must occur after 'b' parameter for this code to work
+                memset(pNewF7->line1, 0, LCD_LINE_LEN);
+                for (uint8_t j=0; j < LCD_LINE_LEN && i < len; j++)
+                {
+                    pNewF7->line1[j] = *(msg+i) & 0x7f;
+                    i++;
+                }
+                pNewF7->line1[0] |= lcd_backlight ? 0x80 : 0x00;  // or in backlight bit
+                break;
+            case '2':
+                memset(pNewF7->line2, 0, LCD_LINE_LEN);
+                for (uint8_t j=0; j < LCD_LINE_LEN && i < len; j++)
+                {
+                    pNewF7->line2[j] = *(msg+i) & 0x7f;
+                    i++;
+                }
+                break;
+            default:
+                success = false;
+                break;
+            }
+        }
+    }
+
+    if (success)
+    {
+        memcpy(pMsgF7, pNewF7, sizeof(t_MesgF7)); // replace existing F7 mesg with updated version
+
+        pMsgF7->chksum = 0;
+        for (uint8_t i=0; i < 44; i++)
+        {
+            pMsgF7->chksum += *(((uint8_t *)pMsgF7) + i);
+        }
+        pMsgF7->chksum = 0x100 - pMsgF7->chksum;  // two's compliment
+
+        return 0xF7;
+    }
+    return 0;  // failed to parse message
+}
+
+static uint8_t legacyParseRecv(const char * msg, uint8_t len)
+{
+    if (len > 4 && msg[0] == 'F' && msg[1] == '7' && msg[2] == 'A')
+        return legacyParseF7(msg+4, len-4, &legacyF7[1]);
+    else if (len > 4 && msg[0] == 'F' && msg[1] == '7')
+        return legacyParseF7(msg+3, len-3, &legacyF7[0]);
+    return 0x0;
+}
+
+// ------------------------------------------------------------------------------------------------
+
+static USBprotocol proto;
+
+static uint8_t passParseRecv(const char * msg, uint8_t len)
+{
+    return proto.parseRecv(msg, len);
+}
+
+#define BATCH_LINES  (6000)  // lines per timed batch
+
+// time one batch of a parser, keep it in pBest (ns per line) if fastest.  Batch goes through
+// all F7 lines, or resends the first one if same is set
+static void timeBatch(uint8_t (*parse)(const char *, uint8_t), const uint8_t * lens, bool same, double * pBest)
+{
+    double start = now();
+    for (uint32_t i=0; i < BATCH_LINES; i++)
+    {
+        uint8_t l = same ? 0 : i % NUM_LINES;
+        parse(f7Lines[l], lens[l]);
+    }
+    double ns = (now() - start) / BATCH_LINES * 1e9;
+    if (ns < *pBest)
+        *pBest = ns;
+}
+
+// both parsers from their init message through every line, then the first line twice more: once
+// sent to the keypads, it is not a change the second time. Returns: count of lines where the F7
+// pages differ or a repeat is taken as a change
+static uint32_t compare(void)
+{
+    static const char init[] = "F7 z=00 t=0 c=1 r=1 a=1 s=0 p=0 b=1 1=Arduino Init     2=Completed  v1.01";
+    uint32_t diffs = 0;
+
+    legacyInitF7(&legacyF7[0]);
+    legacyInitF7(&legacyF7[1]);
+    legacyParseRecv(init, strlen(init));
+    proto.init();
+
+    for (uint8_t l=0; l < NUM_LINES; l++)
+    {
+        uint8_t len = strlen(f7Lines[l]);
+        uint8_t a = legacyParseRecv(f7Lines[l], len);
+        uint8_t b = proto.parseRecv(f7Lines[l], len);
+        for (uint8_t p=0; p < 2; p++)
+        {
+            if (a != b || memcmp(&legacyF7[p], proto.getPage(p), sizeof(t_MesgF7)) != 0)
+            {
+                printf("  differ on page %u after '%s'\n", p, f7Lines[l]);
+                diffs++;
+            }
+        }
+    }
+
+    uint8_t len = strlen(f7Lines[0]);
+    proto.parseRecv(f7Lines[0], len);
+    proto.getF7();
+    proto.parseRecv(f7Lines[0], len);
+    if (proto.f7Dirty())
+    {
+        printf("  same '%s' again taken as a change\n", f7Lines[0]);
+        diffs++;
+    }
+    return diffs;
+}
+
+int main(int argc, char ** argv)
+{
+    uint32_t batches = argc > 1 ? strtoul(argv[1], NULL, 0) : 500;
+    uint8_t  lens[NUM_LINES];
+
+    for (uint8_t l=0; l < NUM_LINES; l++)
+        lens[l] = strlen(f7Lines[l]);
+
+    uint32_t diffs = compare();
+    printf("check: %u lines, %u differ\n", (unsigned)NUM_LINES + 2, diffs);
+
+    for (uint8_t same=0; same < 2; same++)
+    {
+        double legacyNs = 1e9, passNs = 1e9;
+        for (uint32_t b=0; b < batches; b++)  // batches alternate, so both see the same machine load
+        {
+            timeBatch(legacyParseRecv, lens, same, &legacyNs);
+            timeBatch(passParseRecv, lens, same, &passNs);
+        }
+        printf("%s (fastest of %u batches of %u lines)\n", same ? "same line resent" : "lines change",
+               batches, BATCH_LINES);
+        printf("  legacy: %.1f ns/line\n", legacyNs);
+        printf("  1 pass: %.1f ns/line\n", passNs);
+        printf("  1 pass/legacy: %.2f\n", passNs / legacyNs);
+    }
+
+    return diffs ? 1 : 0;
+}
@@ -0,0 +1,376 @@
+// file protoTest.cpp - round trip tests between the firmware's USBprotocol and the Pi side client
+//
+// Pi to Arduino: F7 commands built with F7Builder are fed to USBprotocol::parseRecv and the F7
+// pages it builds are checked field by field against what was set, including the checksum, the
+// backlight bit, fields left as they were, every char lcd text may hold, the primary/alternate
+// page switch, and the column reported for a bad command.  A page dumped by f7PageMsg (STATE?)
+// and sent back must set the same bytes, zeros and other chars text can't hold included.  Arduino
+// to Pi: the key, power and SYNC lines the firmware generates are parsed by KeybusClient::parseLine
+// and the fields checked against what went in.  A failed check prints its line and the test exits
+// with status 1, so make check fails.
+//
+// Links the firmware objects without USB2keybus.o and with NativeLib.o, see NativeCore.cpp
+//
+// build and run: make check
+
+#include "USBprotocol.h"
+#include "KeypadSerial.h"
+#include "KeybusClient.h"
+#include "F7Builder.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int checks, failures;
+
+#define CHECK(cond) \
+    do { checks++; if (!(cond)) { failures++; printf("protoTest.cpp:%d: CHECK(%s) failed\n", __LINE__, #cond); } } while (0)
+
+#define PRINT_BUF_SIZE  (128)  // same as the firmware's print buffer
+
+static USBprotocol proto;
+
+// send a built F7 command to the firmware parser. Returns: parseRecv() result
+static uint8_t sendF7(F7Builder & f7)
+{
+    size_t len;
+    const char * cmd = f7.build(&len);
+    return proto.parseRecv(cmd, len);
+}
+
+// true if the page's checksum makes its first 45 bytes sum to zero
+static bool chksumOk(const t_MesgF7 * pPage)
+{
+    uint8_t sum = 0;
+    for (uint8_t i=0; i < 45; i++)
+        sum += *(((const uint8_t *)pPage) + i);
+    return sum == 0;
+}
+
+// true if lcd line holds text, padded with spaces (backlight bit masked off)
+static bool lineIs(const char * line, const char * text)
+{
+    for (uint8_t i=0; i < LCD_LINE_LEN; i++)
+    {
+        char c = *text ? *text++ : ' ';
+        if ((line[i] & 0x7f) != c)
+            return false;
+    }
+    return true;
+}
+
+// every field set lands in its byte and bit of the page
+static void testF7AllFields(void)
+{
+    F7Builder f7;
+
+    proto.init();
+    t_MesgF7 alt = *proto.getPage(1);
+
+    f7.zone(0x12).tone(5).chime(true).ready(true).armAway(false).armStay(true).power(true).backlight(true)
+      .line1("READY TO ARM").line2("Zone 12");
+    CHECK(sendF7(f7) == USB_CMD_F7);
+
+    const t_MesgF7 * p = proto.getPage(0);
+    CHECK(p->type == 0xF7);
+    CHECK(p->zone == 0x12);
+    CHECK(p->byte1 == 5);
+    CHECK(GET_CHIME(p->byte3));
+    CHECK(GET_READY(p->byte2));
+    CHECK(!GET_ARMED_AWAY(p->byte3));
+    CHECK(GET_ARMED_STAY(p->byte2));
+    CHECK(GET_POWER(p->byte3));
+    CHECK(p->line1[0] & 0x80);                  // backlight
+    CHECK(lineIs(p->line1, "READY TO ARM"));
+    CHECK(lineIs(p->line2, "Zone 12"));
+    CHECK(!(p->line2[0] & 0x80));
+    CHECK(chksumOk(p));
+    CHECK(!proto.getAltActive());
+    CHECK(memcmp(proto.getPage(1), &alt, sizeof(alt)) == 0);
+
+    f7.clear();
+    f7.zone(0xFC).tone(0).chime(false).ready(false).armAway(true).armStay(false).power(false).backlight(false)
+      .line1("ARMED AWAY").line2("");
+    CHECK(sendF7(f7) == USB_CMD_F7);
+    CHECK(p->zone == 0xFC && p->byte1 == 0);
+    CHECK(!GET_CHIME(p->byte3) && !GET_READY(p->byte2) && GET_ARMED_AWAY(p->byte3));
+    CHECK(!GET_ARMED_STAY(p->byte2) && !GET_POWER(p->byte3));
+    CHECK(!(p->line1[0] & 0x80));
+    CHECK(lineIs(p->line1, "ARMED AWAY"));
+    CHECK(lineIs(p->line2, ""));
+    CHECK(chksumOk(p));
+}
+
+// every zone and tone value goes through
+static void testF7ZoneTone(void)
+{
+    F7Builder f7;
+    bool ok = true;
+
+    proto.init();
+    for (uint16_t z=0; z < 256; z++)
+    {
+        f7.clear();
+        f7.zone(z).tone(z & 0x0F);
+        ok &= sendF7(f7) == USB_CMD_F7;
+        ok &= proto.getPage(0)->zone == z && proto.getPage(0)->byte1 == (z & 0x0F);
+        ok &= chksumOk(proto.getPage(0));
+    }
+    CHECK(ok);
+}
+
+// only the fields set are sent, the rest of the page is left as it was
+static void testF7Partial(void)
+{
+    F7Builder f7;
+
+    proto.init();
+    f7.zone(0x21).tone(1).chime(true).ready(true).power(true).backlight(true).line1("DISARMED").line2("Ready");
+    sendF7(f7);
+    t_MesgF7 before = *proto.getPage(0);
+
+    f7.clear();
+    f7.ready(false);
+    CHECK(sendF7(f7) == USB_CMD_F7);
+    const t_MesgF7 * p = proto.getPage(0);
+    CHECK(!GET_READY(p->byte2));
+    CHECK(p->zone == before.zone && p->byte1 == before.byte1 && p->byte3 == before.byte3);
+    CHECK(memcmp(p->line1, before.line1, LCD_LINE_LEN) == 0);  // backlight kept too
+    CHECK(memcmp(p->line2, before.line2, LCD_LINE_LEN) == 0);
+    CHECK(chksumOk(p));
+
+    f7.clear();
+    f7.line2("Door Open");                      // line2 alone doesn't touch the backlight
+    CHECK(sendF7(f7) == USB_CMD_F7);
+    CHECK(lineIs(p->line2, "Door Open"));
+    CHECK(p->line1[0] & 0x80);
+    CHECK(lineIs(p->line1, "DISARMED"));
+
+    f7.clear();
+    f7.line1("NOT READY");                      // line1 without b=1 turns it off
+    CHECK(sendF7(f7) == USB_CMD_F7);
+    CHECK(!(p->line1[0] & 0x80));
+    CHECK(lineIs(p->line1, "NOT READY"));
+    CHECK(chksumOk(p));
+}
+
+// every char lcd text can hold, text cut at 16 chars, and chars the builder blanks
+static void testF7Text(void)
+{
+    F7Builder f7;
+    char text[LCD_LINE_LEN+1];
+    bool ok = true;
+
+    proto.init();
+    for (uint8_t c=' '; c <= '~'; c += LCD_LINE_LEN)  // all printable chars, including '=' and spaces
+    {
+        for (uint8_t i=0; i < LCD_LINE_LEN; i++)
+            text[i] = c + i <= '~' ? c + i : '~';
+        text[LCD_LINE_LEN] = '\0';
+        f7.clear();
+        f7.backlight(true).line1(text).line2(text);
+        ok &= sendF7(f7) == USB_CMD_F7;
+        ok &= lineIs(proto.getPage(0)->line1, text) && lineIs(proto.getPage(0)->line2, text);
+    }
+    CHECK(ok);
+
+    f7.clear();
+    f7.line1("0123456789ABCDEFGHIJ").line2("tab\there\x7f");
+    CHECK(sendF7(f7) == USB_CMD_F7);
+    CHECK(lineIs(proto.getPage(0)->line1, "0123456789ABCDEF"));
+    CHECK(lineIs(proto.getPage(0)->line2, "tab here "));
+}
+
+// F7A sets the alternate page and starts the rotation, F7 ends it
+static void testF7AltPage(void)
+{
+    F7Builder f7;
+
+    proto.init();
+    t_MesgF7 primary = *proto.getPage(0);
+
+    f7.alt(true).zone(0x05).backlight(true).line1("FAULT 05").line2("Front Door");
+    CHECK(sendF7(f7) == USB_CMD_F7);
+    CHECK(proto.getAltActive());
+    const t_MesgF7 * p = proto.getPage(1);
+    CHECK(p->zone == 0x05);
+    CHECK(lineIs(p->line1, "FAULT 05") && (p->line1[0] & 0x80));
+    CHECK(lineIs(p->line2, "Front Door"));
+    CHECK(chksumOk(p));
+    CHECK(memcmp(proto.getPage(0), &primary, sizeof(primary)) == 0);
+
+    f7.clear();
+    f7.ready(true);
+    CHECK(sendF7(f7) == USB_CMD_F7);
+    CHECK(!proto.getAltActive());
+    CHECK(GET_READY(proto.getPage(0)->byte2));
+    CHECK(proto.getPage(1)->zone == 0x05);      // alternate page is kept
+}
+
+// a bad F7 command is rejected whole, with the column of the first bad char, and the page is left
+// as it was.  b= with no value is rejected too (the parser before the single pass one took it as
+// b=0 and went on)
+static void testF7Errors(void)
+{
+    static const struct {
+        const char * cmd;
+        uint8_t      col;
+    } bad[] = {
+        { "F7 b= 1=HELLO",          5 },  // bool with no value
+        { "F7 r=1 b=",              9 },  // same at the end of the command
+        { "F7 z=0G 1=HELLO",        6 },  // bad hex digit
+        { "F7 z=1",                 6 },  // byte cut short
+        { "F7 t=12",                6 },  // arg too long
+        { "F7 c=2",                 5 },  // not a bool
+        { "F7 q=1",                 3 },  // unknown parm
+        { "F7 r 1",                 4 },  // no '='
+        { "F7A p=1 1=FAULT 2=\x01", 18 },  // text stops at a char it can't hold
+        { "F7 x=414243",           11 },  // hex line cut short
+        { "F7 y=4142434445464748494A4B4C4D4E4F4G", 36 },  // bad hex digit
+        { "F7 x=4142434445464748494A4B4C4D4E4F505", 37 },  // hex line too long
+    };
+
+    proto.init();
+    t_MesgF7 pages[2] = { *proto.getPage(0), *proto.getPage(1) };
+    bool alt = proto.getAltActive();
+
+    for (uint8_t i=0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    {
+        if (proto.parseRecv(bad[i].cmd, strlen(bad[i].cmd)) != USB_CMD_UNKNOWN || proto.getErrPos() != bad[i].col)
+        {
+            printf("  '%s': col %u, want %u\n", bad[i].cmd, proto.getErrPos(), bad[i].col);
+            CHECK(false);
+        }
+    }
+    CHECK(memcmp(proto.getPage(0), &pages[0], sizeof(t_MesgF7)) == 0);
+    CHECK(memcmp(proto.getPage(1), &pages[1], sizeof(t_MesgF7)) == 0);
+    CHECK(proto.getAltActive() == alt);
+}
+
+// a page dumped by f7PageMsg and sent back is the same page, byte for byte.  Short text is zero
+// padded and a line with a zero byte (or any char text can't hold) is dumped as hex
+static void testF7PageRoundTrip(void)
+{
+    static const char * cmds[] = {
+        "F7 z=12 t=0 c=1 r=1 a=0 s=0 p=1 b=1 1=DISARMED        2=Ready to Arm    ",
+        "F7 z=03 b=1 1=HELLO",                                          // line1 zero padded
+        "F7A p=1 x=00C1FF417F0102030405060708090A0B y=0000000000000000000000000000005C",
+    };
+    char buf[PRINT_BUF_SIZE];
+    char dump[PRINT_BUF_SIZE];
+
+    for (uint8_t i=0; i < sizeof(cmds) / sizeof(cmds[0]); i++)
+    {
+        proto.init();
+        CHECK(proto.parseRecv(cmds[i], strlen(cmds[i])) == USB_CMD_F7);
+        uint8_t page = proto.getAltActive() ? 1 : 0;
+        t_MesgF7 sent = *proto.getPage(page);
+        strcpy(dump, proto.f7PageMsg(buf, sizeof(buf), page));
+
+        size_t len = strlen(dump);
+        CHECK(len > 0 && dump[len-1] == '\n');
+        proto.init();
+        CHECK(proto.parseRecv(dump, len-1) == USB_CMD_F7);  // without the newline, as PiSerial passes it
+        CHECK(memcmp(proto.getPage(page), &sent, sizeof(sent)) == 0);
+        CHECK(strcmp(proto.f7PageMsg(buf, sizeof(buf), page), dump) == 0);
+    }
+
+    proto.init();
+    CHECK(proto.parseRecv(cmds[1], strlen(cmds[1])) == USB_CMD_F7);
+    CHECK(strstr(proto.f7PageMsg(buf, sizeof(buf), 0), " b=1 x=48454C4C4F0000000000000000000000 2=") != NULL);
+}
+
+// key reports from keyMsg parse back to the same keypad, bytes and stamp
+static void testKeyMsg(void)
+{
+    char buf[PRINT_BUF_SIZE];
+    t_KbEvent ev;
+
+    proto.init();
+    uint8_t keys[3] = { 0x01, 0x0b, 0x0a };
+    proto.keyMsg(buf, sizeof(buf), 16, 3, keys, KEYS_MESG, 123456, 42);
+    CHECK(KeybusClient::parseLine(buf, strlen(buf) - 1, &ev));  // without the newline
+    CHECK(ev.type == KB_EV_KEYS);
+    CHECK(ev.addr == 16 && ev.len == 3);
+    CHECK(memcmp(ev.data, keys, 3) == 0);
+    CHECK(ev.hasStamp && ev.time == 123456 && ev.seq == 42);
+
+    proto.keyMsg(buf, sizeof(buf), 7, 1, keys, KEYS_MESG, 4294967295u, 65535);  // address below 10
+    CHECK(KeybusClient::parseLine(buf, strlen(buf) - 1, &ev));
+    CHECK(ev.addr == 7 && ev.len == 1 && ev.data[0] == 0x01);
+    CHECK(ev.time == 4294967295u && ev.seq == 65535);
+
+    proto.keyMsg(buf, sizeof(buf), 18, 0, keys, KEYS_MESG, 5, 6);  // no data bytes
+    CHECK(KeybusClient::parseLine(buf, strlen(buf) - 1, &ev));
+    CHECK(ev.addr == 18 && ev.len == 0);
+    CHECK(ev.hasStamp && ev.time == 5 && ev.seq == 6);
+
+    uint8_t pwup[9] = { 0x87, 0, 0, 0, 0, 0, 0, 0, 0x79 };
+    proto.keyMsg(buf, sizeof(buf), 17, 9, pwup, 0x87, 1000, 1);
+    CHECK(KeybusClient::parseLine(buf, strlen(buf) - 1, &ev));
+    CHECK(ev.type == KB_EV_PWUP);
+    CHECK(ev.addr == 17 && ev.len == 9);
+    CHECK(memcmp(ev.data, pwup, 9) == 0);
+
+    uint8_t unk[12];
+    for (uint8_t i=0; i < sizeof(unk); i++)
+        unk[i] = 0xf0 + i;
+    proto.keyMsg(buf, sizeof(buf), 23, sizeof(unk), unk, 0x44, 77, 3);
+    CHECK(KeybusClient::parseLine(buf, strlen(buf) - 1, &ev));
+    CHECK(ev.type == KB_EV_UNK);
+    CHECK(ev.addr == 23 && ev.len == sizeof(unk));
+    CHECK(memcmp(ev.data, unk, sizeof(unk)) == 0);
+    CHECK(ev.time == 77 && ev.seq == 3);
+}
+
+// POWER lines from powerMsg parse back to the same rail, state and level
+static void testPowerMsg(void)
+{
+    char buf[PRINT_BUF_SIZE];
+    t_KbEvent ev;
+
+    proto.powerMsg(buf, sizeof(buf), 2, true, 0x03e8, 4000000000u);
+    CHECK(strlen(buf) <= POWER_MSG_LEN);
+    CHECK(KeybusClient::parseLine(buf, strlen(buf) - 1, &ev));
+    CHECK(ev.type == KB_EV_POWER);
+    CHECK(ev.fail && ev.addr == 2 && ev.rail[0] == 0x03e8);
+
+    proto.powerMsg(buf, sizeof(buf), 0, false, 0x0148, 0);
+    CHECK(KeybusClient::parseLine(buf, strlen(buf) - 1, &ev));
+    CHECK(!ev.fail && ev.addr == 0 && ev.rail[0] == 0x0148);
+}
+
+// SYNC reply carries the token sent and the next key sequence number
+static void testSyncMsg(void)
+{
+    char buf[PRINT_BUF_SIZE];
+    t_KbEvent ev;
+
+    proto.init();
+    proto.nextKeySeq();
+    proto.nextKeySeq();
+    static const char cmd[] = "SYNC pi-0042";
+    CHECK(proto.parseRecv(cmd, strlen(cmd)) == USB_CMD_SYNC);
+    proto.syncMsg(buf, sizeof(buf), 987654);
+    CHECK(KeybusClient::parseLine(buf, strlen(buf) - 1, &ev));
+    CHECK(ev.type == KB_EV_SYNC);
+    CHECK(ev.args.len == 7 && memcmp(ev.args.p, "pi-0042", 7) == 0);
+    CHECK(ev.hasStamp && ev.time == 987654 && ev.seq == 2);
+}
+
+int main(void)
+{
+    testF7AllFields();
+    testF7ZoneTone();
+    testF7Partial();
+    testF7Text();
+    testF7AltPage();
+    testF7Errors();
+    testF7PageRoundTrip();
+    testKeyMsg();
+    testPowerMsg();
+    testSyncMsg();
+
+    printf("protoTest: %d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,192 @@
+// file ringBench.cpp - host benchmark for SpscRing
+//
+//   single  - one thread pushes and pops bytes through a 64 byte ring, as the keybus receive path
+//             does: SpscRing one at a time and in bulk, against the static buffer with volatile
+//             indexes and % that SoftwareSerial used before
+//   threads - a producer thread pushes a counting sequence through a 128 slot ring while the
+//             consumer checks that every value arrives once and in order.  Like the ISR/main
+//             loop handoff, but preempting at any instruction and on a second core if there is one
+//
+// build: make native
+// usage: ringBench [millions of items]
+
+#include "SpscRing.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define RING_BYTES   (64)   // _SS_MAX_RX_BUFF
+#define RING_SLOTS   (128)  // largest SpscRing
+#define BURST        (16)   // bytes per push/pop burst, about a keypad key mesg
+
+// seconds since an arbitrary start
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the receive buffer SoftwareSerial had before SpscRing, for comparison
+static uint8_t legacyBuf[RING_BYTES];
+static volatile uint8_t legacyTail = 0;
+static volatile uint8_t legacyHead = 0;
+
+static bool legacyPush(uint8_t d)
+{
+    uint8_t next = (legacyTail + 1) % RING_BYTES;
+    if (next == legacyHead)
+        return false;
+    legacyBuf[legacyTail] = d;
+    legacyTail = next;
+    return true;
+}
+
+static int legacyPop(void)
+{
+    if (legacyHead == legacyTail)
+        return -1;
+    uint8_t d = legacyBuf[legacyHead];
+    legacyHead = (legacyHead + 1) % RING_BYTES;
+    return d;
+}
+
+static int legacyAvailable(void)
+{
+    return (legacyTail + RING_BYTES - legacyHead) % RING_BYTES;
+}
+
+static void report(const char * name, uint64_t items, double secs, uint32_t sum)
+{
+    printf("  %-8s %.1f M bytes/s (sum %08x)\n", name, items / secs / 1e6, sum);
+}
+
+// push BURST bytes then pop them, the way a key mesg goes through the keybus receive ring
+static void benchSingle(uint64_t items)
+{
+    uint64_t bursts = items / BURST;
+    uint32_t sum;
+    double start;
+
+    printf("single thread, %d byte ring, %d byte bursts:\n", RING_BYTES, BURST);
+
+    sum = 0;
+    start = now();
+    for (uint64_t b=0; b < bursts; b++)
+    {
+        for (uint8_t i=0; i < BURST; i++)
+            legacyPush((uint8_t)(b + i));
+        while (legacyAvailable())
+            sum += legacyPop();
+    }
+    report("legacy", bursts * BURST, now() - start, sum);
+
+    SpscRing<uint8_t, RING_BYTES> ring;
+    sum = 0;
+    start = now();
+    for (uint64_t b=0; b < bursts; b++)
+    {
+        for (uint8_t i=0; i < BURST; i++)
+            ring.push((uint8_t)(b + i));
+        uint8_t d;
+        while (ring.pop(&d))
+            sum += d;
+    }
+    report("spsc", bursts * BURST, now() - start, sum);
+
+    sum = 0;
+    start = now();
+    for (uint64_t b=0; b < bursts; b++)
+    {
+        uint8_t in[BURST], out[BURST];
+        for (uint8_t i=0; i < BURST; i++)
+            in[i] = (uint8_t)(b + i);
+        ring.push(in, BURST);
+        uint8_t n = ring.pop(out, BURST);
+        for (uint8_t i=0; i < n; i++)
+            sum += out[i];
+    }
+    report("bulk", bursts * BURST, now() - start, sum);
+}
+
+typedef struct {
+    SpscRing<uint32_t, RING_SLOTS> ring;
+    uint64_t items;
+    bool     bulk;
+} t_Shared;
+
+// producer thread: push 0 .. items-1
+static void * producer(void * arg)
+{
+    t_Shared * s = (t_Shared *)arg;
+    uint64_t next = 0;
+
+    while (next < s->items)
+    {
+        if (s->bulk)
+        {
+            uint32_t v[BURST];
+            uint8_t n = s->items - next < BURST ? s->items - next : BURST;
+            for (uint8_t i=0; i < n; i++)
+                v[i] = (uint32_t)(next + i);
+            uint8_t pushed = s->ring.push(v, n);
+            next += pushed;
+            if (!pushed)
+                sched_yield();  // full, let the consumer run if there is only one core
+        }
+        else if (s->ring.push((uint32_t)next))
+        {
+            next++;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// consumer: pop everything, count values that are missing or out of order
+static void benchThreads(uint64_t items, bool bulk)
+{
+    t_Shared s;
+    s.items = items;
+    s.bulk = bulk;
+
+    pthread_t tid;
+    double start = now();
+    pthread_create(&tid, NULL, producer, &s);
+
+    uint64_t got = 0, errors = 0;
+    while (got < items)
+    {
+        uint32_t v[BURST];
+        uint8_t n = bulk ? s.ring.pop(v, BURST) : s.ring.pop(&v[0]);
+        if (!n)
+            sched_yield();  // empty, let the producer run if there is only one core
+        for (uint8_t i=0; i < n; i++, got++)
+        {
+            if (v[i] != (uint32_t)got)
+                errors++;
+        }
+    }
+    pthread_join(tid, NULL);
+    double secs = now() - start;
+
+    printf("  %-8s %.1f M items/s, %lu items, %lu errors\n", bulk ? "bulk" : "spsc", items / secs / 1e6,
+        (unsigned long)items, (unsigned long)errors);
+}
+
+int main(int argc, char ** argv)
+{
+    uint64_t items = (argc > 1 ? strtoul(argv[1], NULL, 0) : 50) * 1000000ULL;
+
+    benchSingle(items);
+    printf("two threads, %d slot ring of uint32_t:\n", RING_SLOTS);
+    benchThreads(items, false);
+    benchThreads(items, true);
+    return 0;
+}
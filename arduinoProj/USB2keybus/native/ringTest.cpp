@@ -0,0 +1,173 @@
+// file ringTest.cpp - unit tests for SpscRing
+//
+// Each case checks one edge of the ring: empty, full, the free running byte indexes wrapping at
+// 256, bulk push/pop that only fit in part, peek and clear.  A failed check prints its line and
+// the test exits with status 1, so make check fails.
+//
+// build and run: make check
+
+#include "SpscRing.h"
+
+#include <stdio.h>
+
+static int checks, failures;
+
+#define CHECK(cond) \
+    do { checks++; if (!(cond)) { failures++; printf("ringTest.cpp:%d: CHECK(%s) failed\n", __LINE__, #cond); } } while (0)
+
+// pop and peek on an empty ring find nothing
+static void testEmpty(void)
+{
+    SpscRing<uint8_t, 8> ring;
+    uint8_t d = 0x55, out[4];
+
+    CHECK(ring.available() == 0);
+    CHECK(ring.space() == 8);
+    CHECK(!ring.pop(&d));
+    CHECK(d == 0x55);               // left alone when empty
+    CHECK(ring.pop(out, 4) == 0);
+    CHECK(ring.peek() == NULL);
+}
+
+// a full ring takes N items and refuses the next
+static void testFull(void)
+{
+    SpscRing<uint8_t, 8> ring;
+
+    for (uint8_t i=0; i < 8; i++)
+        CHECK(ring.push(i));
+    CHECK(!ring.push(99));
+    CHECK(ring.available() == 8);
+    CHECK(ring.space() == 0);
+
+    uint8_t more[2] = { 98, 99 };
+    CHECK(ring.push(more, 2) == 0);
+
+    for (uint8_t i=0; i < 8; i++)
+    {
+        uint8_t d;
+        CHECK(ring.pop(&d) && d == i);
+    }
+    CHECK(ring.available() == 0);
+}
+
+// the largest ring: tail - head reaches 128 and still reads as full, not empty
+static void testFull128(void)
+{
+    SpscRing<uint16_t, 128> ring;
+    uint16_t d;
+
+    for (uint16_t i=0; i < 200; i++)  // move head and tail near the wrap at 256
+    {
+        ring.push(i);
+        ring.pop(&d);
+    }
+    for (uint16_t i=0; i < 128; i++)
+        CHECK(ring.push(1000 + i));
+    CHECK(!ring.push(0));
+    CHECK(ring.available() == 128);
+    CHECK(ring.space() == 0);
+    for (uint16_t i=0; i < 128; i++)
+        CHECK(ring.pop(&d) && d == 1000 + i);
+    CHECK(!ring.pop(&d));
+}
+
+// head and tail count past 255 and wrap, at every fill level
+static void testWrap(void)
+{
+    SpscRing<uint8_t, 4> ring;
+    uint16_t in = 0, out = 0;
+
+    for (uint16_t pass=0; pass < 1000; pass++)
+    {
+        uint8_t fill = (pass * 3) % 5;  // 0..4 items in the ring across the wrap
+        uint8_t d;
+        while (ring.available() > fill)
+            CHECK(ring.pop(&d) && d == (uint8_t)out++);
+        while (ring.available() < fill)
+            CHECK(ring.push((uint8_t)in++));
+        CHECK(ring.available() == fill);
+        CHECK(ring.space() == 4 - fill);
+    }
+    CHECK(in > 512);                // indexes went round more than twice
+    uint8_t d;
+    while (ring.pop(&d))
+        CHECK(d == (uint8_t)out++);
+    CHECK(out == in);
+}
+
+// bulk push and pop move what fits and say how much, also across the end of the array
+static void testBulk(void)
+{
+    SpscRing<uint8_t, 8> ring;
+    uint8_t in[8] = { 10, 11, 12, 13, 14, 15, 16, 17 };
+    uint8_t out[8];
+    uint8_t d;
+
+    for (uint8_t i=0; i < 6; i++)   // start the items at slot 6, so they wrap in the array
+    {
+        ring.push(i);
+        ring.pop(&d);
+    }
+    CHECK(ring.push(in, 5) == 5);
+    CHECK(ring.push(in + 5, 5) == 3);  // only 3 free
+    CHECK(ring.available() == 8);
+
+    CHECK(ring.pop(out, 3) == 3);
+    CHECK(out[0] == 10 && out[1] == 11 && out[2] == 12);
+    CHECK(ring.pop(out, 8) == 5);      // asks for more than there is
+    for (uint8_t i=0; i < 5; i++)
+        CHECK(out[i] == 13 + i);
+    CHECK(ring.pop(out, 8) == 0);
+    CHECK(ring.push(in, 0) == 0);
+}
+
+// peek returns the oldest item and leaves it in the ring
+static void testPeek(void)
+{
+    SpscRing<uint8_t, 4> ring;
+    uint8_t d;
+
+    ring.push(7);
+    ring.push(8);
+    CHECK(ring.peek() && *ring.peek() == 7);
+    CHECK(ring.available() == 2);
+    CHECK(ring.pop(&d) && d == 7);
+    CHECK(ring.peek() && *ring.peek() == 8);
+    CHECK(ring.pop(&d) && d == 8);
+    CHECK(ring.peek() == NULL);
+}
+
+// clear empties the ring and it works as new after
+static void testClear(void)
+{
+    SpscRing<uint8_t, 4> ring;
+    uint8_t d;
+
+    ring.push(1);
+    ring.push(2);
+    ring.push(3);
+    ring.clear();
+    CHECK(ring.available() == 0);
+    CHECK(ring.space() == 4);
+    CHECK(!ring.pop(&d));
+    CHECK(ring.peek() == NULL);
+    for (uint8_t i=0; i < 4; i++)
+        CHECK(ring.push(20 + i));
+    CHECK(!ring.push(0));
+    CHECK(ring.pop(&d) && d == 20);
+}
+
+int main(void)
+{
+    testEmpty();
+    testFull();
+    testFull128();
+    testWrap();
+    testBulk();
+    testPeek();
+    testClear();
+
+    printf("ringTest: %d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
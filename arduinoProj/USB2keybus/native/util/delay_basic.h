@@ -0,0 +1,7 @@
+// file delay_basic.h - native stand-in for util/delay_basic.h, callers busy-wait on micros()
+
+#pragma once
+
+#include <stdint.h>
+
+static inline void _delay_loop_2(uint16_t count)  {}
@@ -0,0 +1,491 @@
+// file keybusSim.c - run the USB2keybus firmware under simavr and profile it in cpu cycles
+//
+// The firmware writes profile markers to GPIOR0 (see Profile.h).  This harness timestamps each
+// marker write with the simulated cycle count and prints per-function cycle profiles at the end
+// of the run, along with a histogram of the latency from a keypad start bit to the recv ISR.
+//
+// Stimulus comes from a script file (see stimulus.txt).  The harness plays the part of the Pi on
+// UART0 and of a keypad on the keybus pins (D11 transmit, D12 receive, both inverted logic).
+//
+// build: make profile (needs simavr, libsimavr-dev and libelf-dev)
+// usage: keybusSim <firmware.elf> <stimulus file>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_irq.h>
+#include <simavr/sim_io.h>
+#include <simavr/sim_cycle_timers.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_uart.h>
+
+#define SIM_MCU          "atmega2560"
+#define SIM_FREQ         (16000000UL)
+#define US2CYC(us)       ((avr_cycle_count_t)(us) * (SIM_FREQ / 1000000UL))
+#define CYC2US(c)        ((double)(c) / (SIM_FREQ / 1000000UL))
+
+#define GPIOR0_ADDR      (0x3E)     // data space address of GPIOR0 on the mega2560
+#define PROF_EXIT_BIT    (0x80)     // must match Profile.h
+#define PROF_MAX_IDS     (16)
+#define PROF_STACK       (16)
+
+#define KP_BIT_CYC       (SIM_FREQ / 4800)  // one keybus bit in cycles
+#define KP_TX_PORT       'B'        // D11 -> PB5, arduino transmit to keypad
+#define KP_TX_PIN        (5)
+#define KP_RX_PORT       'B'        // D12 -> PB6, keypad transmit to arduino
+#define KP_RX_PIN        (6)
+
+#define USB_BYTE_US      (100)      // pace bytes sent to UART0 a bit slower than 115200 baud
+#define HIST_BUCKETS     (16)       // log2 buckets of ISR latency in cycles
+#define MAX_EVENTS       (256)
+#define MAX_WIRE_BITS    (512)
+
+// names for profile ids, index matches PROF_xxx in Profile.h
+static const char * profName[PROF_MAX_IDS] = {
+    "", "loop()", "recv ISR", "write() cli", "parseF7()", "keyMsg()"
+};
+
+typedef struct {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+} t_Prof;
+
+typedef struct {
+    uint8_t           id;
+    avr_cycle_count_t start;
+} t_ProfFrame;
+
+enum { EV_USB, EV_KEYS, EV_END };
+
+typedef struct {
+    uint32_t ms;
+    int      type;
+    uint8_t  addr;
+    char     text[128];
+} t_Event;
+
+static avr_t *     avr;
+static avr_irq_t * rxIrq;
+static avr_irq_t * uartIn;
+
+static t_Prof      prof[PROF_MAX_IDS];
+static t_ProfFrame profStack[PROF_STACK];
+static int         profDepth;
+
+static uint64_t    isrHist[HIST_BUCKETS];
+static avr_cycle_count_t rxStartCycle;   // cycle of the last start bit driven on rx, 0 if none pending
+
+static t_Event     events[MAX_EVENTS];
+static int         numEvents, nextEvent;
+static int         simDone;
+
+static char        usbOut[256];          // line buffer for text written by the firmware
+static int         usbOutLen;
+static char        usbIn[4096];          // bytes waiting to be sent to the firmware
+static int         usbInHead, usbInTail;
+
+// keypad model
+static uint8_t     txLevel;              // current level of the arduino transmit pin
+static avr_cycle_count_t txFallCycle;    // cycle when transmit last went low
+static int         pollPulse;            // 0 when not polling, else count of poll clock pulses
+static int         decBit = -1;          // bit being decoded from transmit, -1 when idle
+static uint16_t    decShift;
+static uint8_t     txnBuf[8];            // bytes decoded in the current keybus transaction
+static int         txnLen;
+static uint8_t     kpAddr;               // address of keypad with keys pending
+static uint8_t     kpKeys[16];
+static int         kpNumKeys;
+static uint8_t     wire[MAX_WIRE_BITS];  // rx line levels to drive, one per keybus bit
+static int         wireLen, wireIdx;
+
+// ------------------------------------------ profiling -----------------------------------------
+
+static void profWrite(struct avr_t * a, avr_io_addr_t addr, uint8_t v, void * param)
+{
+    a->data[addr] = v;
+
+    uint8_t id = v & ~PROF_EXIT_BIT;
+    if (id == 0 || id >= PROF_MAX_IDS)
+        return;
+
+    if (!(v & PROF_EXIT_BIT))
+    {
+        if (id == 2 && rxStartCycle)  // recv ISR entry, record latency from start bit
+        {
+            uint64_t lat = a->cycle - rxStartCycle;
+            int b = 0;
+            while (b < HIST_BUCKETS-1 && (lat >> (b+1)))
+                b++;
+            isrHist[b]++;
+            rxStartCycle = 0;
+        }
+        if (profDepth < PROF_STACK)
+        {
+            profStack[profDepth].id = id;
+            profStack[profDepth].start = a->cycle;
+            profDepth++;
+        }
+        return;
+    }
+
+    while (profDepth > 0)  // pop to matching enter (tolerates a missing exit)
+    {
+        t_ProfFrame * f = &profStack[--profDepth];
+        if (f->id == id)
+        {
+            uint64_t d = a->cycle - f->start;
+            t_Prof * p = &prof[id];
+            if (p->count == 0 || d < p->min)
+                p->min = d;
+            if (d > p->max)
+                p->max = d;
+            p->total += d;
+            p->count++;
+            break;
+        }
+    }
+}
+
+static void profReport(void)
+{
+    printf("\n%-12s %10s %10s %10s %10s %10s\n", "function", "count", "min cyc", "avg cyc", "max cyc", "max us");
+    for (int i=1; i < PROF_MAX_IDS; i++)
+    {
+        t_Prof * p = &prof[i];
+        if (p->count == 0)
+            continue;
+        printf("%-12s %10llu %10llu %10llu %10llu %10.1f\n", profName[i] ? profName[i] : "?",
+            (unsigned long long)p->count, (unsigned long long)p->min,
+            (unsigned long long)(p->total / p->count), (unsigned long long)p->max, CYC2US(p->max));
+    }
+
+    printf("\nrecv ISR latency (start bit -> ISR entry)\n");
+    for (int b=0; b < HIST_BUCKETS; b++)
+    {
+        if (isrHist[b])
+            printf("  %6u - %6u cyc : %llu\n", 1u << b, (2u << b) - 1, (unsigned long long)isrHist[b]);
+    }
+}
+
+// ------------------------------------------ usb side ------------------------------------------
+
+static void uartOut(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+    char c = (char)value;
+    if (c == '\n' || usbOutLen >= (int)sizeof(usbOut)-1)
+    {
+        usbOut[usbOutLen] = '\0';
+        if (usbOutLen)
+            printf("[%9.3f ms] usb> %s\n", CYC2US(avr->cycle) / 1000.0, usbOut);
+        usbOutLen = 0;
+    }
+    else if (c != '\r')
+    {
+        usbOut[usbOutLen++] = c;
+    }
+}
+
+static avr_cycle_count_t uartFeed(struct avr_t * a, avr_cycle_count_t when, void * param)
+{
+    if (usbInHead != usbInTail)
+    {
+        avr_raise_irq(uartIn, (uint8_t)usbIn[usbInHead]);
+        usbInHead = (usbInHead + 1) % sizeof(usbIn);
+    }
+    return when + US2CYC(USB_BYTE_US);
+}
+
+static void usbSend(const char * text)
+{
+    for (const char * s = text; *s; s++)
+    {
+        usbIn[usbInTail] = *s;
+        usbInTail = (usbInTail + 1) % sizeof(usbIn);
+    }
+    usbIn[usbInTail] = '\n';
+    usbInTail = (usbInTail + 1) % sizeof(usbIn);
+}
+
+// ------------------------------------------ keypad side ---------------------------------------
+
+// drive queued rx line levels, one per keybus bit
+static avr_cycle_count_t wireTick(struct avr_t * a, avr_cycle_count_t when, void * param)
+{
+    if (wireIdx >= wireLen)
+    {
+        avr_raise_irq(rxIrq, 0);  // idle level of rx is low
+        wireLen = wireIdx = 0;
+        return 0;
+    }
+    uint8_t level = wire[wireIdx++];
+    if (level && (wireIdx == 1 || !wire[wireIdx-2]))
+        rxStartCycle = a->cycle;  // rising edge starts a recv in the firmware
+    avr_raise_irq(rxIrq, level);
+    return when + KP_BIT_CYC;
+}
+
+static void wireBit(uint8_t level)
+{
+    if (wireLen < MAX_WIRE_BITS)
+        wire[wireLen++] = level;
+}
+
+// queue one byte on rx: inverted logic, high start bit, optional even parity, two stop bits
+static void wireByte(uint8_t b, int parity)
+{
+    uint8_t ones = 0;
+    wireBit(1);
+    for (int i=0; i < 8; i++)
+    {
+        uint8_t bit = (b >> i) & 0x01;
+        ones ^= bit;
+        wireBit(!bit);
+    }
+    if (parity)
+        wireBit(!ones);
+    wireBit(0);
+    wireBit(0);
+}
+
+static void wireStart(avr_cycle_count_t delayCyc)
+{
+    if (wireLen && wireIdx == 0)
+        avr_cycle_timer_register(avr, delayCyc, wireTick, NULL);
+}
+
+// keypad reply to an F6 request: addr, length, keys, checksum
+static void keypadReply(void)
+{
+    uint8_t msg[20];
+    uint8_t n = 0, sum = 0;
+
+    msg[n++] = kpAddr;
+    msg[n++] = kpNumKeys + 1;
+    for (int i=0; i < kpNumKeys; i++)
+        msg[n++] = kpKeys[i];
+    for (int i=0; i < n; i++)
+        sum += msg[i];
+    msg[n++] = 0x100 - sum;
+
+    for (int i=0; i < n; i++)
+        wireByte(msg[i], 1);
+    wireStart(US2CYC(1000));
+    kpNumKeys = 0;
+}
+
+// sample the transmit line in the middle of each bit of a byte written by the firmware
+static avr_cycle_count_t decodeTick(struct avr_t * a, avr_cycle_count_t when, void * param)
+{
+    decShift |= (uint16_t)(!txLevel) << decBit;  // inverted logic
+    if (++decBit < 10)                            // 8 data bits, parity, stop
+        return when + KP_BIT_CYC;
+
+    decBit = -1;
+    if (txLevel)      // stop bit must be low, otherwise this was the idle line going high
+        return 0;
+
+    if (txnLen < (int)sizeof(txnBuf))
+        txnBuf[txnLen++] = decShift & 0xFF;
+    // the request may follow an ack on a merged transaction (no new preamble), so match the last two bytes
+    if (txnLen >= 2 && txnBuf[txnLen-2] == 0xF6 && txnBuf[txnLen-1] == kpAddr && kpNumKeys)
+        keypadReply();
+    return 0;
+}
+
+static void txChange(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+    avr_cycle_count_t now = avr->cycle;
+    uint8_t level = value ? 1 : 0;
+    if (level == txLevel)
+        return;
+    txLevel = level;
+
+    if (!level)
+    {
+        txFallCycle = now;
+        return;
+    }
+
+    avr_cycle_count_t low = now - txFallCycle;
+
+    if (low > US2CYC(10000))           // long low starts a poll
+    {
+        pollPulse = 1;
+    }
+    else if (pollPulse && pollPulse < 3)
+    {
+        pollPulse++;
+    }
+    else if (pollPulse)                // rising edge after the third poll clock ends the poll
+    {
+        pollPulse = 0;
+        return;
+    }
+    else                               // start bit of a byte written to keypads
+    {
+        if (low > US2CYC(3000))        // preamble, new transaction
+            txnLen = 0;
+        if (decBit < 0)
+        {
+            decBit = 0;
+            decShift = 0;
+            avr_cycle_timer_register(avr, KP_BIT_CYC * 3 / 2, decodeTick, NULL);
+        }
+        return;
+    }
+
+    if (!kpNumKeys)                    // keypad only answers the poll when it has keys
+        return;
+
+    if (pollPulse < 3)
+    {
+        wireBit(1);                    // short pulse to clock the poll state
+        wireBit(0);
+    }
+    else
+    {
+        wireByte((uint8_t)~(1 << (kpAddr - 16)), 0);  // poll response, bit low for our address
+    }
+    wireStart(US2CYC(50));
+}
+
+// ------------------------------------------ stimulus ------------------------------------------
+
+static int loadScript(const char * fname)
+{
+    FILE * fp = fopen(fname, "r");
+    if (!fp)
+    {
+        perror(fname);
+        return -1;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof(line), fp) && numEvents < MAX_EVENTS)
+    {
+        t_Event * e = &events[numEvents];
+        char kind[8];
+        int  pos = 0;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '#' || sscanf(line, "%u %7s %n", &e->ms, kind, &pos) < 2)
+            continue;
+
+        if (!strcmp(kind, "usb"))
+        {
+            e->type = EV_USB;
+            snprintf(e->text, sizeof(e->text), "%s", line + pos);
+        }
+        else if (!strcmp(kind, "keys"))
+        {
+            unsigned addr;
+            e->type = EV_KEYS;
+            if (sscanf(line + pos, "%u %127s", &addr, e->text) != 2 || addr < 16 || addr > 23)
+            {
+                fprintf(stderr, "bad keys line: %s\n", line);
+                continue;
+            }
+            e->addr = addr;
+        }
+        else if (!strcmp(kind, "end"))
+        {
+            e->type = EV_END;
+        }
+        else
+        {
+            fprintf(stderr, "unknown stimulus: %s\n", line);
+            continue;
+        }
+        numEvents++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+static avr_cycle_count_t scriptTick(struct avr_t * a, avr_cycle_count_t when, void * param)
+{
+    uint32_t ms = (uint32_t)(CYC2US(a->cycle) / 1000);
+
+    while (nextEvent < numEvents && events[nextEvent].ms <= ms)
+    {
+        t_Event * e = &events[nextEvent++];
+        switch (e->type)
+        {
+        case EV_USB:
+            usbSend(e->text);
+            break;
+        case EV_KEYS:
+            kpAddr = e->addr;
+            kpNumKeys = 0;
+            for (const char * k = e->text; *k && kpNumKeys < 15; k++)
+                kpKeys[kpNumKeys++] = (*k >= '0' && *k <= '9') ? *k - '0' : (*k == '*' ? 0x0A : 0x0B);
+            break;
+        case EV_END:
+            simDone = 1;
+            break;
+        }
+    }
+    return when + US2CYC(1000);
+}
+
+// ------------------------------------------ main ----------------------------------------------
+
+int main(int argc, char * argv[])
+{
+    elf_firmware_t fw;
+
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <firmware.elf> <stimulus file>\n", argv[0]);
+        return 1;
+    }
+
+    memset(&fw, 0, sizeof(fw));
+    if (elf_read_firmware(argv[1], &fw) || loadScript(argv[2]))
+        return 1;
+    if (!fw.frequency)
+        fw.frequency = SIM_FREQ;
+
+    avr = avr_make_mcu_by_name(SIM_MCU);
+    if (!avr)
+    {
+        fprintf(stderr, "simavr has no %s core\n", SIM_MCU);
+        return 1;
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &fw);
+
+    avr_register_io_write(avr, GPIOR0_ADDR, profWrite, NULL);
+
+    uint32_t flags = 0;  // keep simavr from echoing the uart to stdout, we print it ourselves
+    avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+    flags &= ~AVR_UART_FLAG_STDIO;
+    avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+    uartIn = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uartOut, NULL);
+
+    rxIrq = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(KP_RX_PORT), KP_RX_PIN);
+    avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(KP_TX_PORT), KP_TX_PIN), txChange, NULL);
+    avr_raise_irq(rxIrq, 0);
+
+    avr_cycle_timer_register_usec(avr, 1000, scriptTick, NULL);
+    avr_cycle_timer_register_usec(avr, USB_BYTE_US, uartFeed, NULL);
+
+    int state = cpu_Running;
+    while (!simDone && state != cpu_Done && state != cpu_Crashed)
+        state = avr_run(avr);
+
+    printf("\nsimulated %.3f s, %llu cycles%s\n", CYC2US(avr->cycle) / 1e6,
+        (unsigned long long)avr->cycle, state == cpu_Crashed ? " (CPU CRASHED)" : "");
+    profReport();
+
+    avr_terminate(avr);
+    return state == cpu_Crashed ? 1 : 0;
+}